@@ -0,0 +1,312 @@
+/*
+ * libgoline: counts the code lines of Go source files, i.e. lines that hold
+ * anything besides comments and white space.
+ *
+ * All state lives in a goline_ctx. Contexts share nothing with each other,
+ * every allocation goes through the context's allocator, and no function
+ * prints or exits: failures come back as negative GOLINE_E* codes. A context
+ * may be used by several threads at once, except for goline_walk(),
+ * goline_visit(), goline_scan() and goline_tree(), which one thread at a time
+ * may use.
+ */
+#ifndef GOLINE_H
+#define GOLINE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return codes. errno is kept for GOLINE_EOPEN and GOLINE_EREAD. */
+enum {
+    GOLINE_OK = 0,
+    GOLINE_ENOMEM = -1,
+    GOLINE_EINVAL = -2,
+    GOLINE_EOPEN = -3,
+    GOLINE_EREAD = -4,
+    GOLINE_ESTOP = -5
+};
+
+/* goline_result.status: counted, or why the file was left out. */
+enum {
+    GOLINE_COUNTED,
+    GOLINE_SKIP_GENERATED,
+    GOLINE_SKIP_BUILD,
+    GOLINE_SKIP_TEST,
+    GOLINE_SKIP_BINARY,
+    GOLINE_SKIP_BAD_UTF8
+};
+
+/* goline_options.generated */
+enum {
+    GOLINE_GENERATED_ALL,
+    GOLINE_GENERATED_SKIP,
+    GOLINE_GENERATED_ONLY
+};
+
+/* goline_options.follow_symlinks */
+enum {
+    GOLINE_FOLLOW_NEVER,
+    GOLINE_FOLLOW_ONCE,
+    GOLINE_FOLLOW_ALWAYS
+};
+
+/*
+ * realloc() with a user pointer: size 0 frees ptr and returns NULL. NULL
+ * means the C library's allocator.
+ */
+typedef void *(*goline_alloc_fn)(void *user, void *ptr, size_t size);
+
+typedef struct {
+    goline_alloc_fn alloc;
+    void *alloc_user;
+    /* Files marked `// Code generated ... DO NOT EDIT.`: GOLINE_GENERATED_* */
+    int generated;
+    /* Leave out binary (NUL byte) and non-UTF-8 files; on by default. */
+    int check_text;
+    /*
+     * Count only files that `go build` compiles for the target. Filtering is
+     * on when any of the three is set; goos defaults to "linux" and goarch to
+     * the host's. tags is a comma- or space-separated list.
+     */
+    const char *goos;
+    const char *goarch;
+    const char *tags;
+    int skip_tests;
+    /* goline_walk(): GOLINE_FOLLOW_* (default always) and mount points. */
+    int follow_symlinks;
+    int one_file_system;
+    /*
+     * Buffers of at least split_threshold bytes are lexed by up to jobs
+     * threads. All calls on a context share jobs - 1 helper threads.
+     */
+    int jobs;
+    size_t split_threshold;
+} goline_options;
+
+typedef struct {
+    int status;
+    int generated;
+    long lines;
+    long bytes;
+    /* GOLINE_SKIP_BINARY, GOLINE_SKIP_BAD_UTF8: offset of the offending byte */
+    long invalid_offset;
+} goline_result;
+
+typedef struct goline_ctx goline_ctx;
+
+void goline_options_init(goline_options *opts);
+int goline_new(const goline_options *opts, goline_ctx **out);
+void goline_free(goline_ctx *ctx);
+
+/* Counts len bytes of Go source with the context's filters. */
+int goline_count_buffer(goline_ctx *ctx, const char *buf, size_t len, goline_result *out);
+int goline_count_file(goline_ctx *ctx, const char *path, goline_result *out);
+
+/* goline_walk() events */
+enum {
+    /* A directory, the root included, is about to be read. */
+    GOLINE_WALK_DIR,
+    /* A directory has been read; follows every GOLINE_WALK_DIR that was not pruned. */
+    GOLINE_WALK_LEAVE,
+    /* A regular .go file. */
+    GOLINE_WALK_FILE,
+    /* A directory or .go file left out because the visited set ran out of memory. */
+    GOLINE_WALK_UNTRACKED
+};
+
+/* Returned for GOLINE_WALK_DIR to skip that directory. */
+#define GOLINE_WALK_PRUNE 1
+
+typedef struct {
+    /* The root followed by the names below it. */
+    const char *path;
+    const char *name;
+    /* st_size of a file. */
+    long size;
+    /* 0 for the root, 1 for the entries in it, and so on. */
+    int depth;
+} goline_walk_entry;
+
+/*
+ * Returns 0 to go on, GOLINE_WALK_PRUNE for a GOLINE_WALK_DIR to skip it, or
+ * anything else to stop the walk, which then returns GOLINE_ESTOP. A
+ * directory's path stays valid until its GOLINE_WALK_LEAVE.
+ */
+typedef int (*goline_walk_fn)(void *user, int event, const goline_walk_entry *e);
+
+/*
+ * Walks root depth-first for directories and .go files, with the context's
+ * symlink and file-system options. Every directory and file is reported
+ * once, however many links lead to it. Nothing is read or counted;
+ * goline_scan() is a walk that counts.
+ */
+int goline_walk(goline_ctx *ctx, const char *root, goline_walk_fn fn, void *user);
+
+/*
+ * Records the file at path in the set goline_walk() keeps, for callers that
+ * list files themselves. Returns 1 for a regular file not seen since the last
+ * goline_walk(), 0 for one seen before or for anything but a regular file,
+ * GOLINE_EOPEN when path cannot be stat()ed, or GOLINE_ENOMEM when the set
+ * cannot record it.
+ */
+int goline_visit(goline_ctx *ctx, const char *path);
+
+/* 1 when name ends in .go, in any letter case, as goline_walk() expects. */
+int goline_is_go_file(const char *name);
+
+/*
+ * Called for every .go file goline_scan() finds, with rc GOLINE_OK and the
+ * result, or the negative code of a file that could not be read. A nonzero
+ * return stops the scan, which then returns GOLINE_ESTOP.
+ */
+typedef int (*goline_file_fn)(void *user, const char *path, int rc, const goline_result *res);
+
+/*
+ * Walks root for .go files, counts them and sums the counted ones per
+ * directory into the context's tree, replacing that of an earlier scan.
+ * fn may be NULL.
+ */
+int goline_scan(goline_ctx *ctx, const char *root, goline_file_fn fn, void *user);
+
+typedef struct goline_dir {
+    const char *name;
+    /* Relative to the scan root; "" for the root itself. */
+    const char *path;
+    long lines;
+    long generated_lines;
+    long bytes;
+    long files;
+    /* Subdirectories holding counted files, sorted by name. */
+    struct goline_dir **dirs;
+    size_t ndirs;
+} goline_dir;
+
+/* The tree of the last goline_scan(), or NULL before one has finished. */
+const goline_dir *goline_tree(const goline_ctx *ctx);
+
+/*
+ * Building blocks for callers that do their own I/O. The goline_count_lines*
+ * functions count a buffer with no filters applied.
+ */
+
+/* Code lines in code[0, len). readable >= len bytes may be loaded, which spares the tail loop. */
+long goline_count_lines(const char *code, size_t len, size_t readable);
+
+/* Counts up to GOLINE_INTERLEAVE buffers in one pass, overlapping their load latencies. */
+#define GOLINE_INTERLEAVE 4
+void goline_count_lines_n(const char *const *bufs, const long *lens, long *counts, int n);
+
+/*
+ * Counts one large buffer in up to nchunks threads, taking the helpers from
+ * the context's shared budget of jobs - 1. Uses fewer threads when the budget,
+ * threads or memory run out.
+ */
+long goline_count_lines_split(goline_ctx *ctx, const char *code, size_t len, int nchunks);
+
+/*
+ * Threads the context would split a len-byte buffer across: 1 below
+ * split_threshold, otherwise one per MiB up to jobs.
+ */
+int goline_split_chunks(const goline_ctx *ctx, size_t len);
+
+/*
+ * Copies code[0, len) to out without its comments, keeping the newlines
+ * inside them, so out has the same code lines. out has room for cap bytes;
+ * len + 1 is always enough. Returns the length of out, which is
+ * NUL-terminated when there is room.
+ */
+long goline_strip_comments(const char *code, size_t len, char *out, size_t cap);
+
+/* Non-blank lines of comment-free code such as goline_strip_comments() output. */
+long goline_count_code_lines(const char *code, size_t len);
+
+#define GOLINE_FUNC_NAME_MAX 128
+
+/* A top-level function or method found by goline_strip_funcs(). */
+typedef struct {
+    /* Source line of `func` and code lines spanned. */
+    long line;
+    long lines;
+    /* 1 + its decision points, when complexity was asked for. */
+    long complexity;
+    /* The declaration is out[start, end) of the stripped code. */
+    long start;
+    long end;
+    /* "Name", or "Recv.Name" for a method. */
+    char name[GOLINE_FUNC_NAME_MAX];
+} goline_func;
+
+typedef struct {
+    goline_func *funcs;
+    size_t nfuncs;
+    /* Decision points of the whole buffer, inside functions or not. */
+    long decisions;
+} goline_funcs;
+
+/*
+ * goline_strip_comments() that also records the top-level functions and
+ * methods, and with complexity set counts decision points the way gocyclo
+ * does (if, for, case, && and ||). funcs->funcs comes from the context's
+ * allocator and is released with goline_funcs_free(). Returns the length of
+ * out or GOLINE_ENOMEM.
+ */
+long goline_strip_funcs(goline_ctx *ctx, const char *code, size_t len, char *out, size_t cap,
+                        int complexity, goline_funcs *funcs);
+void goline_funcs_free(goline_ctx *ctx, goline_funcs *funcs);
+
+/*
+ * Reads up to want bytes from fd, retrying after signals. A short read is
+ * taken as the end of a regular file, so asking for one byte more than its
+ * expected size costs no second system call. Returns the bytes read, or -1
+ * with errno set.
+ */
+long goline_read(int fd, char *buf, size_t want);
+
+/*
+ * Checks buf[*pos, len) for NUL bytes and malformed UTF-8. Unless complete,
+ * a sequence cut off at len is left for the next call. Returns
+ * GOLINE_COUNTED when the text is fine, otherwise GOLINE_SKIP_BINARY or
+ * GOLINE_SKIP_BAD_UTF8 with *pos at the offending byte.
+ */
+int goline_text_check(const char *buf, size_t len, int complete, size_t *pos);
+
+/* 3 when buf starts with a UTF-8 byte order mark, which is not code; else 0. */
+size_t goline_bom_len(const char *buf, size_t len);
+
+/*
+ * Looks for the generated-code marker before the package clause of buf
+ * (after any byte order mark). Sets *decided once the prefix was enough to
+ * tell; with to_package set, reading goes on to the package clause so that
+ * build constraints can be checked on the same prefix. Returns 1 when
+ * generated.
+ */
+int goline_scan_header(const char *buf, size_t len, int complete, int to_package, int *decided);
+
+/*
+ * Applies the generated-file filter and the //go:build or // +build lines of
+ * a header read by goline_scan_header(). Returns GOLINE_COUNTED,
+ * GOLINE_SKIP_GENERATED or GOLINE_SKIP_BUILD.
+ */
+int goline_header_status(goline_ctx *ctx, int generated, const char *code, size_t len);
+
+/*
+ * Checks a path by its file name alone: _test.go files with skip_tests, and
+ * for a build target names starting with '_' or '.' and GOOS/GOARCH suffixes.
+ * Returns GOLINE_COUNTED, GOLINE_SKIP_TEST or GOLINE_SKIP_BUILD.
+ */
+int goline_name_status(const goline_ctx *ctx, const char *path);
+
+/* 1 when a build target is set, so headers are read up to the package clause. */
+int goline_build_filtering(const goline_ctx *ctx);
+
+int goline_known_os(const char *goos);
+int goline_known_arch(const char *goarch);
+const char *goline_host_arch(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,2141 @@
+// src/linux/libgoline.c
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "goline.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define SPLIT_MIN_CHUNK (1L << 20)
+#define DEFAULT_SPLIT_THRESHOLD (32L << 20)
+#define BUILD_CACHE_INIT 64
+#define VISITED_INIT 1024
+
+/*
+ * Constraint lines repeat across thousands of files (`//go:build unix`), so
+ * results are memoized by the constraint text. The table is small and only
+ * touched once per file, so a single lock is enough.
+ */
+typedef struct {
+    char *key;
+    size_t len;
+    int ok;
+} BuildCacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    BuildCacheEntry *slots;
+    size_t capacity;
+    size_t count;
+} BuildCache;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int used;
+} Visited;
+
+typedef struct DirNode {
+    goline_dir pub;
+    size_t dirs_cap;
+} DirNode;
+
+struct goline_ctx {
+    goline_options opts;
+    char *goos;
+    char *goarch;
+    char *tags;
+    BuildCache build_cache;
+    DirNode *tree;
+    int tree_done;
+    Visited *visited;
+    size_t visited_cap;
+    size_t visited_count;
+    dev_t root_dev;
+    /* Helper threads split lexing may still start, shared by all callers. */
+    int split_budget;
+};
+
+static void *libc_alloc(void *user, void *ptr, size_t size) {
+    (void)user;
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, size);
+}
+
+static void *ctx_alloc(goline_ctx *ctx, void *ptr, size_t size) {
+    return ctx->opts.alloc(ctx->opts.alloc_user, ptr, size);
+}
+
+static void ctx_free(goline_ctx *ctx, void *ptr) {
+    if (ptr)
+        ctx->opts.alloc(ctx->opts.alloc_user, ptr, 0);
+}
+
+static char *ctx_strdup(goline_ctx *ctx, const char *s) {
+    size_t len = strlen(s);
+    char *copy = (char*)ctx_alloc(ctx, NULL, len + 1);
+    if (copy)
+        memcpy(copy, s, len + 1);
+    return copy;
+}
+
+#if defined(__SSE2__)
+static inline unsigned byte_mask(__m128i v, char c) {
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+#endif
+
+/*
+ * strip_comments() + count_code_lines() expressed as a byte-at-a-time
+ * DFA that only tracks line counts. The lookahead the serial lexer does on
+ * '/', '*' and '\\' becomes explicit states, so a chunk can end anywhere.
+ */
+enum {
+    LX_CODE,
+    LX_LINE_COMMENT,
+    LX_BLOCK_COMMENT,
+    LX_STRING,
+    LX_RAW_STRING,
+    LX_RUNE,
+    LX_CODE_SLASH,
+    LX_BLOCK_STAR,
+    LX_STRING_ESC,
+    LX_RUNE_ESC,
+    LX_NUM_STATES
+};
+
+#define LX_NUM_LANES (LX_NUM_STATES * 2)
+
+typedef struct {
+    int state;
+    int in_line;
+    long count;
+} LexCursor;
+
+static inline void lex_emit(LexCursor *lc, unsigned char c) {
+    if (c == '\n') {
+        lc->count += lc->in_line;
+        lc->in_line = 0;
+    } else if (c != ' ' && c != '\t' && c != '\r') {
+        lc->in_line = 1;
+    }
+}
+
+static inline void lex_step(LexCursor *lc, unsigned char c) {
+    switch (lc->state) {
+        case LX_CODE_SLASH:
+            if (c == '/') {
+                lc->state = LX_LINE_COMMENT;
+                return;
+            }
+            if (c == '*') {
+                lc->state = LX_BLOCK_COMMENT;
+                return;
+            }
+            lex_emit(lc, '/');
+            lc->state = LX_CODE;
+            /* fall through */
+        case LX_CODE:
+            if (c == '/') {
+                lc->state = LX_CODE_SLASH;
+                return;
+            }
+            if (c == '"')
+                lc->state = LX_STRING;
+            else if (c == '`')
+                lc->state = LX_RAW_STRING;
+            else if (c == '\'')
+                lc->state = LX_RUNE;
+            lex_emit(lc, c);
+            return;
+        case LX_LINE_COMMENT:
+            if (c == '\n') {
+                lex_emit(lc, c);
+                lc->state = LX_CODE;
+            }
+            return;
+        case LX_BLOCK_STAR:
+            if (c == '/') {
+                lc->state = LX_CODE;
+                return;
+            }
+            lc->state = LX_BLOCK_COMMENT;
+            /* fall through */
+        case LX_BLOCK_COMMENT:
+            if (c == '\n')
+                lex_emit(lc, c);
+            else if (c == '*')
+                lc->state = LX_BLOCK_STAR;
+            return;
+        case LX_STRING:
+            if (c == '\\')
+                lc->state = LX_STRING_ESC;
+            else if (c == '"')
+                lc->state = LX_CODE;
+            lex_emit(lc, c);
+            return;
+        case LX_STRING_ESC:
+            lc->state = LX_STRING;
+            lex_emit(lc, c);
+            return;
+        case LX_RAW_STRING:
+            if (c == '`')
+                lc->state = LX_CODE;
+            lex_emit(lc, c);
+            return;
+        case LX_RUNE:
+            if (c == '\\')
+                lc->state = LX_RUNE_ESC;
+            else if (c == '\'')
+                lc->state = LX_CODE;
+            lex_emit(lc, c);
+            return;
+        case LX_RUNE_ESC:
+            lc->state = LX_RUNE;
+            lex_emit(lc, c);
+            return;
+    }
+}
+
+static inline long lex_finish(LexCursor *lc) {
+    if (lc->state == LX_CODE_SLASH)
+        lex_emit(lc, '/');
+    return lc->count + lc->in_line;
+}
+
+/*
+ * Table-driven form of the same lexer for plain line counting. Bytes map to
+ * one of LX_NUM_CLASSES classes; a DFA state is (lexer state, in_line) and
+ * its table row is stored pre-multiplied by LX_NUM_CLASSES, so each byte is
+ * two loads, an add and a mask with no data-dependent branch. Bit 8 of an
+ * entry is set when the step completes a non-empty line. The tables are
+ * generated from lex_step() itself, so both forms agree by construction.
+ */
+enum {
+    LC_OTHER,
+    LC_SPACE,
+    LC_NEWLINE,
+    LC_SLASH,
+    LC_STAR,
+    LC_QUOTE,
+    LC_BACKQUOTE,
+    LC_APOSTROPHE,
+    LC_BACKSLASH,
+    LX_NUM_CLASSES
+};
+
+/* Built once from lex_step() and read-only afterwards. */
+static unsigned char g_lex_class[256];
+static uint16_t g_lex_next[LX_NUM_LANES * LX_NUM_CLASSES];
+static pthread_once_t g_lex_tables_once = PTHREAD_ONCE_INIT;
+
+static void lex_tables_build(void) {
+    static const unsigned char sample[LX_NUM_CLASSES] = { 'x', ' ', '\n', '/', '*', '"', '`', '\'', '\\' };
+    for (int c = 0; c < 256; c++)
+        g_lex_class[c] = LC_OTHER;
+    g_lex_class[' '] = g_lex_class['\t'] = g_lex_class['\r'] = LC_SPACE;
+    for (int k = LC_NEWLINE; k < LX_NUM_CLASSES; k++)
+        g_lex_class[sample[k]] = (unsigned char)k;
+    for (int s = 0; s < LX_NUM_LANES; s++) {
+        for (int k = 0; k < LX_NUM_CLASSES; k++) {
+            LexCursor lc = { s / 2, s % 2, 0 };
+            lex_step(&lc, sample[k]);
+            int next = lc.state * 2 + lc.in_line;
+            g_lex_next[s * LX_NUM_CLASSES + k] = (uint16_t)((next * LX_NUM_CLASSES) | (lc.count << 8));
+        }
+    }
+}
+
+static inline void lex_tables_init(void) {
+    pthread_once(&g_lex_tables_once, lex_tables_build);
+}
+
+static inline long lex_table_finish(unsigned s, long count) {
+    s /= LX_NUM_CLASSES;
+    /* A trailing '/' is code; otherwise the open line counts if it has any. */
+    if (s / 2 == LX_CODE_SLASH)
+        return count + 1;
+    return count + (long)(s % 2);
+}
+
+static long count_lines_table(const unsigned char *p, long len) {
+    unsigned s = 0;
+    long count = 0;
+    for (long i = 0; i < len; i++) {
+        unsigned e = g_lex_next[s + g_lex_class[p[i]]];
+        count += e >> 8;
+        s = e & 0xff;
+    }
+    return lex_table_finish(s, count);
+}
+
+/*
+ * Counts up to GOLINE_INTERLEAVE independent buffers in one loop. The per-byte
+ * state chains do not depend on each other, so their load latencies overlap.
+ */
+static void count_lines_interleaved(const unsigned char *const *bufs, const long *lens, long *counts, int n) {
+    unsigned s[GOLINE_INTERLEAVE] = { 0 };
+    long cnt[GOLINE_INTERLEAVE] = { 0 };
+    const unsigned char *p[GOLINE_INTERLEAVE];
+    if (n == 1) {
+        counts[0] = count_lines_table(bufs[0], lens[0]);
+        return;
+    }
+    long common = n > 0 ? lens[0] : 0;
+    for (int k = 0; k < GOLINE_INTERLEAVE; k++) {
+        p[k] = k < n ? bufs[k] : bufs[0];
+        if (k < n && lens[k] < common)
+            common = lens[k];
+    }
+    for (long i = 0; i < common; i++) {
+        for (int k = 0; k < GOLINE_INTERLEAVE; k++) {
+            unsigned e = g_lex_next[s[k] + g_lex_class[p[k][i]]];
+            cnt[k] += e >> 8;
+            s[k] = e & 0xff;
+        }
+    }
+    for (int k = 0; k < n; k++) {
+        for (long i = common; i < lens[k]; i++) {
+            unsigned e = g_lex_next[s[k] + g_lex_class[p[k][i]]];
+            cnt[k] += e >> 8;
+            s[k] = e & 0xff;
+        }
+        counts[k] = lex_table_finish(s[k], cnt[k]);
+    }
+}
+
+/*
+ * count_lines_table() that skips ahead 16 bytes at a time with SSE2 wherever
+ * the DFA would stay put: inside a non-empty code line, a comment or a
+ * literal, only a handful of bytes (newline, quotes, '/', '*', '\\') can
+ * change the state, so those are found by byte compares and only they take a
+ * table step. Loads may reach up to limit >= len, so a caller with readable
+ * padding after the buffer gets no scalar tail.
+ */
+#define LX_LANE(state, in_line) (((state) * 2 + (in_line)) * LX_NUM_CLASSES)
+
+#if defined(__SSE2__)
+static inline long lex_skip_to(const unsigned char *p, long i, long len, long limit, unsigned s) {
+    for (; i + 16 <= limit && i < len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        unsigned stop = byte_mask(v, '\n');
+        switch (s) {
+            case LX_LANE(LX_CODE, 1):
+                stop |= byte_mask(v, '/') | byte_mask(v, '"') | byte_mask(v, '`') | byte_mask(v, '\'');
+                break;
+            case LX_LANE(LX_BLOCK_COMMENT, 0):
+            case LX_LANE(LX_BLOCK_COMMENT, 1):
+                stop |= byte_mask(v, '*');
+                break;
+            case LX_LANE(LX_STRING, 1):
+                stop |= byte_mask(v, '"') | byte_mask(v, '\\');
+                break;
+            case LX_LANE(LX_RAW_STRING, 1):
+                stop |= byte_mask(v, '`');
+                break;
+            case LX_LANE(LX_RUNE, 1):
+                stop |= byte_mask(v, '\'') | byte_mask(v, '\\');
+                break;
+        }
+        if (stop)
+            return i + __builtin_ctz(stop) < len ? i + __builtin_ctz(stop) : len;
+    }
+    return i < len ? i : len;
+}
+
+static inline int lex_lane_skips(unsigned s) {
+    return s == LX_LANE(LX_CODE, 1) || s == LX_LANE(LX_LINE_COMMENT, 0) || s == LX_LANE(LX_LINE_COMMENT, 1) ||
+           s == LX_LANE(LX_BLOCK_COMMENT, 0) || s == LX_LANE(LX_BLOCK_COMMENT, 1) ||
+           s == LX_LANE(LX_STRING, 1) || s == LX_LANE(LX_RAW_STRING, 1) || s == LX_LANE(LX_RUNE, 1);
+}
+#endif
+
+static long count_lines_skip(const unsigned char *p, long len, long limit) {
+    unsigned s = 0;
+    long count = 0;
+    long i = 0;
+    while (i < len) {
+    #if defined(__SSE2__)
+        if (lex_lane_skips(s)) {
+            i = lex_skip_to(p, i, len, limit, s);
+            if (i == len)
+                break;
+        }
+    #endif
+        unsigned e = g_lex_next[s + g_lex_class[p[i++]]];
+        count += e >> 8;
+        s = e & 0xff;
+    }
+    (void)limit;
+    return lex_table_finish(s, count);
+}
+
+/*
+ * Transfer function of one chunk: for every (lexer state, in_line) it could
+ * start in, the state it ends in and the lines it completes.
+ */
+typedef struct {
+    const char *data;
+    long len;
+    LexCursor lanes[LX_NUM_LANES];
+} ChunkLex;
+
+static void lex_chunk_all_states(ChunkLex *ck) {
+    LexCursor *lanes = ck->lanes;
+    int alias[LX_NUM_LANES];
+    long offset[LX_NUM_LANES];
+    int active[LX_NUM_LANES];
+    int nactive = LX_NUM_LANES;
+    for (int l = 0; l < LX_NUM_LANES; l++) {
+        lanes[l].state = l / 2;
+        lanes[l].in_line = l % 2;
+        lanes[l].count = 0;
+        alias[l] = -1;
+        offset[l] = 0;
+        active[l] = l;
+    }
+
+    const unsigned char *p = (const unsigned char*)ck->data;
+    long i = 0;
+    for (; i < ck->len && nactive > 1; i++) {
+        unsigned char c = p[i];
+        for (int a = 0; a < nactive; a++)
+            lex_step(&lanes[active[a]], c);
+        if (c != '\n')
+            continue;
+        /* Lanes that reached the same (state, in_line) behave identically from here on. */
+        int kept = 0;
+        for (int a = 0; a < nactive; a++) {
+            int l = active[a];
+            int merged = 0;
+            for (int b = 0; b < kept; b++) {
+                int r = active[b];
+                if (lanes[r].state == lanes[l].state && lanes[r].in_line == lanes[l].in_line) {
+                    alias[l] = r;
+                    offset[l] = lanes[l].count - lanes[r].count;
+                    merged = 1;
+                    break;
+                }
+            }
+            if (!merged)
+                active[kept++] = l;
+        }
+        nactive = kept;
+    }
+    LexCursor *last = &lanes[active[0]];
+    for (; i < ck->len; i++)
+        lex_step(last, p[i]);
+
+    /* Resolve merged lanes in merge order: a representative may itself have merged later. */
+    for (int pass = 0; pass < LX_NUM_LANES; pass++) {
+        int changed = 0;
+        for (int l = 0; l < LX_NUM_LANES; l++) {
+            int r = alias[l];
+            if (r < 0 || alias[r] >= 0)
+                continue;
+            lanes[l].state = lanes[r].state;
+            lanes[l].in_line = lanes[r].in_line;
+            lanes[l].count = lanes[r].count + offset[l];
+            alias[l] = -1;
+            changed = 1;
+        }
+        if (!changed)
+            break;
+    }
+}
+
+static void *lex_chunk_thread(void *arg) {
+    lex_chunk_all_states((ChunkLex*)arg);
+    return NULL;
+}
+
+/*
+ * Counts code lines of a large buffer by lexing chunks in parallel from every
+ * possible starting state, then composing the chunk transfer functions left to
+ * right from the initial state. Equal to strip_comments() followed by
+ * count_code_lines() on the whole buffer.
+ */
+static long count_lines_chunked(goline_ctx *ctx, const char *input, long size, int nchunks) {
+    ChunkLex *chunks = (ChunkLex*)ctx_alloc(ctx, NULL, nchunks * sizeof(ChunkLex));
+    pthread_t *threads = (pthread_t*)ctx_alloc(ctx, NULL, nchunks * sizeof(pthread_t));
+    int *started = (int*)ctx_alloc(ctx, NULL, nchunks * sizeof(int));
+    if (!chunks || !threads || !started) {
+        ctx_free(ctx, chunks);
+        ctx_free(ctx, threads);
+        ctx_free(ctx, started);
+        LexCursor lc = { LX_CODE, 0, 0 };
+        for (long i = 0; i < size; i++)
+            lex_step(&lc, (unsigned char)input[i]);
+        return lex_finish(&lc);
+    }
+
+    memset(started, 0, nchunks * sizeof(int));
+    long per = size / nchunks;
+    for (int k = 0; k < nchunks; k++) {
+        chunks[k].data = input + (long)k * per;
+        chunks[k].len = (k == nchunks - 1) ? size - (long)k * per : per;
+    }
+    for (int k = 1; k < nchunks; k++)
+        started[k] = pthread_create(&threads[k], NULL, lex_chunk_thread, &chunks[k]) == 0;
+    lex_chunk_all_states(&chunks[0]);
+    for (int k = 1; k < nchunks; k++) {
+        if (started[k])
+            pthread_join(threads[k], NULL);
+        else
+            lex_chunk_all_states(&chunks[k]);
+    }
+
+    LexCursor cur = { LX_CODE, 0, 0 };
+    for (int k = 0; k < nchunks; k++) {
+        const LexCursor *t = &chunks[k].lanes[cur.state * 2 + cur.in_line];
+        cur.count += t->count;
+        cur.state = t->state;
+        cur.in_line = t->in_line;
+    }
+    ctx_free(ctx, chunks);
+    ctx_free(ctx, threads);
+    ctx_free(ctx, started);
+    return lex_finish(&cur);
+}
+
+/* Takes up to want helper threads from the context's budget. */
+static int split_reserve(goline_ctx *ctx, int want) {
+    int avail = __atomic_load_n(&ctx->split_budget, __ATOMIC_RELAXED);
+    for (;;) {
+        int take = avail < want ? avail : want;
+        if (take <= 0)
+            return 0;
+        if (__atomic_compare_exchange_n(&ctx->split_budget, &avail, avail - take, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return take;
+    }
+}
+
+/*
+ * Each chunk after the first needs a helper thread from the budget, so
+ * callers that split at the same time never start more than jobs - 1
+ * helpers between them.
+ */
+static long count_lines_parallel(goline_ctx *ctx, const char *input, long size, int nchunks) {
+    int helpers = split_reserve(ctx, nchunks - 1);
+    if (helpers == 0)
+        return goline_count_lines(input, (size_t)size, (size_t)size);
+    nchunks = helpers + 1;
+    long lines = count_lines_chunked(ctx, input, size, nchunks);
+    __atomic_fetch_add(&ctx->split_budget, helpers, __ATOMIC_RELEASE);
+    return lines;
+}
+
+/*
+ * The copying lexer behind goline_strip_comments() and goline_strip_funcs(),
+ * for callers that need the comment-free text and not only its line count.
+ */
+static long count_code_lines(const char *str, long length) {
+    long count = 0;
+    int in_line = 0;
+    long i = 0;
+    #if defined(__AVX2__)
+        for (; i <= length - 32; i += 32) {
+            int nl_mask;
+            __asm__ volatile (
+                "vmovdqu (%[str], %[i], 1), %%ymm0\n\t"
+                "vpcmpeqb $0x0A, %%ymm0, %%ymm1\n\t"  // Compare with newline (0x0A)
+                "vpmovmskb %%ymm1, %%eax\n\t"          // Create mask from comparison
+                : "=a" (nl_mask)
+                : [str] "r" (str), [i] "r" (i)
+                : "ymm0", "ymm1", "memory"
+            );
+            for (int j = 0; j < 32; j++) {
+                char c = str[i+j];
+                if (c == '\n') {
+                    if (in_line)
+                        count++;
+                    in_line = 0;
+                } else if (c != ' ' && c != '\t' && c != '\r') {
+                    in_line = 1;
+                }
+            }
+        }
+    #endif
+    for (; i < length; i++) {
+        char c = str[i];
+        if (c == '\n') {
+            if (in_line)
+                count++;
+            in_line = 0;
+        } else if (c != ' ' && c != '\t' && c != '\r') {
+            in_line = 1;
+        }
+    }
+    if (in_line)
+        count++;
+    return count;
+}
+
+/*
+ * Brace tracking state for goline_strip_funcs(). Only code bytes reach
+ * the tracker, so braces inside strings and comments are ignored. With
+ * complexity set it also counts decision points.
+ */
+typedef struct {
+    goline_ctx *ctx;
+    goline_func *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+    int depth;
+    int pending;
+    int in_body;
+    int paren;
+    int lit;
+    long start;
+    int complexity;
+    long decisions;
+    long start_decisions;
+} FuncTracker;
+
+static inline int is_ident_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+/* True if the code before pos ends with the keyword `struct` or `interface`. */
+static int follows_type_keyword(const char *out, long pos) {
+    while (pos > 0 && (out[pos - 1] == ' ' || out[pos - 1] == '\t' ||
+                       out[pos - 1] == '\n' || out[pos - 1] == '\r'))
+        pos--;
+    long end = pos;
+    while (pos > 0 && is_ident_byte((unsigned char)out[pos - 1]))
+        pos--;
+    long len = end - pos;
+    return (len == 6 && memcmp(out + pos, "struct", 6) == 0) ||
+           (len == 9 && memcmp(out + pos, "interface", 9) == 0);
+}
+
+static void func_track(FuncTracker *ft, unsigned char c, const char *input, long i, long size,
+                       const char *output, long out_len) {
+    switch (c) {
+        case 'f':
+            /* A declaration starts with `func` in column 0 at brace depth 0. */
+            if (ft->depth == 0 && (out_len == 0 || output[out_len - 1] == '\n') &&
+                i + 3 <= size && memcmp(input + i, "unc", 3) == 0 &&
+                (i + 3 == size || !is_ident_byte((unsigned char)input[i + 3]))) {
+                ft->pending = 1;
+                ft->paren = 0;
+                ft->lit = 0;
+                ft->start = out_len;
+                ft->start_decisions = ft->decisions;
+            }
+            break;
+        case '\n':
+        case ';':
+            /* A declaration without a body (an assembly stub) ends at its line or semicolon. */
+            if (ft->pending && ft->paren == 0 && ft->lit == 0)
+                ft->pending = 0;
+            break;
+        case '(':
+            if (ft->pending)
+                ft->paren++;
+            break;
+        case ')':
+            if (ft->pending && ft->paren > 0)
+                ft->paren--;
+            break;
+        case '{':
+            if (ft->pending && ft->paren == 0) {
+                if (ft->lit == 0 && !follows_type_keyword(output, out_len)) {
+                    ft->pending = 0;
+                    ft->in_body = 1;
+                } else {
+                    ft->lit++;
+                }
+            }
+            ft->depth++;
+            break;
+        case '}':
+            if (ft->depth > 0)
+                ft->depth--;
+            if (ft->pending && ft->paren == 0 && ft->lit > 0)
+                ft->lit--;
+            if (ft->in_body && ft->depth == 0) {
+                ft->in_body = 0;
+                if (ft->size == ft->capacity) {
+                    size_t new_cap = ft->capacity ? ft->capacity * 2 : 16;
+                    goline_func *data = (goline_func*)ctx_alloc(ft->ctx, ft->data, new_cap * sizeof(goline_func));
+                    if (!data) {
+                        ft->failed = 1;
+                        break;
+                    }
+                    ft->data = data;
+                    ft->capacity = new_cap;
+                }
+                goline_func *fs = &ft->data[ft->size++];
+                memset(fs, 0, sizeof(*fs));
+                fs->start = ft->start;
+                fs->end = out_len + 1;
+                fs->complexity = 1 + ft->decisions - ft->start_decisions;
+            }
+            break;
+    }
+}
+
+/*
+ * Decision points as gocyclo counts them: `if`, `for`, `case` (switch and
+ * select) and the operators && and ||. c is a code byte, input[i] the byte
+ * after it and output[out_len - 1] the code byte before it.
+ */
+static inline void count_decision(FuncTracker *ft, unsigned char c, const char *input, long i, long size,
+                                  const char *output, long out_len) {
+    unsigned char prev = out_len > 0 ? (unsigned char)output[out_len - 1] : '\n';
+    const char *rest;
+    long n;
+    switch (c) {
+        case '&':
+        case '|':
+            if (i < size && (unsigned char)input[i] == c && prev != c)
+                ft->decisions++;
+            return;
+        case 'i': rest = "f"; n = 1; break;
+        case 'f': rest = "or"; n = 2; break;
+        case 'c': rest = "ase"; n = 3; break;
+        default: return;
+    }
+    if (is_ident_byte(prev) || prev == '.')
+        return;
+    if (i + n > size || memcmp(input + i, rest, (size_t)n) != 0)
+        return;
+    if (i + n < size && is_ident_byte((unsigned char)input[i + n]))
+        return;
+    ft->decisions++;
+}
+
+static inline void code_track(FuncTracker *ft, unsigned char c, const char *input, long i, long size,
+                              const char *output, long out_len) {
+    if (c == '{' || c == '}' || c == '(' || c == ')' || c == 'f' || c == '\n' || c == ';')
+        func_track(ft, c, input, i, size, output, out_len);
+    if (ft->complexity && (c == 'i' || c == 'f' || c == 'c' || c == '&' || c == '|'))
+        count_decision(ft, c, input, i, size, output, out_len);
+}
+
+static inline long strip_comments(const char *input, char *output, long size, long capacity,
+                                        FuncTracker *ft) {
+    int state = 0;
+    long out_len = 0;
+    long i = 0;
+    #if defined(__AVX2__)
+        while (!ft && i <= size - 32 && out_len <= capacity - 32 && state == 0) {
+            int mask;
+            __asm__ volatile (
+                "vmovdqu (%[input], %[i], 1), %%ymm0\n\t"
+                "vpcmpeqb %%ymm_slash, %%ymm0, %%ymm1\n\t"  // Compare with '/'
+                "vpcmpeqb %%ymm_dq, %%ymm0, %%ymm2\n\t"     // Compare with '\"'
+                "vpcmpeqb %%ymm_bt, %%ymm0, %%ymm3\n\t"     // Compare with '`'
+                "vpcmpeqb %%ymm_sq, %%ymm0, %%ymm4\n\t"     // Compare with '\''
+                "vorps %%ymm1, %%ymm2, %%ymm1\n\t"
+                "vorps %%ymm3, %%ymm4, %%ymm3\n\t"
+                "vorps %%ymm1, %%ymm3, %%ymm1\n\t"
+                "vpmovmskb %%ymm1, %%eax\n\t"
+                : "=a" (mask)
+                : [input] "r" (input), [i] "r" (i),
+                  [ymm_slash] "x" (_mm256_set1_epi8('/')),
+                  [ymm_dq] "x" (_mm256_set1_epi8('"')),
+                  [ymm_bt] "x" (_mm256_set1_epi8('`')),
+                  [ymm_sq] "x" (_mm256_set1_epi8('\''))
+                : "ymm0", "ymm1", "ymm2", "ymm3", "ymm4", "memory"
+            );
+            if (mask == 0) {
+                __asm__ volatile (
+                    "vmovdqu (%[input], %[i], 1), %%ymm0\n\t"
+                    "vmovdqu %%ymm0, (%[output], %[out_len], 1)\n\t"
+                    :
+                    : [input] "r" (input), [output] "r" (output),
+                      [i] "r" (i), [out_len] "r" (out_len)
+                    : "ymm0", "memory"
+                );
+                i += 32;
+                out_len += 32;
+            } else {
+                break;
+            }
+        }
+    #endif
+    for (; i < size && out_len < capacity - 1; ) {
+    #if defined(__SSE2__)
+        /*
+         * Tracking: copy code up to the next comment or literal opener 16
+         * bytes at a time, and hand only the bytes the tracker cares about
+         * to it, found by byte compares.
+         */
+        if (ft && state == 0 && i + 16 <= size && out_len + 16 < capacity) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(input + i));
+            unsigned lex = byte_mask(v, '/') | byte_mask(v, '"') | byte_mask(v, '`') | byte_mask(v, '\'');
+            int n = lex ? __builtin_ctz(lex) : 16;
+            if (n > 0) {
+                unsigned cand = byte_mask(v, '{') | byte_mask(v, '}') | byte_mask(v, '(') |
+                                byte_mask(v, ')') | byte_mask(v, 'f') | byte_mask(v, '\n') | byte_mask(v, ';');
+                if (ft->complexity)
+                    cand |= byte_mask(v, 'i') | byte_mask(v, 'c') | byte_mask(v, '&') | byte_mask(v, '|');
+                cand &= (n == 16) ? 0xffffu : (1u << n) - 1;
+                _mm_storeu_si128((__m128i*)(output + out_len), v);
+                while (cand) {
+                    int k = __builtin_ctz(cand);
+                    cand &= cand - 1;
+                    code_track(ft, (unsigned char)input[i + k], input, i + k + 1, size, output, out_len + k);
+                }
+                i += n;
+                out_len += n;
+                continue;
+            }
+        }
+    #endif
+        unsigned char c = (unsigned char)input[i++];
+        switch (state) {
+            case 0:
+                if (c == '/') {
+                    if (i < size) {
+                        unsigned char c2 = (unsigned char)input[i];
+                        if (c2 == '/') {
+                            state = 1;
+                            i++;
+                            continue;
+                        } else if (c2 == '*') {
+                            state = 2;
+                            i++;
+                            continue;
+                        }
+                    }
+                    output[out_len++] = c;
+                } else if (c == '"') {
+                    state = 3;
+                    output[out_len++] = c;
+                } else if (c == '`') {
+                    state = 4;
+                    output[out_len++] = c;
+                } else if (c == '\'') {
+                    state = 5;
+                    output[out_len++] = c;
+                } else {
+                    if (ft)
+                        code_track(ft, c, input, i, size, output, out_len);
+                    output[out_len++] = c;
+                }
+                break;
+            case 1:
+                if (c == '\n') {
+                    if (ft)
+                        func_track(ft, c, input, i, size, output, out_len);
+                    output[out_len++] = c;
+                    state = 0;
+                }
+                break;
+            case 2:
+                if (c == '\n') {
+                    if (ft)
+                        func_track(ft, c, input, i, size, output, out_len);
+                    output[out_len++] = c;
+                } else if (c == '*') {
+                    if (i < size && input[i] == '/') {
+                        i++;
+                        state = 0;
+                    }
+                }
+                break;
+            case 3:
+                if (c == '\\' && i < size) {
+                    output[out_len++] = c;
+                    c = (unsigned char)input[i++];
+                    if (out_len < capacity - 1)
+                        output[out_len++] = c;
+                } else {
+                    if (c == '"')
+                        state = 0;
+                    output[out_len++] = c;
+                }
+                break;
+            case 4:
+                if (c == '`')
+                    state = 0;
+                output[out_len++] = c;
+                break;
+            case 5:
+                if (c == '\\' && i < size) {
+                    output[out_len++] = c;
+                    c = (unsigned char)input[i++];
+                    if (out_len < capacity - 1)
+                        output[out_len++] = c;
+                } else {
+                    if (c == '\'')
+                        state = 0;
+                    output[out_len++] = c;
+                }
+                break;
+        }
+    }
+    if (out_len < capacity)
+        output[out_len] = '\0';
+    return out_len;
+}
+
+
+/* Receiver type of a method: the last identifier outside [...] in the receiver list. */
+static void func_receiver_type(const char *p, long len, char *dst, size_t dst_size) {
+    long best = -1, best_len = 0;
+    int brackets = 0;
+    for (long k = 0; k < len; k++) {
+        unsigned char c = (unsigned char)p[k];
+        if (c == '[') {
+            brackets++;
+        } else if (c == ']') {
+            brackets--;
+        } else if (brackets == 0 && is_ident_byte(c) && (k == 0 || !is_ident_byte((unsigned char)p[k - 1]))) {
+            long e = k;
+            while (e < len && is_ident_byte((unsigned char)p[e]))
+                e++;
+            best = k;
+            best_len = e - k;
+            k = e - 1;
+        }
+    }
+    if (best < 0 || (size_t)best_len >= dst_size)
+        best_len = 0;
+    memcpy(dst, p + (best < 0 ? 0 : best), (size_t)best_len);
+    dst[best_len] = '\0';
+}
+
+static void func_span_name(goline_func *fs, const char *out) {
+    long k = fs->start + 4;
+    long end = fs->end;
+    char recv[GOLINE_FUNC_NAME_MAX] = "";
+    while (k < end && (out[k] == ' ' || out[k] == '\t' || out[k] == '\n'))
+        k++;
+    if (k < end && out[k] == '(') {
+        long open = k + 1;
+        int depth = 1;
+        for (k = open; k < end && depth > 0; k++) {
+            if (out[k] == '(')
+                depth++;
+            else if (out[k] == ')')
+                depth--;
+        }
+        func_receiver_type(out + open, k - 1 - open, recv, sizeof(recv));
+        while (k < end && (out[k] == ' ' || out[k] == '\t' || out[k] == '\n'))
+            k++;
+    }
+    long n = k;
+    while (n < end && is_ident_byte((unsigned char)out[n]))
+        n++;
+    if (recv[0])
+        snprintf(fs->name, sizeof(fs->name), "%s.%.*s", recv, (int)(n - k), out + k);
+    else
+        snprintf(fs->name, sizeof(fs->name), "%.*s", (int)(n - k), out + k);
+}
+
+#define GEN_MARKER_PREFIX "// Code generated "
+#define GEN_MARKER_SUFFIX " DO NOT EDIT."
+
+static int is_generated_marker(const char *line, long len) {
+    long plen = (long)sizeof(GEN_MARKER_PREFIX) - 1;
+    long slen = (long)sizeof(GEN_MARKER_SUFFIX) - 1;
+    if (len < plen + slen)
+        return 0;
+    return memcmp(line, GEN_MARKER_PREFIX, plen) == 0 &&
+           memcmp(line + len - slen, GEN_MARKER_SUFFIX, slen) == 0;
+}
+
+/*
+ * Whether a block comment is still open at the end of a header line that
+ * starts with in_block set. Openers and closers pair up left to right, and a
+ * line comment hides the rest of the line.
+ */
+static int block_comment_after(const char *line, long len, int in_block) {
+    for (long i = 0; i + 1 < len; i++) {
+        if (in_block) {
+            if (line[i] == '*' && line[i + 1] == '/')
+                in_block = 0, i++;
+        } else if (line[i] == '/') {
+            if (line[i + 1] == '/')
+                break;
+            if (line[i + 1] == '*')
+                in_block = 1, i++;
+        }
+    }
+    return in_block;
+}
+
+/*
+ * Looks for the `// Code generated ... DO NOT EDIT.` marker in the lines that
+ * precede the package clause. Sets *pDecided once the prefix was enough to tell:
+ * the marker or the package clause was seen, or the whole file is in buf. With
+ * to_package set the marker is not enough, so build constraints can be read
+ * from the whole header.
+ */
+static int scan_generated_header(const char *buf, long len, int complete, int to_package, int *pDecided) {
+    long pos = 0;
+    int in_block = 0;
+    int generated = 0;
+    *pDecided = 0;
+    while (pos < len) {
+        const char *nl = (const char*)memchr(buf + pos, '\n', len - pos);
+        if (!nl && !complete)
+            break;
+        long end = nl ? (long)(nl - buf) : len;
+        const char *line = buf + pos;
+        long line_len = end - pos;
+        if (line_len > 0 && line[line_len - 1] == '\r')
+            line_len--;
+
+        if (!in_block) {
+            if (is_generated_marker(line, line_len)) {
+                generated = 1;
+                if (!to_package) {
+                    *pDecided = 1;
+                    return 1;
+                }
+            }
+            long k = 0;
+            while (k < line_len && (line[k] == ' ' || line[k] == '\t'))
+                k++;
+            if (line_len - k >= 7 && memcmp(line + k, "package", 7) == 0 &&
+                (line_len - k == 7 || line[k + 7] == ' ' || line[k + 7] == '\t')) {
+                *pDecided = 1;
+                return generated;
+            }
+        }
+        in_block = block_comment_after(line, line_len, in_block);
+        pos = end + 1;
+    }
+    if (complete)
+        *pDecided = 1;
+    return generated;
+}
+
+/*
+ * Text check run on each chunk as it is read: a NUL byte marks a binary file,
+ * and the rest must be well-formed UTF-8. The SSE2 loops only stop on bytes
+ * that are NUL or non-ASCII, so plain ASCII source is checked 64 bytes at a
+ * time.
+ */
+#define UTF8_BOM "\xEF\xBB\xBF"
+
+/* Length of the UTF-8 sequence at p, 0 if malformed, -1 if cut off by avail. */
+static int utf8_sequence(const unsigned char *p, long avail) {
+    unsigned char c = p[0];
+    unsigned char lo = 0x80, hi = 0xBF;
+    int n;
+    if (c < 0x80)
+        return 1;
+    else if (c >= 0xC2 && c <= 0xDF)
+        n = 2;
+    else if (c == 0xE0)
+        n = 3, lo = 0xA0;
+    else if (c == 0xED)
+        n = 3, hi = 0x9F;
+    else if (c >= 0xE1 && c <= 0xEF)
+        n = 3;
+    else if (c == 0xF0)
+        n = 4, lo = 0x90;
+    else if (c == 0xF4)
+        n = 4, hi = 0x8F;
+    else if (c >= 0xF1 && c <= 0xF3)
+        n = 4;
+    else
+        return 0;
+    for (int k = 1; k < n; k++) {
+        if (k >= avail)
+            return -1;
+        if (p[k] < lo || p[k] > hi)
+            return 0;
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return n;
+}
+
+/*
+ * Checks buf[*pPos, len). Unless complete, a sequence cut off at len is left
+ * for the next call. On failure *pPos is the offset of the offending byte.
+ */
+static int text_scan(const unsigned char *buf, long len, int complete, long *pPos) {
+    long i = *pPos;
+    while (i < len) {
+    #if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        while (i + 64 <= len) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(buf + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(buf + i + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(buf + i + 32));
+            __m128i d = _mm_loadu_si128((const __m128i*)(buf + i + 48));
+            __m128i lo = _mm_min_epu8(_mm_min_epu8(a, b), _mm_min_epu8(c, d));
+            __m128i hi = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+            if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(lo, zero), hi)))
+                break;
+            i += 64;
+        }
+        while (i + 16 <= len) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+            int nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+            int high = _mm_movemask_epi8(v);
+            if (nul | high) {
+                i += __builtin_ctz(nul | high);
+                break;
+            }
+            i += 16;
+        }
+        if (i >= len)
+            break;
+    #endif
+        unsigned char c = buf[i];
+        if (c == 0) {
+            *pPos = i;
+            return GOLINE_SKIP_BINARY;
+        }
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        int n = utf8_sequence(buf + i, len - i);
+        if (n == 0 || (n < 0 && complete)) {
+            *pPos = i;
+            return GOLINE_SKIP_BAD_UTF8;
+        }
+        if (n < 0)
+            break;
+        i += n;
+    }
+    *pPos = i;
+    return GOLINE_COUNTED;
+}
+
+
+/*
+ * Build targets keep only the files `go build` would compile, following
+ * go/build: file name suffixes are checked when the path is listed, and the
+ * //go:build line (or legacy // +build lines) in the header that
+ * goline_scan_header() reads up to the package clause.
+ */
+static const char *const g_known_os[] = {
+    "aix", "android", "darwin", "dragonfly", "freebsd", "hurd", "illumos", "ios", "js", "linux",
+    "nacl", "netbsd", "openbsd", "plan9", "solaris", "wasip1", "windows", "zos", NULL
+};
+static const char *const g_unix_os[] = {
+    "aix", "android", "darwin", "dragonfly", "freebsd", "hurd", "illumos", "ios", "linux",
+    "netbsd", "openbsd", "solaris", NULL
+};
+static const char *const g_known_arch[] = {
+    "386", "amd64", "amd64p32", "arm", "armbe", "arm64", "arm64be", "loong64", "mips", "mipsle",
+    "mips64", "mips64le", "mips64p32", "mips64p32le", "ppc", "ppc64", "ppc64le", "riscv", "riscv64",
+    "s390", "s390x", "sparc", "sparc64", "wasm", NULL
+};
+
+#if defined(__x86_64__)
+#define HOST_GOARCH "amd64"
+#elif defined(__aarch64__)
+#define HOST_GOARCH "arm64"
+#elif defined(__i386__)
+#define HOST_GOARCH "386"
+#elif defined(__arm__)
+#define HOST_GOARCH "arm"
+#elif defined(__riscv) && __riscv_xlen == 64
+#define HOST_GOARCH "riscv64"
+#elif defined(__powerpc64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_GOARCH "ppc64le"
+#elif defined(__s390x__)
+#define HOST_GOARCH "s390x"
+#elif defined(__loongarch64)
+#define HOST_GOARCH "loong64"
+#else
+#define HOST_GOARCH "amd64"
+#endif
+
+static int word_is(const char *s, size_t len, const char *word) {
+    return strlen(word) == len && memcmp(s, word, len) == 0;
+}
+
+static int word_in(const char *const *list, const char *s, size_t len) {
+    for (; *list; list++) {
+        if (word_is(s, len, *list))
+            return 1;
+    }
+    return 0;
+}
+
+int goline_known_os(const char *goos) {
+    return word_in(g_known_os, goos, strlen(goos));
+}
+
+int goline_known_arch(const char *goarch) {
+    return word_in(g_known_arch, goarch, strlen(goarch));
+}
+
+const char *goline_host_arch(void) {
+    return HOST_GOARCH;
+}
+
+int goline_build_filtering(const goline_ctx *ctx) {
+    return ctx->goos != NULL;
+}
+
+/* tags is a comma- or space-separated list, like go build -tags. */
+static int build_tag_listed(const goline_ctx *ctx, const char *tag, size_t len) {
+    const char *p = ctx->tags;
+    while (p && *p) {
+        size_t n = strcspn(p, ", ");
+        if (n == len && memcmp(p, tag, len) == 0)
+            return 1;
+        p += n;
+        p += strspn(p, ", ");
+    }
+    return 0;
+}
+
+/*
+ * go/build's matchTag(): the target and the OSes it implies, the gc toolchain
+ * and the listed tags. Release tags (go1.N) are taken as satisfied, as with
+ * the newest toolchain. cgo holds for a native target, as with go build's
+ * default CGO_ENABLED; GOEXPERIMENT tags only count when listed.
+ */
+static int build_tag_ok(const goline_ctx *ctx, const char *tag, size_t len) {
+    const char *goos = ctx->goos;
+    if (word_is(tag, len, goos) || word_is(tag, len, ctx->goarch) || word_is(tag, len, "gc"))
+        return 1;
+    if ((strcmp(goos, "android") == 0 && word_is(tag, len, "linux")) ||
+        (strcmp(goos, "illumos") == 0 && word_is(tag, len, "solaris")) ||
+        (strcmp(goos, "ios") == 0 && word_is(tag, len, "darwin")))
+        return 1;
+    if (word_is(tag, len, "unix") && word_in(g_unix_os, goos, strlen(goos)))
+        return 1;
+    if (word_is(tag, len, "cgo") && strcmp(goos, "linux") == 0 && strcmp(ctx->goarch, HOST_GOARCH) == 0)
+        return 1;
+    if (len > 4 && memcmp(tag, "go1.", 4) == 0) {
+        size_t k = 4;
+        while (k < len && tag[k] >= '0' && tag[k] <= '9')
+            k++;
+        if (k == len)
+            return 1;
+    }
+    return build_tag_listed(ctx, tag, len);
+}
+
+int goline_name_status(const goline_ctx *ctx, const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    size_t len = strlen(name);
+    if (ctx->opts.skip_tests && len >= 8 && strcmp(name + len - 8, "_test.go") == 0)
+        return GOLINE_SKIP_TEST;
+    if (!goline_build_filtering(ctx))
+        return GOLINE_COUNTED;
+    int keep = name[0] != '_' && name[0] != '.';
+    const char *end = strchr(name, '.');
+    const char *first = (const char*)memchr(name, '_', (size_t)(end - name));
+    if (keep && first) {
+        const char *last = (const char*)memrchr(first, '_', (size_t)(end - first));
+        if (word_is(last + 1, (size_t)(end - last - 1), "test")) {
+            end = last;
+            last = end > first ? (const char*)memrchr(first, '_', (size_t)(end - first)) : NULL;
+        }
+        if (last) {
+            const char *arch = last + 1;
+            size_t arch_len = (size_t)(end - arch);
+            const char *prev = last > first ? (const char*)memrchr(first, '_', (size_t)(last - first)) : NULL;
+            if (prev && word_in(g_known_os, prev + 1, (size_t)(last - prev - 1)) &&
+                word_in(g_known_arch, arch, arch_len))
+                keep = build_tag_ok(ctx, prev + 1, (size_t)(last - prev - 1)) && build_tag_ok(ctx, arch, arch_len);
+            else if (word_in(g_known_os, arch, arch_len) || word_in(g_known_arch, arch, arch_len))
+                keep = build_tag_ok(ctx, arch, arch_len);
+        }
+    }
+    return keep ? GOLINE_COUNTED : GOLINE_SKIP_BUILD;
+}
+
+/* //go:build expressions: ||, &&, ! and parentheses over tags. */
+typedef struct {
+    const goline_ctx *ctx;
+    const char *p;
+    const char *end;
+    int err;
+} BuildExpr;
+
+static int build_expr_or(BuildExpr *e);
+
+static void build_expr_space(BuildExpr *e) {
+    while (e->p < e->end && (*e->p == ' ' || *e->p == '\t'))
+        e->p++;
+}
+
+static int build_expr_not(BuildExpr *e) {
+    build_expr_space(e);
+    if (e->p == e->end) {
+        e->err = 1;
+        return 0;
+    }
+    if (*e->p == '!') {
+        e->p++;
+        return !build_expr_not(e);
+    }
+    if (*e->p == '(') {
+        e->p++;
+        int v = build_expr_or(e);
+        build_expr_space(e);
+        if (e->p < e->end && *e->p == ')')
+            e->p++;
+        else
+            e->err = 1;
+        return v;
+    }
+    const char *tag = e->p;
+    while (e->p < e->end && (isalnum((unsigned char)*e->p) || *e->p == '_' || *e->p == '.'))
+        e->p++;
+    if (e->p == tag) {
+        e->err = 1;
+        return 0;
+    }
+    return build_tag_ok(e->ctx, tag, (size_t)(e->p - tag));
+}
+
+static int build_expr_and(BuildExpr *e) {
+    int v = build_expr_not(e);
+    for (;;) {
+        build_expr_space(e);
+        if (e->end - e->p < 2 || e->p[0] != '&' || e->p[1] != '&')
+            return v;
+        e->p += 2;
+        int w = build_expr_not(e);
+        v = v && w;
+    }
+}
+
+static int build_expr_or(BuildExpr *e) {
+    int v = build_expr_and(e);
+    for (;;) {
+        build_expr_space(e);
+        if (e->end - e->p < 2 || e->p[0] != '|' || e->p[1] != '|')
+            return v;
+        e->p += 2;
+        int w = build_expr_and(e);
+        v = v || w;
+    }
+}
+
+/* A malformed line fails `go build`; the file is kept rather than guessed away. */
+static int eval_go_build(const goline_ctx *ctx, const char *expr, long len) {
+    BuildExpr e = { ctx, expr, expr + len, 0 };
+    int v = build_expr_or(&e);
+    build_expr_space(&e);
+    return e.err || e.p != e.end ? 1 : v;
+}
+
+/* `// +build A,!B C`: fields are ORed, comma-separated terms ANDed. */
+static int eval_plus_build(const goline_ctx *ctx, const char *args, long len) {
+    const char *p = args, *end = args + len;
+    int any = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        const char *field = p;
+        while (p < end && *p != ' ' && *p != '\t')
+            p++;
+        if (p == field)
+            break;
+        int all = 1;
+        for (const char *t = field; t < p && all;) {
+            const char *comma = (const char*)memchr(t, ',', (size_t)(p - t));
+            const char *term_end = comma ? comma : p;
+            int neg = t < term_end && *t == '!';
+            const char *tag = t + neg;
+            all = tag < term_end && build_tag_ok(ctx, tag, (size_t)(term_end - tag)) != neg;
+            t = comma ? comma + 1 : p;
+        }
+        any |= all;
+    }
+    return any;
+}
+
+static size_t build_cache_slot(const BuildCacheEntry *slots, size_t capacity, const char *key, size_t len) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)key[i]) * 0x100000001B3ULL;
+    size_t idx = (size_t)(h ^ (h >> 32)) & (capacity - 1);
+    while (slots[idx].key && (slots[idx].len != len || memcmp(slots[idx].key, key, len) != 0))
+        idx = (idx + 1) & (capacity - 1);
+    return idx;
+}
+
+static int build_cache_get(goline_ctx *ctx, const char *key, size_t len, int *ok) {
+    BuildCache *c = &ctx->build_cache;
+    int found = 0;
+    pthread_mutex_lock(&c->lock);
+    if (c->capacity) {
+        BuildCacheEntry *e = &c->slots[build_cache_slot(c->slots, c->capacity, key, len)];
+        if (e->key) {
+            *ok = e->ok;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return found;
+}
+
+/* Takes over key; a full table that cannot grow just stops caching. */
+static void build_cache_put(goline_ctx *ctx, char *key, size_t len, int ok) {
+    BuildCache *c = &ctx->build_cache;
+    pthread_mutex_lock(&c->lock);
+    if ((c->count + 1) * 2 > c->capacity) {
+        size_t new_cap = c->capacity ? c->capacity * 2 : BUILD_CACHE_INIT;
+        BuildCacheEntry *slots = (BuildCacheEntry*)ctx_alloc(ctx, NULL, new_cap * sizeof(BuildCacheEntry));
+        if (slots) {
+            memset(slots, 0, new_cap * sizeof(BuildCacheEntry));
+            for (size_t i = 0; i < c->capacity; i++) {
+                if (c->slots[i].key)
+                    slots[build_cache_slot(slots, new_cap, c->slots[i].key, c->slots[i].len)] = c->slots[i];
+            }
+            ctx_free(ctx, c->slots);
+            c->slots = slots;
+            c->capacity = new_cap;
+        }
+    }
+    BuildCacheEntry *e = NULL;
+    if ((c->count + 1) * 2 <= c->capacity)
+        e = &c->slots[build_cache_slot(c->slots, c->capacity, key, len)];
+    if (e && !e->key) {
+        e->key = key;
+        e->len = len;
+        e->ok = ok;
+        c->count++;
+        key = NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+    ctx_free(ctx, key);
+}
+
+static void build_cache_free(goline_ctx *ctx) {
+    BuildCache *c = &ctx->build_cache;
+    for (size_t i = 0; i < c->capacity; i++)
+        ctx_free(ctx, c->slots[i].key);
+    ctx_free(ctx, c->slots);
+    c->slots = NULL;
+    c->capacity = c->count = 0;
+}
+
+static void trim_line(const char **line, long *len) {
+    while (*len > 0 && isspace((unsigned char)**line)) {
+        (*line)++;
+        (*len)--;
+    }
+    while (*len > 0 && isspace((unsigned char)(*line)[*len - 1]))
+        (*len)--;
+}
+
+static int is_go_build_line(const char *line, long len) {
+    return len >= 10 && memcmp(line, "//go:build", 10) == 0 && (len == 10 || line[10] == ' ' || line[10] == '\t');
+}
+
+/* The arguments of a `// +build` line, or NULL. */
+static const char *plus_build_args(const char *line, long len, long *args_len) {
+    if (len < 2 || line[0] != '/' || line[1] != '/')
+        return NULL;
+    line += 2;
+    len -= 2;
+    trim_line(&line, &len);
+    if (len < 6 || memcmp(line, "+build", 6) != 0 || (len > 6 && line[6] != ' ' && line[6] != '\t'))
+        return NULL;
+    *args_len = len - 6;
+    return line + 6;
+}
+
+/*
+ * The cache key of a header's constraint: 'g' and the //go:build expression,
+ * or 'p' and the arguments of the // +build lines in buf[0, plus_end), one
+ * per line. Sets *len to 1 for a header without constraint lines.
+ */
+static char *build_key(goline_ctx *ctx, const char *buf, long plus_end, const char *go_build, long go_build_len,
+                       size_t *len) {
+    size_t cap = 1 + (size_t)(go_build ? go_build_len : plus_end + 1);
+    char *key = (char*)ctx_alloc(ctx, NULL, cap);
+    if (!key)
+        return NULL;
+    size_t n = 0;
+    if (go_build) {
+        key[n++] = 'g';
+        memcpy(key + n, go_build, (size_t)go_build_len);
+        n += (size_t)go_build_len;
+    } else {
+        key[n++] = 'p';
+        for (long p = 0; p < plus_end;) {
+            const char *nl = (const char*)memchr(buf + p, '\n', (size_t)(plus_end - p));
+            const char *line = buf + p;
+            long line_len = nl ? (long)(nl - line) : plus_end - p;
+            p = nl ? (long)(nl - buf) + 1 : plus_end;
+            trim_line(&line, &line_len);
+            long args_len;
+            const char *args = plus_build_args(line, line_len, &args_len);
+            if (args) {
+                memcpy(key + n, args, (size_t)args_len);
+                n += (size_t)args_len;
+                key[n++] = '\n';
+            }
+        }
+    }
+    *len = n;
+    return key;
+}
+
+/*
+ * Reads the build constraint from the comments before the first code, as
+ * go/build's parseFileHeader() does: a //go:build line outside block
+ * comments wins; otherwise all // +build lines above the last blank line must
+ * hold. Returns 1 when the file builds for the target.
+ */
+static int build_header_ok(goline_ctx *ctx, const char *buf, long len) {
+    const char *go_build = NULL;
+    long go_build_len = 0;
+    long pos = 0, plus_end = 0;
+    int ended = 0, in_block = 0;
+    while (pos < len) {
+        const char *nl = (const char*)memchr(buf + pos, '\n', (size_t)(len - pos));
+        const char *line = buf + pos;
+        long line_len = nl ? (long)(nl - line) : len - pos;
+        pos = nl ? (long)(nl - buf) + 1 : len;
+        trim_line(&line, &line_len);
+        if (line_len == 0 && !ended) {
+            plus_end = pos;
+            continue;
+        }
+        if (line_len < 2 || line[0] != '/' || line[1] != '/')
+            ended = 1;
+        if (!in_block && !go_build && is_go_build_line(line, line_len)) {
+            go_build = line + 10;
+            go_build_len = line_len - 10;
+        }
+        int code = 0;
+        while (line_len > 0 && !code) {
+            if (in_block) {
+                const char *close = (const char*)memmem(line, (size_t)line_len, "*/", 2);
+                if (!close)
+                    break;
+                in_block = 0;
+                line_len -= (long)(close + 2 - line);
+                line = close + 2;
+                trim_line(&line, &line_len);
+            } else if (line_len >= 2 && line[0] == '/' && line[1] == '/') {
+                break;
+            } else if (line_len >= 2 && line[0] == '/' && line[1] == '*') {
+                in_block = 1;
+                line += 2;
+                line_len -= 2;
+                trim_line(&line, &line_len);
+            } else {
+                code = 1;
+            }
+        }
+        if (code)
+            break;
+    }
+
+    size_t key_len = 0;
+    char *key = build_key(ctx, buf, plus_end, go_build, go_build_len, &key_len);
+    if (key && key_len == 1) {
+        ctx_free(ctx, key);
+        return 1;
+    }
+    int ok;
+    if (key && build_cache_get(ctx, key, key_len, &ok)) {
+        ctx_free(ctx, key);
+        return ok;
+    }
+
+    if (go_build) {
+        ok = eval_go_build(ctx, go_build, go_build_len);
+    } else {
+        ok = 1;
+        for (long p = 0; p < plus_end && ok;) {
+            const char *nl = (const char*)memchr(buf + p, '\n', (size_t)(plus_end - p));
+            const char *line = buf + p;
+            long line_len = nl ? (long)(nl - line) : plus_end - p;
+            p = nl ? (long)(nl - buf) + 1 : plus_end;
+            trim_line(&line, &line_len);
+            long args_len;
+            const char *args = plus_build_args(line, line_len, &args_len);
+            if (args)
+                ok = eval_plus_build(ctx, args, args_len);
+        }
+    }
+    if (key)
+        build_cache_put(ctx, key, key_len, ok);
+    return ok;
+}
+
+int goline_header_status(goline_ctx *ctx, int generated, const char *code, size_t len) {
+    if ((ctx->opts.generated == GOLINE_GENERATED_SKIP && generated) ||
+        (ctx->opts.generated == GOLINE_GENERATED_ONLY && !generated))
+        return GOLINE_SKIP_GENERATED;
+    if (goline_build_filtering(ctx) && !build_header_ok(ctx, code, (long)len))
+        return GOLINE_SKIP_BUILD;
+    return GOLINE_COUNTED;
+}
+
+void goline_options_init(goline_options *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->generated = GOLINE_GENERATED_ALL;
+    opts->check_text = 1;
+    opts->follow_symlinks = GOLINE_FOLLOW_ALWAYS;
+    opts->jobs = 1;
+    opts->split_threshold = DEFAULT_SPLIT_THRESHOLD;
+}
+
+int goline_new(const goline_options *opts, goline_ctx **out) {
+    goline_options o;
+    if (opts)
+        o = *opts;
+    else
+        goline_options_init(&o);
+    *out = NULL;
+    if (!o.alloc)
+        o.alloc = libc_alloc;
+    if (o.generated < GOLINE_GENERATED_ALL || o.generated > GOLINE_GENERATED_ONLY ||
+        o.follow_symlinks < GOLINE_FOLLOW_NEVER || o.follow_symlinks > GOLINE_FOLLOW_ALWAYS ||
+        (o.goos && !goline_known_os(o.goos)) || (o.goarch && !goline_known_arch(o.goarch)))
+        return GOLINE_EINVAL;
+    if (o.jobs < 1)
+        o.jobs = 1;
+
+    goline_ctx *ctx = (goline_ctx*)o.alloc(o.alloc_user, NULL, sizeof(goline_ctx));
+    if (!ctx)
+        return GOLINE_ENOMEM;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->opts = o;
+    ctx->split_budget = o.jobs - 1;
+    pthread_mutex_init(&ctx->build_cache.lock, NULL);
+    if (o.goos || o.goarch || o.tags) {
+        ctx->goos = ctx_strdup(ctx, o.goos ? o.goos : "linux");
+        ctx->goarch = ctx_strdup(ctx, o.goarch ? o.goarch : HOST_GOARCH);
+        ctx->tags = o.tags ? ctx_strdup(ctx, o.tags) : NULL;
+        if (!ctx->goos || !ctx->goarch || (o.tags && !ctx->tags)) {
+            goline_free(ctx);
+            return GOLINE_ENOMEM;
+        }
+    }
+    ctx->opts.goos = ctx->goos;
+    ctx->opts.goarch = ctx->goarch;
+    ctx->opts.tags = ctx->tags;
+    *out = ctx;
+    return GOLINE_OK;
+}
+
+static void dir_node_free(goline_ctx *ctx, DirNode *n) {
+    if (!n)
+        return;
+    for (size_t i = 0; i < n->pub.ndirs; i++)
+        dir_node_free(ctx, (DirNode*)n->pub.dirs[i]);
+    ctx_free(ctx, n->pub.dirs);
+    ctx_free(ctx, n);
+}
+
+void goline_free(goline_ctx *ctx) {
+    if (!ctx)
+        return;
+    build_cache_free(ctx);
+    pthread_mutex_destroy(&ctx->build_cache.lock);
+    dir_node_free(ctx, ctx->tree);
+    ctx_free(ctx, ctx->visited);
+    ctx_free(ctx, ctx->goos);
+    ctx_free(ctx, ctx->goarch);
+    ctx_free(ctx, ctx->tags);
+    ctx_free(ctx, ctx);
+}
+
+long goline_count_lines(const char *code, size_t len, size_t readable) {
+    lex_tables_init();
+    return count_lines_skip((const unsigned char*)code, (long)len, (long)readable);
+}
+
+void goline_count_lines_n(const char *const *bufs, const long *lens, long *counts, int n) {
+    lex_tables_init();
+    count_lines_interleaved((const unsigned char *const*)bufs, lens, counts, n);
+}
+
+int goline_split_chunks(const goline_ctx *ctx, size_t len) {
+    if (ctx->opts.jobs < 2 || len < ctx->opts.split_threshold)
+        return 1;
+    size_t nchunks = len / SPLIT_MIN_CHUNK;
+    if (nchunks > (size_t)ctx->opts.jobs)
+        nchunks = (size_t)ctx->opts.jobs;
+    return nchunks ? (int)nchunks : 1;
+}
+
+long goline_count_lines_split(goline_ctx *ctx, const char *code, size_t len, int nchunks) {
+    if (nchunks < 2)
+        return goline_count_lines(code, len, len);
+    return count_lines_parallel(ctx, code, (long)len, nchunks);
+}
+
+int goline_text_check(const char *buf, size_t len, int complete, size_t *pos) {
+    long p = (long)*pos;
+    int status = text_scan((const unsigned char*)buf, (long)len, complete, &p);
+    *pos = (size_t)p;
+    return status;
+}
+
+size_t goline_bom_len(const char *buf, size_t len) {
+    return len >= 3 && memcmp(buf, UTF8_BOM, 3) == 0 ? 3 : 0;
+}
+
+int goline_scan_header(const char *buf, size_t len, int complete, int to_package, int *decided) {
+    return scan_generated_header(buf, (long)len, complete, to_package, decided);
+}
+
+long goline_strip_comments(const char *code, size_t len, char *out, size_t cap) {
+    return strip_comments(code, out, (long)len, (long)cap, NULL);
+}
+
+long goline_count_code_lines(const char *code, size_t len) {
+    return count_code_lines(code, (long)len);
+}
+
+long goline_strip_funcs(goline_ctx *ctx, const char *code, size_t len, char *out, size_t cap,
+                        int complexity, goline_funcs *funcs) {
+    FuncTracker ft;
+    memset(&ft, 0, sizeof(ft));
+    ft.ctx = ctx;
+    ft.complexity = complexity;
+    memset(funcs, 0, sizeof(*funcs));
+    long out_len = strip_comments(code, out, (long)len, (long)cap, &ft);
+    if (ft.failed) {
+        ctx_free(ctx, ft.data);
+        return GOLINE_ENOMEM;
+    }
+    long line = 1;
+    long pos = 0;
+    for (size_t k = 0; k < ft.size; k++) {
+        goline_func *fs = &ft.data[k];
+        for (; pos < fs->start; pos++)
+            line += (out[pos] == '\n');
+        long stop = fs->end;
+        while (stop < out_len && out[stop] != '\n')
+            stop++;
+        fs->line = line;
+        fs->lines = count_code_lines(out + fs->start, stop - fs->start);
+        func_span_name(fs, out);
+    }
+    funcs->funcs = ft.data;
+    funcs->nfuncs = ft.size;
+    funcs->decisions = ft.decisions;
+    return out_len;
+}
+
+void goline_funcs_free(goline_ctx *ctx, goline_funcs *funcs) {
+    ctx_free(ctx, funcs->funcs);
+    memset(funcs, 0, sizeof(*funcs));
+}
+
+int goline_count_buffer(goline_ctx *ctx, const char *buf, size_t len, goline_result *out) {
+    memset(out, 0, sizeof(*out));
+    out->bytes = (long)len;
+    if (ctx->opts.check_text) {
+        size_t pos = 0;
+        int status = goline_text_check(buf, len, 1, &pos);
+        if (status != GOLINE_COUNTED) {
+            out->status = status;
+            out->invalid_offset = (long)pos;
+            return GOLINE_OK;
+        }
+    }
+    /* A leading byte order mark is not code and must not hide a column-0 token. */
+    size_t bom = goline_bom_len(buf, len);
+    const char *code = buf + bom;
+    len -= bom;
+    int decided;
+    out->generated = goline_scan_header(code, len, 1, goline_build_filtering(ctx), &decided);
+    out->status = goline_header_status(ctx, out->generated, code, len);
+    if (out->status != GOLINE_COUNTED)
+        return GOLINE_OK;
+    out->lines = goline_count_lines_split(ctx, code, len, goline_split_chunks(ctx, len));
+    return GOLINE_OK;
+}
+
+long goline_read(int fd, char *buf, size_t want) {
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = read(fd, buf + got, want - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        got += (size_t)n;
+        if (n == 0 || got < want)
+            break;
+    }
+    return (long)got;
+}
+
+/* Reads all of fd, however much the file has changed since fstat(). */
+static int read_all(goline_ctx *ctx, int fd, char **pBuf, size_t *pLen) {
+    struct stat st;
+    size_t cap = (fstat(fd, &st) == 0 && st.st_size > 0 ? (size_t)st.st_size : 0) + 1;
+    size_t len = 0;
+    char *buf = (char*)ctx_alloc(ctx, NULL, cap);
+    if (!buf)
+        return GOLINE_ENOMEM;
+    for (;;) {
+        long n = goline_read(fd, buf + len, cap - len);
+        if (n < 0) {
+            int err = errno;
+            ctx_free(ctx, buf);
+            errno = err;
+            return GOLINE_EREAD;
+        }
+        len += (size_t)n;
+        if (len < cap)
+            break;
+        char *grown = (char*)ctx_alloc(ctx, buf, cap * 2);
+        if (!grown) {
+            ctx_free(ctx, buf);
+            return GOLINE_ENOMEM;
+        }
+        buf = grown;
+        cap *= 2;
+    }
+    *pBuf = buf;
+    *pLen = len;
+    return GOLINE_OK;
+}
+
+int goline_count_file(goline_ctx *ctx, const char *path, goline_result *out) {
+    memset(out, 0, sizeof(*out));
+    out->status = goline_name_status(ctx, path);
+    if (out->status != GOLINE_COUNTED)
+        return GOLINE_OK;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return GOLINE_EOPEN;
+    char *buf;
+    size_t len;
+    int rc = read_all(ctx, fd, &buf, &len);
+    int err = errno;
+    close(fd);
+    if (rc != GOLINE_OK) {
+        errno = err;
+        return rc;
+    }
+    rc = goline_count_buffer(ctx, buf, len, out);
+    ctx_free(ctx, buf);
+    return rc;
+}
+
+/*
+ * goline_walk(): (st_dev, st_ino) of every directory and file already seen,
+ * so symlink loops end and linked copies are counted once.
+ */
+static int visit(goline_ctx *ctx, dev_t dev, ino_t ino) {
+    if ((ctx->visited_count + 1) * 2 > ctx->visited_cap) {
+        size_t new_cap = ctx->visited_cap ? ctx->visited_cap * 2 : VISITED_INIT;
+        Visited *slots = (Visited*)ctx_alloc(ctx, NULL, new_cap * sizeof(Visited));
+        if (!slots)
+            return GOLINE_ENOMEM;
+        memset(slots, 0, new_cap * sizeof(Visited));
+        for (size_t i = 0; i < ctx->visited_cap; i++) {
+            const Visited *v = &ctx->visited[i];
+            if (!v->used)
+                continue;
+            size_t idx = ((size_t)v->ino * 0x9E3779B97F4A7C15ULL ^ (size_t)v->dev) & (new_cap - 1);
+            while (slots[idx].used)
+                idx = (idx + 1) & (new_cap - 1);
+            slots[idx] = *v;
+        }
+        ctx_free(ctx, ctx->visited);
+        ctx->visited = slots;
+        ctx->visited_cap = new_cap;
+    }
+    size_t idx = ((size_t)ino * 0x9E3779B97F4A7C15ULL ^ (size_t)dev) & (ctx->visited_cap - 1);
+    while (ctx->visited[idx].used) {
+        if (ctx->visited[idx].dev == dev && ctx->visited[idx].ino == ino)
+            return 0;
+        idx = (idx + 1) & (ctx->visited_cap - 1);
+    }
+    ctx->visited[idx].dev = dev;
+    ctx->visited[idx].ino = ino;
+    ctx->visited[idx].used = 1;
+    ctx->visited_count++;
+    return 1;
+}
+
+static DirNode *dir_node_new(goline_ctx *ctx, const char *name, const char *rel) {
+    size_t name_len = strlen(name), rel_len = strlen(rel);
+    DirNode *n = (DirNode*)ctx_alloc(ctx, NULL, sizeof(DirNode) + name_len + rel_len + 2);
+    if (!n)
+        return NULL;
+    memset(n, 0, sizeof(*n));
+    char *strings = (char*)(n + 1);
+    memcpy(strings, name, name_len + 1);
+    memcpy(strings + name_len + 1, rel, rel_len + 1);
+    n->pub.name = strings;
+    n->pub.path = strings + name_len + 1;
+    return n;
+}
+
+static int compare_dirs(const void *a, const void *b) {
+    return strcmp((*(const goline_dir* const*)a)->name, (*(const goline_dir* const*)b)->name);
+}
+
+static void sort_tree(goline_dir *n) {
+    qsort(n->dirs, n->ndirs, sizeof(goline_dir*), compare_dirs);
+    for (size_t i = 0; i < n->ndirs; i++)
+        sort_tree(n->dirs[i]);
+}
+
+int goline_is_go_file(const char *name) {
+    size_t len = strlen(name);
+    return len > 3 && strcasecmp(name + (len - 3), ".go") == 0;
+}
+
+int goline_visit(goline_ctx *ctx, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return GOLINE_EOPEN;
+    if (!S_ISREG(st.st_mode))
+        return 0;
+    return visit(ctx, st.st_dev, st.st_ino);
+}
+
+typedef struct {
+    goline_walk_fn fn;
+    void *user;
+    int rc;
+} WalkState;
+
+/* Reports one event; GOLINE_WALK_PRUNE passes through, any other nonzero answer stops the walk. */
+static int walk_event(WalkState *ws, int event, const char *path, const char *name, long size, int depth) {
+    if (ws->rc != GOLINE_OK)
+        return -1;
+    goline_walk_entry e = { path, name, size, depth };
+    int answer = ws->fn(ws->user, event, &e);
+    if (answer != 0 && !(answer == GOLINE_WALK_PRUNE && event == GOLINE_WALK_DIR)) {
+        ws->rc = GOLINE_ESTOP;
+        return -1;
+    }
+    return answer;
+}
+
+/* Reports path, which is open as dir, and everything below it. */
+static void walk_dir(goline_ctx *ctx, WalkState *ws, DIR *dir, const char *path, const char *name,
+                     int depth, int via_link) {
+    if (walk_event(ws, GOLINE_WALK_DIR, path, name, 0, depth) != 0) {
+        closedir(dir);
+        return;
+    }
+    struct dirent *entry;
+    while (ws->rc == GOLINE_OK && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        unsigned char type = entry->d_type;
+        int is_go = goline_is_go_file(entry->d_name);
+        if (!is_go && type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+            continue;
+        char full[PATH_MAX];
+        int n = snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+        if (n < 0 || (size_t)n >= sizeof(full))
+            continue;
+        struct stat st;
+        if (lstat(full, &st) != 0)
+            continue;
+        int is_link = S_ISLNK(st.st_mode);
+        if (is_link) {
+            if (ctx->opts.follow_symlinks == GOLINE_FOLLOW_NEVER ||
+                (ctx->opts.follow_symlinks == GOLINE_FOLLOW_ONCE && via_link) || stat(full, &st) != 0)
+                continue;
+        }
+        int is_dir = S_ISDIR(st.st_mode);
+        if (is_dir ? ctx->opts.one_file_system && st.st_dev != ctx->root_dev : !(is_go && S_ISREG(st.st_mode)))
+            continue;
+        int fresh = visit(ctx, st.st_dev, st.st_ino);
+        if (fresh < 0)
+            walk_event(ws, GOLINE_WALK_UNTRACKED, full, entry->d_name, (long)st.st_size, depth + 1);
+        if (fresh <= 0)
+            continue;
+        if (!is_dir) {
+            walk_event(ws, GOLINE_WALK_FILE, full, entry->d_name, (long)st.st_size, depth + 1);
+            continue;
+        }
+        DIR *sub = opendir(full);
+        if (sub)
+            walk_dir(ctx, ws, sub, full, entry->d_name, depth + 1, via_link || is_link);
+    }
+    closedir(dir);
+    walk_event(ws, GOLINE_WALK_LEAVE, path, name, 0, depth);
+}
+
+int goline_walk(goline_ctx *ctx, const char *root, goline_walk_fn fn, void *user) {
+    ctx->visited_count = 0;
+    if (ctx->visited)
+        memset(ctx->visited, 0, ctx->visited_cap * sizeof(Visited));
+
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/')
+        root_len--;
+    char path[PATH_MAX];
+    if (root_len >= sizeof(path))
+        return GOLINE_EINVAL;
+    memcpy(path, root, root_len);
+    path[root_len] = '\0';
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return GOLINE_EOPEN;
+    ctx->root_dev = st.st_dev;
+    if (visit(ctx, st.st_dev, st.st_ino) < 0)
+        return GOLINE_ENOMEM;
+    DIR *dir = opendir(path);
+    if (!dir)
+        return GOLINE_EOPEN;
+    const char *base = strrchr(path, '/');
+    WalkState ws = { fn, user, GOLINE_OK };
+    walk_dir(ctx, &ws, dir, path, base && base[1] ? base + 1 : path, 0, 0);
+    return ws.rc;
+}
+
+/* goline_scan(): one directory of the walk; its node is only made once a file below it is counted. */
+typedef struct {
+    const char *name;
+    const char *rel;
+    DirNode *node;
+} ScanDir;
+
+typedef struct {
+    goline_ctx *ctx;
+    goline_file_fn fn;
+    void *user;
+    size_t root_len;
+    ScanDir *dirs;
+    size_t dirs_cap;
+    int rc;
+} ScanState;
+
+static DirNode *scan_dir_node(ScanState *ss, int depth) {
+    ScanDir *d = &ss->dirs[depth];
+    if (d->node)
+        return d->node;
+    DirNode *parent = scan_dir_node(ss, depth - 1);
+    if (!parent)
+        return NULL;
+    if (parent->pub.ndirs == parent->dirs_cap) {
+        size_t new_cap = parent->dirs_cap ? parent->dirs_cap * 2 : 8;
+        goline_dir **dirs = (goline_dir**)ctx_alloc(ss->ctx, parent->pub.dirs, new_cap * sizeof(goline_dir*));
+        if (!dirs)
+            return NULL;
+        parent->pub.dirs = dirs;
+        parent->dirs_cap = new_cap;
+    }
+    d->node = dir_node_new(ss->ctx, d->name, d->rel);
+    if (d->node)
+        parent->pub.dirs[parent->pub.ndirs++] = &d->node->pub;
+    return d->node;
+}
+
+static int scan_file(ScanState *ss, const goline_walk_entry *e) {
+    goline_result res;
+    int rc = goline_count_file(ss->ctx, e->path, &res);
+    if (rc == GOLINE_OK && res.status == GOLINE_COUNTED) {
+        if (!scan_dir_node(ss, e->depth - 1))
+            rc = GOLINE_ENOMEM;
+        for (int k = e->depth - 1; rc == GOLINE_OK && k >= 0; k--) {
+            goline_dir *n = &ss->dirs[k].node->pub;
+            n->lines += res.lines;
+            n->generated_lines += res.generated ? res.lines : 0;
+            n->bytes += res.bytes;
+            n->files++;
+        }
+    }
+    if (ss->fn && ss->fn(ss->user, e->path, rc, rc == GOLINE_OK ? &res : NULL) != 0)
+        return 1;
+    if (rc == GOLINE_ENOMEM) {
+        ss->rc = rc;
+        return 1;
+    }
+    return 0;
+}
+
+static int scan_event(void *user, int event, const goline_walk_entry *e) {
+    ScanState *ss = (ScanState*)user;
+    switch (event) {
+        case GOLINE_WALK_DIR:
+            if ((size_t)e->depth == ss->dirs_cap) {
+                size_t new_cap = ss->dirs_cap ? ss->dirs_cap * 2 : 16;
+                ScanDir *dirs = (ScanDir*)ctx_alloc(ss->ctx, ss->dirs, new_cap * sizeof(ScanDir));
+                if (!dirs) {
+                    ss->rc = GOLINE_ENOMEM;
+                    return 1;
+                }
+                ss->dirs = dirs;
+                ss->dirs_cap = new_cap;
+            }
+            ss->dirs[e->depth].name = e->name;
+            ss->dirs[e->depth].rel = e->depth ? e->path + ss->root_len + 1 : "";
+            ss->dirs[e->depth].node = NULL;
+            if (e->depth == 0) {
+                ss->dirs[0].node = ss->ctx->tree = dir_node_new(ss->ctx, e->name, "");
+                if (!ss->ctx->tree) {
+                    ss->rc = GOLINE_ENOMEM;
+                    return 1;
+                }
+            }
+            return 0;
+        case GOLINE_WALK_FILE:
+            return scan_file(ss, e);
+        case GOLINE_WALK_UNTRACKED:
+            ss->rc = GOLINE_ENOMEM;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int goline_scan(goline_ctx *ctx, const char *root, goline_file_fn fn, void *user) {
+    dir_node_free(ctx, ctx->tree);
+    ctx->tree = NULL;
+    ctx->tree_done = 0;
+
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/')
+        root_len--;
+    ScanState ss = { ctx, fn, user, root_len, NULL, 0, GOLINE_OK };
+    int rc = goline_walk(ctx, root, scan_event, &ss);
+    ctx_free(ctx, ss.dirs);
+    if (ss.rc != GOLINE_OK)
+        rc = ss.rc;
+    if (rc == GOLINE_OK) {
+        sort_tree(&ctx->tree->pub);
+        ctx->tree_done = 1;
+    }
+    return rc;
+}
+
+const goline_dir *goline_tree(const goline_ctx *ctx) {
+    return ctx->tree_done ? &ctx->tree->pub : NULL;
+}
@@ -3,23 +3,42 @@
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 700
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <signal.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <wchar.h>
 #include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+#include <math.h>
 
 #include <immintrin.h>
 #include <emmintrin.h>
 
+#include "goline.h"
+
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
@@ -41,9 +60,110 @@ wchar_t* to_wide(const char *str) {
     return wstr;
 }
 
+enum {
+    GEN_ALL,
+    GEN_SKIP,
+    GEN_ONLY
+};
+
+enum {
+    FORMAT_TREE,
+    FORMAT_JSON,
+    FORMAT_NDJSON,
+    FORMAT_CSV
+};
+
+enum {
+    INVALID_SKIP,
+    INVALID_REPORT,
+    INVALID_COUNT
+};
+
+/* Why a file could not be counted (GoFile.load_error), for --metrics-file. */
+enum {
+    LOAD_OK,
+    LOAD_OPEN_FAILED,
+    LOAD_READ_FAILED
+};
+
+enum {
+    TOP_BY_LINES,
+    TOP_BY_BYTES,
+    TOP_BY_GROWTH
+};
+
+typedef struct {
+    const char *root_dir;
+    int dedup;
+    int generated_mode;
+    size_t top_k;
+    int top_by;
+    const char *baseline_path;
+    const char *save_counts_path;
+    const char *save_snapshot_path;
+    const char *files_from;
+    const char *trace_path;
+    const char *metrics_path;
+    const char *history_range;
+    int null_delim;
+    int jobs;
+    long split_threshold;
+    int format;
+    int follow_symlinks;
+    int one_file_system;
+    int estimate;
+    double estimate_error;
+    double estimate_seconds;
+    uint64_t estimate_seed;
+    int has_seed;
+    int max_depth;
+    long max_func_lines;
+    size_t top_funcs;
+    int invalid_files;
+    long batch_bytes;
+    int worker_stats;
+    int jobs_set;
+    int background;
+    long io_rate;
+    int module_report;
+    int stream;
+    int tui;
+    int no_nested_modules;
+    int no_vendor;
+    const char *goos;
+    const char *goarch;
+    const char *build_tags;
+    int no_tests;
+    int duplicates;
+    int complexity;
+    long max_complexity;
+    long dup_memory;
+    size_t dup_blocks;
+} Options;
+
+static Options g_opts;
+
+/* A top-level function or method of the file at path, for the function reports. */
+typedef struct {
+    goline_func fn;
+    const char *path;
+} FuncSpan;
+
 typedef struct {
     char  *path;
     long   line_count;
+    long   bytes;
+    int    generated;
+    int    excluded;
+    FuncSpan *funcs;
+    size_t nfuncs;
+    int    invalid;
+    long   invalid_offset;
+    struct DupFile *dup;
+    long   complexity;
+    int    module;
+    int    constrained;
+    int    load_error;
 } GoFile;
 
 typedef struct {
@@ -61,6 +181,8 @@ static void init_go_file_list(GoFileList *list) {
 static void free_go_file_list(GoFileList *list) {
     for (size_t i = 0; i < list->size; i++) {
         free(list->data[i].path);
+        free(list->data[i].funcs);
+        free(list->data[i].dup);
     }
     free(list->data);
     list->data = NULL;
@@ -201,452 +323,6851 @@ static void push_go_file(GoFileList *list, const char *path) {
     list->data[list->size].path = (char*)malloc(len + 1);
     fast_strcpy(list->data[list->size].path, path, len + 1);
     list->data[list->size].line_count = 0;
+    list->data[list->size].bytes = 0;
+    list->data[list->size].generated = 0;
+    list->data[list->size].excluded = 0;
+    list->data[list->size].funcs = NULL;
+    list->data[list->size].nfuncs = 0;
+    list->data[list->size].invalid = 0;
+    list->data[list->size].invalid_offset = 0;
+    list->data[list->size].dup = NULL;
+    list->data[list->size].complexity = 0;
+    list->data[list->size].module = -1;
+    list->data[list->size].constrained = 0;
+    list->data[list->size].load_error = LOAD_OK;
     list->size++;
 }
     
-static long count_non_empty_lines(const char *str, long length) {
-    long count = 0;
-    int in_line = 0;
-    long i = 0;
-    #if defined(__AVX2__)
-        for (; i <= length - 32; i += 32) {
-            int nl_mask;
-            __asm__ volatile (
-                "vmovdqu (%[str], %[i], 1), %%ymm0\n\t"
-                "vpcmpeqb $0x0A, %%ymm0, %%ymm1\n\t"  // Compare with newline (0x0A)
-                "vpmovmskb %%ymm1, %%eax\n\t"          // Create mask from comparison
-                : "=a" (nl_mask)
-                : [str] "r" (str), [i] "r" (i)
-                : "ymm0", "ymm1", "memory"
-            );
-            for (int j = 0; j < 32; j++) {
-                char c = str[i+j];
-                if (c == '\n') {
-                    if (in_line)
-                        count++;
-                    in_line = 0;
-                } else if (c != ' ' && c != '\t' && c != '\r') {
-                    in_line = 1;
-                }
-            }
-        }
-    #endif
-    for (; i < length; i++) {
-        char c = str[i];
-        if (c == '\n') {
-            if (in_line)
-                count++;
-            in_line = 0;
-        } else if (c != ' ' && c != '\t' && c != '\r') {
-            in_line = 1;
-        }
+/*
+ * --trace=FILE: per-thread spans in Chrome trace-event JSON (Perfetto,
+ * chrome://tracing). Each thread appends to its own ring buffer, so recording
+ * takes no lock. Rings grow up to TRACE_RING_EVENTS, after which the oldest
+ * spans are overwritten. With
+ * tracing off every probe is a single test of g_trace_enabled.
+ */
+#define TRACE_RING_EVENTS 65536
+#define TRACE_DETAIL_MAX 64
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    char detail[TRACE_DETAIL_MAX];
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent *ev;
+    size_t cap;
+    size_t head;
+    int tid;
+    char thread_name[32];
+    struct TraceRing *next;
+} TraceRing;
+
+static int g_trace_enabled;
+static struct timespec g_trace_epoch;
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing *g_trace_rings;
+static int g_trace_next_tid;
+static __thread TraceRing *t_trace_ring;
+static __thread const char *t_trace_thread_name;
+
+static uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - g_trace_epoch.tv_sec) * 1000000000ull +
+           (uint64_t)(now.tv_nsec - g_trace_epoch.tv_nsec);
+}
+
+static void trace_init(void) {
+    clock_gettime(CLOCK_MONOTONIC, &g_trace_epoch);
+    g_trace_enabled = 1;
+}
+
+/* Names the calling thread's track; the string must outlive the trace. */
+static inline void trace_thread_name(const char *name) {
+    t_trace_thread_name = name;
+}
+
+static TraceRing *trace_ring_register(void) {
+    TraceRing *r = (TraceRing*)calloc(1, sizeof(TraceRing));
+    if (!r)
+        return NULL;
+    r->cap = 256;
+    r->ev = (TraceEvent*)malloc(r->cap * sizeof(TraceEvent));
+    if (!r->ev) {
+        free(r);
+        return NULL;
     }
-    if (in_line)
-        count++;
-    return count;
+    snprintf(r->thread_name, sizeof(r->thread_name), "%s", t_trace_thread_name ? t_trace_thread_name : "thread");
+    pthread_mutex_lock(&g_trace_lock);
+    r->tid = ++g_trace_next_tid;
+    r->next = g_trace_rings;
+    g_trace_rings = r;
+    pthread_mutex_unlock(&g_trace_lock);
+    return r;
 }
-    
-long remove_comments(const char *input, char *output, long size, long capacity) {
-    int state = 0;
-    long out_len = 0;
-    long i = 0;
-    #if defined(__AVX2__)
-        while (i <= size - 32 && out_len <= capacity - 32 && state == 0) {
-            int mask;
-            __asm__ volatile (
-                "vmovdqu (%[input], %[i], 1), %%ymm0\n\t"
-                "vpcmpeqb %%ymm_slash, %%ymm0, %%ymm1\n\t"  // Compare with '/'
-                "vpcmpeqb %%ymm_dq, %%ymm0, %%ymm2\n\t"     // Compare with '\"'
-                "vpcmpeqb %%ymm_bt, %%ymm0, %%ymm3\n\t"     // Compare with '`'
-                "vpcmpeqb %%ymm_sq, %%ymm0, %%ymm4\n\t"     // Compare with '\''
-                "vorps %%ymm1, %%ymm2, %%ymm1\n\t"
-                "vorps %%ymm3, %%ymm4, %%ymm3\n\t"
-                "vorps %%ymm1, %%ymm3, %%ymm1\n\t"
-                "vpmovmskb %%ymm1, %%eax\n\t"
-                : "=a" (mask)
-                : [input] "r" (input), [i] "r" (i),
-                  [ymm_slash] "x" (_mm256_set1_epi8('/')),
-                  [ymm_dq] "x" (_mm256_set1_epi8('"')),
-                  [ymm_bt] "x" (_mm256_set1_epi8('`')),
-                  [ymm_sq] "x" (_mm256_set1_epi8('\''))
-                : "ymm0", "ymm1", "ymm2", "ymm3", "ymm4", "memory"
-            );
-            if (mask == 0) {
-                __asm__ volatile (
-                    "vmovdqu (%[input], %[i], 1), %%ymm0\n\t"
-                    "vmovdqu %%ymm0, (%[output], %[out_len], 1)\n\t"
-                    :
-                    : [input] "r" (input), [output] "r" (output),
-                      [i] "r" (i), [out_len] "r" (out_len)
-                    : "ymm0", "memory"
-                );
-                i += 32;
-                out_len += 32;
-            } else {
-                break;
-            }
-        }
-    #endif
-    for (; i < size && out_len < capacity - 1; ) {
-        unsigned char c = (unsigned char)input[i++];
-        switch (state) {
-            case 0:
-                if (c == '/') {
-                    if (i < size) {
-                        unsigned char c2 = (unsigned char)input[i];
-                        if (c2 == '/') {
-                            state = 1;
-                            i++;
-                            continue;
-                        } else if (c2 == '*') {
-                            state = 2;
-                            i++;
-                            continue;
-                        }
-                    }
-                    output[out_len++] = c;
-                } else if (c == '"') {
-                    state = 3;
-                    output[out_len++] = c;
-                } else if (c == '`') {
-                    state = 4;
-                    output[out_len++] = c;
-                } else if (c == '\'') {
-                    state = 5;
-                    output[out_len++] = c;
-                } else {
-                    output[out_len++] = c;
-                }
-                break;
-            case 1:
-                if (c == '\n') {
-                    output[out_len++] = c;
-                    state = 0;
-                }
-                break;
-            case 2:
-                if (c == '\n') {
-                    output[out_len++] = c;
-                } else if (c == '*') {
-                    if (i < size && input[i] == '/') {
-                        i++;
-                        state = 0;
-                    }
-                }
-                break;
-            case 3:
-                if (c == '\\' && i < size) {
-                    output[out_len++] = c;
-                    c = (unsigned char)input[i++];
-                    if (out_len < capacity - 1)
-                        output[out_len++] = c;
-                } else {
-                    if (c == '"')
-                        state = 0;
-                    output[out_len++] = c;
-                }
-                break;
-            case 4:
-                if (c == '`')
-                    state = 0;
-                output[out_len++] = c;
-                break;
-            case 5:
-                if (c == '\\' && i < size) {
-                    output[out_len++] = c;
-                    c = (unsigned char)input[i++];
-                    if (out_len < capacity - 1)
-                        output[out_len++] = c;
-                } else {
-                    if (c == '\'')
-                        state = 0;
-                    output[out_len++] = c;
-                }
-                break;
+
+static void trace_record(const char *name, uint64_t start, const char *detail) {
+    TraceRing *r = t_trace_ring;
+    if (!r && (r = t_trace_ring = trace_ring_register()) == NULL)
+        return;
+    if (r->head == r->cap && r->cap < TRACE_RING_EVENTS) {
+        TraceEvent *ev = (TraceEvent*)realloc(r->ev, r->cap * 2 * sizeof(TraceEvent));
+        if (ev) {
+            r->ev = ev;
+            r->cap *= 2;
         }
     }
-    if (out_len < capacity)
-        output[out_len] = '\0';
-    return out_len;
-}
-    
-static int process_one_file(const char *path, long *pLineCount) {
-    FILE *fp = fopen(path, "rb");
-    if (!fp) {
-        fprintf(stderr, "Failed to open file: '%s': %s\n", path, strerror(errno));
-        return -1;
+    TraceEvent *e = &r->ev[r->head++ % r->cap];
+    e->name = name;
+    e->start_ns = start;
+    e->dur_ns = trace_now() - start;
+    e->detail[0] = '\0';
+    if (detail) {
+        /* Keep the tail of long paths, it is the part that tells files apart. */
+        size_t len = strlen(detail);
+        if (len >= TRACE_DETAIL_MAX)
+            detail += len - (TRACE_DETAIL_MAX - 1);
+        memcpy(e->detail, detail, strlen(detail) + 1);
     }
+}
 
-    fseek(fp, 0, SEEK_END);
-    long sz = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+static inline uint64_t trace_begin(void) {
+    return g_trace_enabled ? trace_now() : 0;
+}
 
-    char *input = (char*)malloc(sz + 1);
-    if (!input) {
-        fclose(fp);
-        fprintf(stderr, "Memory allocation failed (input buffer)\n");
-        return -1;
+static inline void trace_end(const char *name, uint64_t start, const char *detail) {
+    if (g_trace_enabled)
+        trace_record(name, start, detail);
+}
+
+static void trace_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
     }
+    fputc('"', fp);
+}
 
-    size_t read_bytes = fread(input, 1, sz, fp);
-    if (read_bytes != (size_t)sz) {
-        fprintf(stderr, "Failed to read entire file: '%s' (%zu / %ld bytes read)\n", path, read_bytes, sz);
-        fclose(fp);
-        free(input);
+/* Writes every ring; call once all traced threads have been joined. */
+static int trace_write(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open '%s' for writing: %s\n", path, strerror(errno));
         return -1;
     }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
+    fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"goline\"}}", fp);
+    size_t dropped = 0;
+    for (TraceRing *r = g_trace_rings; r; r = r->next) {
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", r->tid);
+        trace_json_string(fp, r->thread_name);
+        fputs("}}", fp);
+        size_t first = r->head > r->cap ? r->head - r->cap : 0;
+        dropped += first;
+        for (size_t i = first; i < r->head; i++) {
+            const TraceEvent *e = &r->ev[i % r->cap];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"goline\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f",
+                    e->name, r->tid, e->start_ns / 1e3, e->dur_ns / 1e3);
+            if (e->detail[0]) {
+                fputs(",\"args\":{\"path\":", fp);
+                trace_json_string(fp, e->detail);
+                fputc('}', fp);
+            }
+            fputc('}', fp);
+        }
+    }
+    fputs("\n]}\n", fp);
+    int rc = 0;
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+        rc = -1;
+    }
+    if (dropped)
+        fprintf(stderr, "Trace: %zu oldest spans were overwritten\n", dropped);
+    return rc;
+}
 
-    fclose(fp);
-    input[sz] = '\0';
+static void trace_free(void) {
+    while (g_trace_rings) {
+        TraceRing *r = g_trace_rings;
+        g_trace_rings = r->next;
+        free(r->ev);
+        free(r);
+    }
+}
 
-    char *output = (char*)malloc(sz + 1);
-    if (!output) {
-        free(input);
-        fprintf(stderr, "Memory allocation failed (output buffer)\n");
-        return -1;
+/* Appends a finished entry, taking ownership of its path. Returns its index. */
+static size_t append_go_file(GoFileList *list, const GoFile *file) {
+    if (list->size == list->capacity) {
+        size_t new_cap = (list->capacity == 0) ? 64 : list->capacity * 2;
+        GoFile *new_data = (GoFile *)realloc(list->data, new_cap * sizeof(GoFile));
+        if (!new_data) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        list->data = new_data;
+        list->capacity = new_cap;
     }
+    list->data[list->size] = *file;
+    return list->size++;
+}
 
-    long out_len = remove_comments(input, output, sz, sz + 1);
-    if (out_len < 0)
-        out_len = 0;
-    if (out_len < sz + 1)
-        output[out_len] = '\0';
+/*
+ * Content hash used by --dedup. Four independent 64-bit multiply/rotate lanes
+ * (the XXH64 round) consume 32-byte stripes, so the compiler can keep all lanes
+ * in flight at once; the lanes are folded into a 128-bit digest at the end.
+ */
+#define HASH_P1 0x9E3779B185EBCA87ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH_P3 0x165667B19E3779F9ULL
+#define HASH_P4 0x85EBCA77C2B2AE63ULL
+#define HASH_P5 0x27D4EB2F165667C5ULL
 
-    long lines = count_non_empty_lines(output, out_len);
-    *pLineCount = lines;
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} Hash128;
 
-    free(input);
-    free(output);
-    return 0;
+typedef struct {
+    uint64_t acc[4];
+    uint64_t total;
+    unsigned char tail[32];
+    size_t tail_len;
+} ContentHasher;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
 }
 
-    
-static void find_go_files(const char *root, GoFileList *list) {
-    DIR *dir = opendir(root);
-    if (!dir)
-        return;
-    
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-        char fullpath[PATH_MAX];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", root, entry->d_name);
-        
-        struct stat st;
-        if (stat(fullpath, &st) == 0 && S_ISDIR(st.st_mode)) {
-            find_go_files(fullpath, list);
-        } else {
-            size_t len = fast_strlen(entry->d_name);
-            if (len > 3 && strcasecmp(entry->d_name + (len - 3), ".go") == 0) {
-                push_go_file(list, fullpath);
-            }
-        }
-    }
-    closedir(dir);
+static inline uint64_t read_u64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
-    
-static long compute_dir_go_lines(const char *dir, const GoFileList *list) {
-    long sum = 0;
-    size_t dlen = fast_strlen(dir);
-    for (size_t i = 0; i < list->size; i++) {
-        const char *p = list->data[i].path;
-        if (strncasecmp(p, dir, dlen) == 0) {
-            char c = p[dlen];
-            if (c == '\0' || c == '/')
-                sum += list->data[i].line_count;
-        }
-    }
-    return sum;
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t lane) {
+    acc += lane * HASH_P2;
+    acc = rotl64(acc, 31);
+    return acc * HASH_P1;
 }
-    
-static int has_go_file_in_dir(const char *dir, const GoFileList *list) {
-    long lines = compute_dir_go_lines(dir, list);
-    return (lines > 0);
+
+static inline uint64_t hash_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
 }
-    
-static void print_progress_bar_with_filename(size_t current, size_t total, const char *filepath) {
-    int barWidth = 50;
-    double progress = (double)current / (double)total;
-    int pos = (int)(barWidth * progress);
-    
-    const char *filename = strrchr(filepath, '/');
-    if (filename)
-        filename++;
-    else
-        filename = filepath;
-    
-    printf("\r%-80s\r", "");
-    
-    printf("[");
-    for (int i = 0; i < barWidth; i++) {
-        if (i < pos)
-            printf("=");
-        else if (i == pos)
-            printf(">");
-        else
-            printf(" ");
+
+static void hasher_init(ContentHasher *hs) {
+    hs->acc[0] = HASH_P1 + HASH_P2;
+    hs->acc[1] = HASH_P2;
+    hs->acc[2] = 0;
+    hs->acc[3] = (uint64_t)0 - HASH_P1;
+    hs->total = 0;
+    hs->tail_len = 0;
+}
+
+static void hasher_stripes(ContentHasher *hs, const unsigned char *p, size_t n) {
+    uint64_t a0 = hs->acc[0], a1 = hs->acc[1], a2 = hs->acc[2], a3 = hs->acc[3];
+    for (size_t i = 0; i + 32 <= n; i += 32) {
+        a0 = hash_round(a0, read_u64(p + i));
+        a1 = hash_round(a1, read_u64(p + i + 8));
+        a2 = hash_round(a2, read_u64(p + i + 16));
+        a3 = hash_round(a3, read_u64(p + i + 24));
     }
-    printf("] %3d%%  (%s)", (int)(progress * 100), filename);
-    fflush(stdout);
+    hs->acc[0] = a0;
+    hs->acc[1] = a1;
+    hs->acc[2] = a2;
+    hs->acc[3] = a3;
 }
-    
-typedef struct {
-    char name[PATH_MAX];
-    int is_dir;
-} DirEntry;
-    
-static void print_tree_only_go(const char *dir, const char *prefix, int is_last, const GoFileList *list) {
-    long sum = compute_dir_go_lines(dir, list);
-    if (sum == 0)
-        return;
 
-    const char *slash = strrchr(dir, '/');
-    const char *basename = slash ? (slash + 1) : dir;
+static void hasher_update(ContentHasher *hs, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char*)data;
+    hs->total += len;
+    if (hs->tail_len) {
+        size_t fill = 32 - hs->tail_len;
+        if (fill > len)
+            fill = len;
+        memcpy(hs->tail + hs->tail_len, p, fill);
+        hs->tail_len += fill;
+        p += fill;
+        len -= fill;
+        if (hs->tail_len < 32)
+            return;
+        hasher_stripes(hs, hs->tail, 32);
+        hs->tail_len = 0;
+    }
+    size_t body = len & ~(size_t)31;
+    hasher_stripes(hs, p, body);
+    memcpy(hs->tail, p + body, len - body);
+    hs->tail_len = len - body;
+}
 
-    if (prefix[0] == '\0') {
-        printf("%s  %ld lines\n", basename, sum);
-    } else {
-        printf("%s%s%s  %ld lines\n",
-               prefix,
-               (is_last ? "└── " : "├── "),
-               basename,
-               sum);
+static Hash128 hasher_final(const ContentHasher *hs) {
+    const uint64_t *a = hs->acc;
+    uint64_t lo = rotl64(a[0], 1) + rotl64(a[1], 7) + rotl64(a[2], 12) + rotl64(a[3], 18);
+    uint64_t hi = (a[0] ^ rotl64(a[2], 29)) * HASH_P4 + (a[1] ^ rotl64(a[3], 41)) * HASH_P5;
+    size_t i = 0;
+    for (; i + 8 <= hs->tail_len; i += 8) {
+        uint64_t k = read_u64(hs->tail + i);
+        lo = rotl64(lo ^ hash_round(0, k), 27) * HASH_P1 + HASH_P4;
+        hi = rotl64(hi + hash_round(0, k), 31) * HASH_P2 + HASH_P3;
+    }
+    for (; i < hs->tail_len; i++) {
+        lo = rotl64(lo ^ (hs->tail[i] * HASH_P5), 11) * HASH_P1;
+        hi = rotl64(hi + (hs->tail[i] * HASH_P1), 13) * HASH_P2;
     }
+    Hash128 h;
+    h.lo = hash_avalanche(lo ^ hs->total);
+    h.hi = hash_avalanche(hi + hs->total * HASH_P3) ^ h.lo;
+    return h;
+}
 
-    char newPrefix[256];
-    snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix, (is_last ? "    " : "│   "));
+/*
+ * Memoized line counts keyed by (content hash, size). The table is split into
+ * shards with their own lock so workers only contend on the same shard.
+ */
+#define DEDUP_SHARDS 64
+#define DEDUP_SHARD_INIT 256
 
-    DIR *dp = opendir(dir);
-    if (!dp)
-        return;
+typedef struct {
+    Hash128 hash;
+    long size;
+    long lines;
+    long complexity;
+    FuncSpan *funcs;
+    size_t nfuncs;
+    int used;
+} DedupEntry;
 
-    struct dirent *entry;
-    DirEntry items[1000];
-    int count = 0;
-    while ((entry = readdir(dp)) != NULL && count < 1000) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+typedef struct {
+    pthread_mutex_t lock;
+    DedupEntry *slots;
+    size_t capacity;
+    size_t count;
+} DedupShard;
 
-        items[count].is_dir = 0;
-        fast_strcpy(items[count].name, entry->d_name, sizeof(items[count].name));
+static DedupShard g_dedup[DEDUP_SHARDS];
+static long g_dedup_files_saved;
+static long long g_dedup_bytes_saved;
 
-        char full[PATH_MAX];
-        int written = snprintf(full, sizeof(full), "%s/%s", dir, entry->d_name);
-        if (written < 0 || written >= sizeof(full)) {
-            fprintf(stderr, "Path too long: '%s/%s'\n", dir, entry->d_name);
-            continue;
-        }
+static void dedup_init(void) {
+    for (int i = 0; i < DEDUP_SHARDS; i++) {
+        pthread_mutex_init(&g_dedup[i].lock, NULL);
+        g_dedup[i].slots = NULL;
+        g_dedup[i].capacity = 0;
+        g_dedup[i].count = 0;
+    }
+}
 
-        struct stat st;
-        if (stat(full, &st) == 0 && S_ISDIR(st.st_mode))
-            items[count].is_dir = 1;
-        count++;
+static void dedup_free(void) {
+    for (int i = 0; i < DEDUP_SHARDS; i++) {
+        for (size_t j = 0; j < g_dedup[i].capacity; j++)
+            free(g_dedup[i].slots[j].funcs);
+        free(g_dedup[i].slots);
+        g_dedup[i].slots = NULL;
+        pthread_mutex_destroy(&g_dedup[i].lock);
     }
-    closedir(dp);
+}
 
-    for (int i = 0; i < count - 1; i++) {
-        for (int j = i + 1; j < count; j++) {
-            if (strcasecmp(items[i].name, items[j].name) > 0) {
-                DirEntry tmp = items[i];
-                items[i] = items[j];
-                items[j] = tmp;
+static size_t dedup_unique_count(void) {
+    size_t n = 0;
+    for (int i = 0; i < DEDUP_SHARDS; i++)
+        n += g_dedup[i].count;
+    return n;
+}
+
+static DedupShard *dedup_shard(Hash128 h) {
+    return &g_dedup[h.hi >> 58];
+}
+
+static DedupEntry *dedup_probe(DedupEntry *slots, size_t capacity, Hash128 h, long size) {
+    size_t idx = (size_t)h.lo & (capacity - 1);
+    for (;;) {
+        DedupEntry *e = &slots[idx];
+        if (!e->used)
+            return e;
+        if (e->hash.lo == h.lo && e->hash.hi == h.hi && e->size == size)
+            return e;
+        idx = (idx + 1) & (capacity - 1);
+    }
+}
+
+/* On a hit, fills in file's counts and a private copy of the memoized function spans. */
+static int dedup_lookup(Hash128 h, long size, GoFile *file) {
+    DedupShard *sh = dedup_shard(h);
+    int found = 0;
+    pthread_mutex_lock(&sh->lock);
+    if (sh->capacity) {
+        DedupEntry *e = dedup_probe(sh->slots, sh->capacity, h, size);
+        if (e->used) {
+            file->line_count = e->lines;
+            file->complexity = e->complexity;
+            found = 1;
+            if (e->nfuncs) {
+                file->funcs = (FuncSpan*)malloc(e->nfuncs * sizeof(FuncSpan));
+                if (file->funcs) {
+                    memcpy(file->funcs, e->funcs, e->nfuncs * sizeof(FuncSpan));
+                    file->nfuncs = e->nfuncs;
+                }
             }
         }
     }
+    pthread_mutex_unlock(&sh->lock);
+    return found;
+}
 
-    int realCount = 0;
-    for (int i = 0; i < count; i++) {
-        char full[PATH_MAX];
-        int written = snprintf(full, sizeof(full), "%s/%s", dir, items[i].name);
-        if (written < 0 || written >= sizeof(full)) {
-            fprintf(stderr, "Path too long: '%s/%s'\n", dir, items[i].name);
-            continue;
+static void dedup_insert(Hash128 h, long size, const GoFile *file) {
+    DedupShard *sh = dedup_shard(h);
+    pthread_mutex_lock(&sh->lock);
+    if ((sh->count + 1) * 4 > sh->capacity * 3) {
+        size_t new_cap = sh->capacity ? sh->capacity * 2 : DEDUP_SHARD_INIT;
+        DedupEntry *slots = (DedupEntry*)calloc(new_cap, sizeof(DedupEntry));
+        if (!slots) {
+            pthread_mutex_unlock(&sh->lock);
+            return;
         }
-
-        if (items[i].is_dir) {
-            if (has_go_file_in_dir(full, list))
-                realCount++;
-        } else {
-            size_t ln = fast_strlen(items[i].name);
-            if (ln > 3 && strcasecmp(items[i].name + (ln - 3), ".go") == 0)
-                realCount++;
+        for (size_t i = 0; i < sh->capacity; i++) {
+            if (sh->slots[i].used)
+                *dedup_probe(slots, new_cap, sh->slots[i].hash, sh->slots[i].size) = sh->slots[i];
         }
+        free(sh->slots);
+        sh->slots = slots;
+        sh->capacity = new_cap;
     }
-
-    int passIndex = 0;
-    for (int i = 0; i < count; i++) {
-        char full[PATH_MAX];
-        int written = snprintf(full, sizeof(full), "%s/%s", dir, items[i].name);
-        if (written < 0 || written >= sizeof(full)) {
-            fprintf(stderr, "Path too long: '%s/%s'\n", dir, items[i].name);
-            continue;
+    DedupEntry *e = dedup_probe(sh->slots, sh->capacity, h, size);
+    if (!e->used) {
+        e->hash = h;
+        e->size = size;
+        e->lines = file->line_count;
+        e->complexity = file->complexity;
+        e->funcs = NULL;
+        e->nfuncs = 0;
+        if (file->nfuncs && (e->funcs = (FuncSpan*)malloc(file->nfuncs * sizeof(FuncSpan))) != NULL) {
+            memcpy(e->funcs, file->funcs, file->nfuncs * sizeof(FuncSpan));
+            e->nfuncs = file->nfuncs;
         }
+        e->used = 1;
+        sh->count++;
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
 
-        int lastChild = 0;
-        if (items[i].is_dir) {
-            if (!has_go_file_in_dir(full, list))
-                continue;
-            passIndex++;
-            lastChild = (passIndex == realCount);
-            print_tree_only_go(full, newPrefix, lastChild, list);
-        } else {
-            size_t ln = fast_strlen(items[i].name);
-            if (!(ln > 3 && strcasecmp(items[i].name + (ln - 3), ".go") == 0))
+/*
+ * --duplicates: copy-paste detection on the lexer output. Every window of W
+ * consecutive code lines gets a rolling hash of its whitespace-stripped lines,
+ * and winnowing keeps the rightmost minimum of each run of DUP_GUARD window
+ * hashes, so any copy at least W + DUP_GUARD - 1 lines long shares a
+ * fingerprint. Import declarations are not fingerprinted. Fingerprints go to a
+ * sharded table; when the memory of the run would exceed --dup-memory, the
+ * table keeps only hashes whose low sample_bits are zero, i.e. half of the
+ * hash space per step. Each file also keeps its line hashes, so a shared
+ * fingerprint can be extended line by line to the full length of the copy.
+ */
+#define DUP_DEFAULT_WINDOW 6
+#define DUP_MAX_WINDOW 64
+#define DUP_GUARD 4
+#define DUP_SHARDS 64
+#define DUP_DEFAULT_MEMORY (128L << 20)
+#define DUP_DEFAULT_BLOCKS 20
+
+/*
+ * Bytes per table entry at the peak of dup_finish(): either the shards plus
+ * the merged array, or the merged array plus a hit and a block per entry.
+ */
+#define DUP_FINISH_BYTES (sizeof(DupPrint) + sizeof(DupHit) + sizeof(DupBlock))
+#define DUP_LINE_BYTES (sizeof(uint64_t) + sizeof(uint32_t))
+
+/* Per-file duplicate stats, shared by every copy of the file's GoFile. */
+typedef struct DupFile {
+    const char *path;
+    long hashed_lines;
+    long prints;
+    long shared;
+    long dup_lines;
+    /* Per hashed line, unless they did not fit in the memory budget. */
+    uint64_t *line_hash;
+    uint32_t *src_line;
+} DupFile;
+
+/* Window of code lines [line, line + W) by ordinal; src_* are source line numbers. */
+typedef struct {
+    uint64_t hash;
+    DupFile *file;
+    uint32_t line;
+    uint32_t src_start;
+    uint32_t src_end;
+} DupPrint;
+
+typedef struct {
+    pthread_mutex_t lock;
+    DupPrint *data;
+    size_t size;
+    size_t capacity;
+} DupShard;
+
+/* A run of overlapping shared windows in one file. */
+typedef struct {
+    const DupFile *file;
+    long lines;
+    uint32_t src_start;
+    uint32_t src_end;
+    const DupFile *other;
+    uint32_t other_start;
+    size_t copies;
+} DupBlock;
+
+typedef struct {
+    const DupPrint *print;
+    const DupPrint *other;
+    size_t copies;
+} DupHit;
+
+static DupShard g_dup[DUP_SHARDS];
+static pthread_mutex_t g_dup_resample_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_dup_count;
+static size_t g_dup_table_bytes;
+static size_t g_dup_line_bytes;
+static int g_dup_bits;
+static DupPrint *g_dup_all;
+static size_t g_dup_nall;
+static DupBlock *g_dup_blocks;
+static size_t g_dup_nblocks;
+
+static void dup_init(void) {
+    for (int i = 0; i < DUP_SHARDS; i++) {
+        pthread_mutex_init(&g_dup[i].lock, NULL);
+        g_dup[i].data = NULL;
+        g_dup[i].size = 0;
+        g_dup[i].capacity = 0;
+    }
+}
+
+/* Whether count table entries would take the run past --dup-memory at its peak. */
+static int dup_over_budget(size_t count) {
+    size_t table = __atomic_load_n(&g_dup_table_bytes, __ATOMIC_RELAXED) + count * sizeof(DupPrint);
+    size_t finish = count * DUP_FINISH_BYTES;
+    size_t peak = (table > finish ? table : finish) + __atomic_load_n(&g_dup_line_bytes, __ATOMIC_RELAXED);
+    return peak > (size_t)g_opts.dup_memory;
+}
+
+static void dup_free(void) {
+    for (int i = 0; i < DUP_SHARDS; i++) {
+        free(g_dup[i].data);
+        g_dup[i].data = NULL;
+        pthread_mutex_destroy(&g_dup[i].lock);
+    }
+    free(g_dup_all);
+    free(g_dup_blocks);
+    g_dup_all = NULL;
+    g_dup_blocks = NULL;
+}
+
+static inline int dup_sampled(uint64_t h, int bits) {
+    return (h & ((1ULL << bits) - 1)) == 0;
+}
+
+/* Drops fingerprints outside the current sample from every shard and gives back their memory. */
+static void dup_resample(void) {
+    pthread_mutex_lock(&g_dup_resample_lock);
+    while (dup_over_budget(__atomic_load_n(&g_dup_count, __ATOMIC_RELAXED)) && g_dup_bits < 63) {
+        int bits = __atomic_add_fetch(&g_dup_bits, 1, __ATOMIC_RELAXED);
+        size_t total = 0;
+        for (int i = 0; i < DUP_SHARDS; i++) {
+            DupShard *sh = &g_dup[i];
+            pthread_mutex_lock(&sh->lock);
+            size_t kept = 0;
+            for (size_t j = 0; j < sh->size; j++) {
+                if (dup_sampled(sh->data[j].hash, bits))
+                    sh->data[kept++] = sh->data[j];
+            }
+            sh->size = kept;
+            size_t new_cap = kept ? kept : 1;
+            DupPrint *data = (DupPrint*)realloc(sh->data, new_cap * sizeof(DupPrint));
+            if (data && new_cap < sh->capacity) {
+                __atomic_fetch_sub(&g_dup_table_bytes, (sh->capacity - new_cap) * sizeof(DupPrint),
+                                   __ATOMIC_RELAXED);
+                sh->data = data;
+                sh->capacity = new_cap;
+            }
+            total += kept;
+            pthread_mutex_unlock(&sh->lock);
+        }
+        __atomic_store_n(&g_dup_count, total, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&g_dup_resample_lock);
+}
+
+static void dup_insert(const DupPrint *prints, size_t n) {
+    int bits = __atomic_load_n(&g_dup_bits, __ATOMIC_RELAXED);
+    size_t added = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (!dup_sampled(prints[k].hash, bits))
+            continue;
+        DupShard *sh = &g_dup[(prints[k].hash >> 32) & (DUP_SHARDS - 1)];
+        pthread_mutex_lock(&sh->lock);
+        if (sh->size == sh->capacity) {
+            size_t new_cap = sh->capacity ? sh->capacity * 2 : 256;
+            DupPrint *data = (DupPrint*)realloc(sh->data, new_cap * sizeof(DupPrint));
+            if (!data) {
+                pthread_mutex_unlock(&sh->lock);
                 continue;
-            passIndex++;
-            lastChild = (passIndex == realCount);
-            long lines = 0;
-            for (size_t k = 0; k < list->size; k++) {
-                if (strcasecmp(list->data[k].path, full) == 0) {
-                    lines = list->data[k].line_count;
-                    break;
+            }
+            __atomic_fetch_add(&g_dup_table_bytes, (new_cap - sh->capacity) * sizeof(DupPrint), __ATOMIC_RELAXED);
+            sh->data = data;
+            sh->capacity = new_cap;
+        }
+        sh->data[sh->size++] = prints[k];
+        pthread_mutex_unlock(&sh->lock);
+        added++;
+    }
+    if (dup_over_budget(__atomic_add_fetch(&g_dup_count, added, __ATOMIC_RELAXED)))
+        dup_resample();
+}
+
+/* Column-0 `import` declaration; sets *pBlock for the parenthesized form. */
+static int is_import_line(const char *p, long len, int *pBlock) {
+    if (len < 7 || memcmp(p, "import", 6) != 0 || (p[6] != ' ' && p[6] != '\t' && p[6] != '(' && p[6] != '"'))
+        return 0;
+    *pBlock = memchr(p, '(', (size_t)len) != NULL && memchr(p, ')', (size_t)len) == NULL;
+    return 1;
+}
+
+/*
+ * Counts the non-empty lines of comment-free code like goline_count_code_lines()
+ * and records the file's winnowed fingerprints in the same pass.
+ */
+static long dup_scan(GoFile *file, const char *out, long len) {
+    int window = g_opts.duplicates;
+    DupFile *df = (DupFile*)calloc(1, sizeof(DupFile));
+    DupPrint *prints = NULL;
+    size_t nprints = 0, cap = 0;
+    uint64_t *all_hash = NULL;
+    uint32_t *all_src = NULL;
+    size_t all_cap = 0;
+    int keep_lines = 1;
+    uint64_t line_hash[DUP_MAX_WINDOW];
+    uint32_t src_line[DUP_MAX_WINDOW + DUP_GUARD];
+    uint64_t guard[DUP_GUARD];
+    long guard_pos[DUP_GUARD];
+    int span = window + DUP_GUARD;
+    int r = 0, min = 0;
+    long recorded = -1;
+    uint64_t bw = 1, rolling = 0;
+    for (int k = 0; k < window; k++)
+        bw *= HASH_P2;
+    for (int k = 0; k < DUP_GUARD; k++) {
+        guard[k] = UINT64_MAX;
+        guard_pos[k] = -1;
+    }
+    if (df)
+        df->path = file->path;
+
+    long lines = 0, ord = 0;
+    int in_import = 0;
+    uint32_t src = 0;
+    long i = 0;
+    while (i < len) {
+        const char *line = out + i;
+        const char *nl = (const char*)memchr(line, '\n', (size_t)(len - i));
+        long line_len = nl ? nl - line : len - i;
+        i += line_len + 1;
+        src++;
+        uint64_t h = HASH_P5;
+        long content = 0;
+        for (long k = 0; k < line_len; k++) {
+            unsigned char c = (unsigned char)line[k];
+            if (c == ' ' || c == '\t' || c == '\r')
+                continue;
+            h = (h ^ c) * HASH_P1;
+            content++;
+        }
+        if (content == 0)
+            continue;
+        lines++;
+        int block;
+        if (in_import) {
+            long k = 0;
+            while (k < line_len && (line[k] == ' ' || line[k] == '\t'))
+                k++;
+            if (k < line_len && line[k] == ')')
+                in_import = 0;
+            continue;
+        }
+        if (is_import_line(line, line_len, &block)) {
+            in_import = block;
+            continue;
+        }
+        if (!df)
+            continue;
+
+        h = hash_avalanche(h);
+        if (keep_lines && (size_t)ord == all_cap) {
+            size_t new_cap = all_cap ? all_cap * 2 : 256;
+            uint64_t *ah = (uint64_t*)realloc(all_hash, new_cap * sizeof(uint64_t));
+            if (ah)
+                all_hash = ah;
+            uint32_t *as = ah ? (uint32_t*)realloc(all_src, new_cap * sizeof(uint32_t)) : NULL;
+            if (as)
+                all_src = as;
+            if (ah && as)
+                all_cap = new_cap;
+            else
+                keep_lines = 0;
+        }
+        if (keep_lines) {
+            all_hash[ord] = h;
+            all_src[ord] = src;
+        }
+        int slot = (int)(ord % window);
+        rolling = rolling * HASH_P2 + h;
+        if (ord >= window)
+            rolling -= line_hash[slot] * bw;
+        line_hash[slot] = h;
+        src_line[ord % span] = src;
+        ord++;
+        if (ord < window)
+            continue;
+
+        /* Winnowing: keep the rightmost minimum of the last DUP_GUARD windows. */
+        long pos = ord - window;
+        r = (r + 1) % DUP_GUARD;
+        guard[r] = hash_avalanche(rolling);
+        guard_pos[r] = pos;
+        if (min == r) {
+            for (int k = (r + DUP_GUARD - 1) % DUP_GUARD; k != r; k = (k + DUP_GUARD - 1) % DUP_GUARD) {
+                if (guard[k] < guard[min])
+                    min = k;
+            }
+        } else if (guard[r] <= guard[min]) {
+            min = r;
+        }
+        if (guard_pos[min] == recorded)
+            continue;
+        recorded = guard_pos[min];
+        if (nprints == cap) {
+            size_t new_cap = cap ? cap * 2 : 64;
+            DupPrint *p = (DupPrint*)realloc(prints, new_cap * sizeof(DupPrint));
+            if (!p)
+                continue;
+            prints = p;
+            cap = new_cap;
+        }
+        DupPrint *fp = &prints[nprints++];
+        fp->hash = guard[min];
+        fp->file = df;
+        fp->line = (uint32_t)recorded;
+        fp->src_start = src_line[recorded % span];
+        fp->src_end = src_line[(recorded + window - 1) % span];
+    }
+
+    if (df) {
+        df->hashed_lines = ord;
+        /* Line hashes are kept only while they use at most half of --dup-memory. */
+        size_t bytes = (size_t)ord * DUP_LINE_BYTES;
+        if (keep_lines && ord > 0 &&
+            __atomic_add_fetch(&g_dup_line_bytes, bytes, __ATOMIC_RELAXED) <= (size_t)g_opts.dup_memory / 2) {
+            uint64_t *ah = (uint64_t*)realloc(all_hash, (size_t)ord * sizeof(uint64_t));
+            uint32_t *as = (uint32_t*)realloc(all_src, (size_t)ord * sizeof(uint32_t));
+            df->line_hash = ah ? ah : all_hash;
+            df->src_line = as ? as : all_src;
+            all_hash = NULL;
+            all_src = NULL;
+        } else if (keep_lines && ord > 0) {
+            __atomic_fetch_sub(&g_dup_line_bytes, bytes, __ATOMIC_RELAXED);
+        }
+        file->dup = df;
+        dup_insert(prints, nprints);
+    }
+    free(all_hash);
+    free(all_src);
+    free(prints);
+    return lines;
+}
+
+static int compare_dup_prints(const void *a, const void *b) {
+    uint64_t ha = ((const DupPrint*)a)->hash;
+    uint64_t hb = ((const DupPrint*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+/* Orders copies by path, then position, so reports do not depend on scheduling. */
+static int dup_print_before(const DupPrint *a, const DupPrint *b) {
+    int c = strcmp(a->file->path, b->file->path);
+    return c < 0 || (c == 0 && a->src_start < b->src_start);
+}
+
+/* Groups hits by file; the order of files does not matter here. */
+static int compare_dup_hits(const void *a, const void *b) {
+    const DupPrint *pa = ((const DupHit*)a)->print;
+    const DupPrint *pb = ((const DupHit*)b)->print;
+    if (pa->file != pb->file)
+        return ((uintptr_t)pa->file > (uintptr_t)pb->file) - ((uintptr_t)pa->file < (uintptr_t)pb->file);
+    return (pa->line > pb->line) - (pa->line < pb->line);
+}
+
+static int compare_dup_blocks(const void *a, const void *b) {
+    const DupBlock *ba = (const DupBlock*)a;
+    const DupBlock *bb = (const DupBlock*)b;
+    if (ba->lines != bb->lines)
+        return (ba->lines < bb->lines) - (ba->lines > bb->lines);
+    int c = strcmp(ba->file->path, bb->file->path);
+    if (c != 0)
+        return c;
+    return (ba->src_start > bb->src_start) - (ba->src_start < bb->src_start);
+}
+
+/*
+ * Last hashed line of the copy at p that matches q line by line, starting
+ * from the end of their shared window.
+ */
+static long dup_extend_right(const DupPrint *p, const DupPrint *q, int window) {
+    long i = (long)p->line + window - 1, j = (long)q->line + window - 1;
+    const DupFile *a = p->file, *b = q->file;
+    if (!a->line_hash || !b->line_hash)
+        return i;
+    while (i + 1 < a->hashed_lines && j + 1 < b->hashed_lines && a->line_hash[i + 1] == b->line_hash[j + 1])
+        i++, j++;
+    return i;
+}
+
+/* First hashed line of the copy at p that matches q, not going below floor. */
+static long dup_extend_left(const DupPrint *p, const DupPrint *q, long floor) {
+    long i = (long)p->line, j = (long)q->line;
+    const DupFile *a = p->file, *b = q->file;
+    if (!a->line_hash || !b->line_hash)
+        return i;
+    while (i > floor && j > 0 && a->line_hash[i - 1] == b->line_hash[j - 1])
+        i--, j--;
+    return i;
+}
+
+/*
+ * Runs after all workers are done. A fingerprint seen more than once marks its
+ * window as duplicated in every file that has it, and the window is extended
+ * both ways for as long as the lines of the two copies match, so an exact
+ * copy counts in full and not just the windows winnowing kept. Overlapping
+ * duplicated ranges of a file are merged into blocks, whose total is the
+ * file's duplicated line count. Once the table has been sampled, coverage would
+ * undercount, so a file's count becomes its hashed lines times the share of its
+ * fingerprints that are duplicated.
+ */
+static void dup_finish(void) {
+    int window = g_opts.duplicates;
+    int bits = g_dup_bits;
+    size_t total = 0;
+    for (int i = 0; i < DUP_SHARDS; i++)
+        total += g_dup[i].size;
+    g_dup_all = (DupPrint*)malloc((total ? total : 1) * sizeof(DupPrint));
+    if (!g_dup_all)
+        return;
+    /*
+     * Equal hashes only need to end up adjacent. They share a shard, and within
+     * it a counting pass on the next 8 hash bits leaves buckets small enough
+     * to sort cheaply.
+     */
+    for (int i = 0; i < DUP_SHARDS; i++) {
+        DupShard *sh = &g_dup[i];
+        size_t bucket[257] = { 0 };
+        for (size_t j = 0; j < sh->size; j++) {
+            if (dup_sampled(sh->data[j].hash, bits))
+                bucket[((sh->data[j].hash >> 40) & 0xff) + 1]++;
+        }
+        for (int k = 0; k < 256; k++)
+            bucket[k + 1] += bucket[k];
+        DupPrint *base = g_dup_all + g_dup_nall;
+        g_dup_nall += bucket[256];
+        for (size_t j = 0; j < sh->size; j++) {
+            if (dup_sampled(sh->data[j].hash, bits))
+                base[bucket[(sh->data[j].hash >> 40) & 0xff]++] = sh->data[j];
+        }
+        for (int k = 0; k < 256; k++) {
+            size_t start = k ? bucket[k - 1] : 0;
+            qsort(base + start, bucket[k] - start, sizeof(DupPrint), compare_dup_prints);
+        }
+        free(sh->data);
+        sh->data = NULL;
+        sh->size = sh->capacity = 0;
+    }
+
+    DupHit *hits = (DupHit*)malloc((g_dup_nall ? g_dup_nall : 1) * sizeof(DupHit));
+    g_dup_blocks = (DupBlock*)malloc((g_dup_nall ? g_dup_nall : 1) * sizeof(DupBlock));
+    if (!hits || !g_dup_blocks) {
+        free(hits);
+        return;
+    }
+    size_t nhits = 0;
+    for (size_t a = 0, b; a < g_dup_nall; a = b) {
+        size_t first = a, second = SIZE_MAX;
+        for (b = a + 1; b < g_dup_nall && g_dup_all[b].hash == g_dup_all[a].hash; b++) {
+            if (dup_print_before(&g_dup_all[b], &g_dup_all[first])) {
+                second = first;
+                first = b;
+            } else if (second == SIZE_MAX || dup_print_before(&g_dup_all[b], &g_dup_all[second])) {
+                second = b;
+            }
+        }
+        for (size_t k = a; k < b; k++) {
+            DupFile *df = g_dup_all[k].file;
+            df->prints++;
+            if (b - a < 2)
+                continue;
+            df->shared++;
+            hits[nhits].print = &g_dup_all[k];
+            hits[nhits].other = &g_dup_all[k == first ? second : first];
+            hits[nhits].copies = b - a;
+            nhits++;
+        }
+    }
+    qsort(hits, nhits, sizeof(DupHit), compare_dup_hits);
+
+    for (size_t a = 0, b; a < nhits; a = b) {
+        DupFile *df = hits[a].print->file;
+        long covered = 0, prev_last = -1;
+        for (b = a; b < nhits && hits[b].print->file == df; ) {
+            DupBlock *blk = &g_dup_blocks[g_dup_nblocks];
+            const DupPrint *head = hits[b].print;
+            const DupPrint *other = hits[b].other;
+            long first = dup_extend_left(head, other, prev_last + 1);
+            long last = dup_extend_right(head, other, window);
+            long other_first = (long)other->line - ((long)head->line - first);
+            blk->file = df;
+            blk->src_start = df->src_line ? df->src_line[first] : head->src_start;
+            blk->other = other->file;
+            blk->other_start = other->file->src_line ? other->file->src_line[other_first] : other->src_start;
+            blk->copies = hits[b].copies;
+            uint32_t src_end = head->src_end;
+            for (b++; b < nhits && hits[b].print->file == df && hits[b].print->line <= last + 1; b++) {
+                const DupPrint *p = hits[b].print;
+                if (p->line + window - 1 > last) {
+                    last = dup_extend_right(p, hits[b].other, window);
+                    src_end = p->src_end;
                 }
             }
-            printf("%s%s%s  %ld lines\n",
-                   newPrefix,
-                   (lastChild ? "└── " : "├── "),
-                   items[i].name,
-                   lines);
+            blk->src_end = df->src_line ? df->src_line[last] : src_end;
+            blk->lines = last - first + 1;
+            covered += blk->lines;
+            prev_last = last;
+            /* A set of copies is listed once, from the copy that sorts first. */
+            if (dup_print_before(head, other))
+                g_dup_nblocks++;
+        }
+        if (bits == 0)
+            df->dup_lines = covered;
+        else
+            df->dup_lines = (long)((double)df->hashed_lines * df->shared / df->prints + 0.5);
+    }
+    free(hits);
+    qsort(g_dup_blocks, g_dup_nblocks, sizeof(DupBlock), compare_dup_blocks);
+}
+
+#define READ_CHUNK (1L << 20)
+#define HEADER_CHUNK 4096L
+
+/*
+ * --goos, --goarch, --tags and --no-tests are applied by the library
+ * (goline_name_status(), goline_header_status()); the CLI counts what they
+ * leave out.
+ */
+static goline_ctx *g_goline;
+static long g_tests_skipped;
+static long g_constraint_skipped;
+
+/* parse_args() fills in both GOOS and GOARCH when any of the three is given. */
+static int build_filtering(void) {
+    return g_opts.goos != NULL;
+}
+
+/* Sets up g_goline with the counting options of g_opts. */
+static int open_goline(void) {
+    goline_options o;
+    goline_options_init(&o);
+    if (g_opts.generated_mode == GEN_SKIP)
+        o.generated = GOLINE_GENERATED_SKIP;
+    else if (g_opts.generated_mode == GEN_ONLY)
+        o.generated = GOLINE_GENERATED_ONLY;
+    o.check_text = (g_opts.invalid_files != INVALID_COUNT);
+    o.goos = g_opts.goos;
+    o.goarch = g_opts.goarch;
+    o.tags = g_opts.build_tags;
+    o.skip_tests = g_opts.no_tests;
+    o.follow_symlinks = g_opts.follow_symlinks;
+    o.one_file_system = g_opts.one_file_system;
+    o.jobs = g_opts.jobs;
+    o.split_threshold = (size_t)g_opts.split_threshold;
+    int rc = goline_new(&o, &g_goline);
+    if (rc == GOLINE_ENOMEM)
+        fprintf(stderr, "Memory allocation failed\n");
+    else if (rc != GOLINE_OK)
+        fprintf(stderr, "Invalid counting options\n");
+    return rc;
+}
+
+/*
+ * Checks a listed path by name alone and counts the file when it is left
+ * out. Safe to call from the feeder thread.
+ */
+static int skip_by_build_name(const char *path) {
+    int status = goline_name_status(g_goline, path);
+    if (status == GOLINE_SKIP_TEST)
+        __atomic_fetch_add(&g_tests_skipped, 1, __ATOMIC_RELAXED);
+    else if (status == GOLINE_SKIP_BUILD)
+        __atomic_fetch_add(&g_constraint_skipped, 1, __ATOMIC_RELAXED);
+    return status != GOLINE_COUNTED;
+}
+
+/*
+ * The filters that need the file header. Returns 1 when the file is left
+ * out; file->constrained tells a build-constraint exclusion apart.
+ */
+static int header_excludes(GoFile *file, const char *code, long len) {
+    int status = goline_header_status(g_goline, file->generated, code, (size_t)len);
+    if (status == GOLINE_SKIP_BUILD)
+        file->constrained = 1;
+    return status != GOLINE_COUNTED;
+}
+
+/*
+ * --background: idle I/O class, nice 19, a read-rate cap and page cache
+ * eviction of every file once it has been read.
+ */
+#define BACKGROUND_IO_RATE (32L << 20)
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* Shared token bucket in bytes; reads go into debt and sleep it off. */
+typedef struct {
+    pthread_mutex_t lock;
+    double tokens;
+    double burst;
+    struct timespec last;
+} RateLimiter;
+
+static RateLimiter g_rate = { PTHREAD_MUTEX_INITIALIZER, 0, 0, { 0, 0 } };
+
+static void rate_limit_init(long rate) {
+    g_rate.burst = (double)rate / 10;
+    if (g_rate.burst < (double)(1L << 20))
+        g_rate.burst = (double)(1L << 20);
+    g_rate.tokens = g_rate.burst;
+    clock_gettime(CLOCK_MONOTONIC, &g_rate.last);
+}
+
+static void rate_limit_acquire(long bytes) {
+    if (g_opts.io_rate <= 0 || bytes <= 0)
+        return;
+    struct timespec now;
+    pthread_mutex_lock(&g_rate.lock);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double dt = (double)(now.tv_sec - g_rate.last.tv_sec) + (now.tv_nsec - g_rate.last.tv_nsec) / 1e9;
+    g_rate.last = now;
+    g_rate.tokens += dt * (double)g_opts.io_rate;
+    if (g_rate.tokens > g_rate.burst)
+        g_rate.tokens = g_rate.burst;
+    g_rate.tokens -= (double)bytes;
+    double wait = g_rate.tokens < 0 ? -g_rate.tokens / (double)g_opts.io_rate : 0;
+    pthread_mutex_unlock(&g_rate.lock);
+    if (wait > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+}
+
+/* Applied before the workers start; threads inherit both priorities. */
+static void enter_background_mode(void) {
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        fprintf(stderr, "Failed to set idle I/O priority: %s\n", strerror(errno));
+    errno = 0;
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0)
+        fprintf(stderr, "Failed to lower CPU priority: %s\n", strerror(errno));
+}
+
+/* In background mode the pages just read are dropped from the page cache. */
+static void close_input(int fd) {
+    if (g_opts.background)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/*
+ * A file read into memory and waiting to be lexed: input + bom holds the
+ * code, digest its dedup key.
+ */
+typedef struct {
+    char *input;
+    long size;
+    long bom;
+    Hash128 digest;
+} LoadedFile;
+
+/*
+ * First half of process_one_file(): reads the file and applies the text,
+ * generated-file and dedup checks. Returns 2 when lf is ready to lex, 0 when
+ * the count came from the dedup table, and otherwise what process_one_file()
+ * returns.
+ */
+static int load_one_file(GoFile *file, LoadedFile *lf) {
+    const char *path = file->path;
+    uint64_t t_read = trace_begin();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: '%s': %s\n", path, strerror(errno));
+        file->load_error = LOAD_OPEN_FAILED;
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to read file: '%s': %s\n", path, strerror(errno));
+        file->load_error = LOAD_READ_FAILED;
+        close(fd);
+        return -1;
+    }
+    long sz = (long)st.st_size;
+    file->bytes = sz;
+    if (g_opts.background)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    char *input = (char*)malloc(sz + 1);
+    if (!input) {
+        close_input(fd);
+        fprintf(stderr, "Memory allocation failed (input buffer)\n");
+        return -1;
+    }
+
+    ContentHasher hs;
+    if (g_opts.dedup)
+        hasher_init(&hs);
+
+    int check_text = (g_opts.invalid_files != INVALID_COUNT);
+    size_t text_pos = 0;
+    int decided = 0;
+    long header_limit = HEADER_CHUNK;
+    size_t read_bytes = 0;
+    while (read_bytes < (size_t)sz) {
+        size_t limit = (size_t)sz;
+        if (!decided && (size_t)header_limit < limit)
+            limit = (size_t)header_limit;
+        size_t want = limit - read_bytes;
+        if (want > (size_t)READ_CHUNK)
+            want = (size_t)READ_CHUNK;
+        rate_limit_acquire((long)want);
+        long got = goline_read(fd, input + read_bytes, want);
+        if (got <= 0)
+            break;
+        if (g_opts.dedup)
+            hasher_update(&hs, input + read_bytes, (size_t)got);
+        read_bytes += (size_t)got;
+
+        if (check_text) {
+            int status = goline_text_check(input, read_bytes, read_bytes == (size_t)sz, &text_pos);
+            if (status != GOLINE_COUNTED) {
+                close_input(fd);
+                free(input);
+                file->invalid = status;
+                file->invalid_offset = (long)text_pos;
+                file->excluded = 1;
+                return 1;
+            }
+        }
+
+        if (!decided && read_bytes == limit) {
+            long bom = (long)goline_bom_len(input, read_bytes);
+            file->generated = goline_scan_header(input + bom, read_bytes - bom, read_bytes == (size_t)sz,
+                                                 build_filtering(), &decided);
+            if (!decided) {
+                header_limit *= 2;
+            } else if (header_excludes(file, input + bom, (long)read_bytes - bom)) {
+                close_input(fd);
+                free(input);
+                file->excluded = 1;
+                return 1;
+            }
+        }
+    }
+    if (read_bytes != (size_t)sz) {
+        fprintf(stderr, "Failed to read entire file: '%s' (%zu / %ld bytes read)\n", path, read_bytes, sz);
+        file->load_error = LOAD_READ_FAILED;
+        close_input(fd);
+        free(input);
+        return -1;
+    }
+
+    close_input(fd);
+    input[sz] = '\0';
+    trace_end("open+read", t_read, path);
+
+    /* A leading byte order mark is not code and must not hide a column-0 token. */
+    long bom = (long)goline_bom_len(input, (size_t)sz);
+    if (!decided) {
+        file->generated = goline_scan_header(input + bom, sz - bom, 1, build_filtering(), &decided);
+        if (header_excludes(file, input + bom, sz - bom)) {
+            free(input);
+            file->excluded = 1;
+            return 1;
+        }
+    }
+
+    Hash128 digest = { 0, 0 };
+    if (g_opts.dedup) {
+        digest = hasher_final(&hs);
+        if (dedup_lookup(digest, sz, file)) {
+            for (size_t k = 0; k < file->nfuncs; k++)
+                file->funcs[k].path = path;
+            __atomic_fetch_add(&g_dedup_files_saved, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&g_dedup_bytes_saved, (long long)sz, __ATOMIC_RELAXED);
+            free(input);
+            return 0;
+        }
+    }
+    lf->input = input;
+    lf->size = sz;
+    lf->bom = bom;
+    lf->digest = digest;
+    return 2;
+}
+
+static int needs_func_tracking(void) {
+    return g_opts.max_func_lines > 0 || g_opts.top_funcs > 0 || g_opts.complexity;
+}
+
+/* Only function tracking and --duplicates need the comment-free text. */
+static int needs_lexer_output(void) {
+    return needs_func_tracking() || g_opts.duplicates > 0;
+}
+
+/* Copies the spans goline_strip_funcs() found into file, tagged with its path. */
+static int adopt_funcs(GoFile *file, const goline_funcs *gf) {
+    if (gf->nfuncs) {
+        file->funcs = (FuncSpan*)malloc(gf->nfuncs * sizeof(FuncSpan));
+        if (!file->funcs)
+            return -1;
+        for (size_t k = 0; k < gf->nfuncs; k++) {
+            file->funcs[k].fn = gf->funcs[k];
+            file->funcs[k].path = file->path;
+        }
+        file->nfuncs = gf->nfuncs;
+    }
+    if (g_opts.complexity)
+        file->complexity = (long)gf->nfuncs + gf->decisions;
+    return 0;
+}
+
+static void finish_one_file(GoFile *file, LoadedFile *lf, long lines) {
+    file->line_count = lines;
+    if (g_opts.dedup)
+        dedup_insert(lf->digest, lf->size, file);
+    free(lf->input);
+    lf->input = NULL;
+}
+
+/* Second half of process_one_file() for a file that is lexed on its own. */
+static int lex_one_file(GoFile *file, LoadedFile *lf) {
+    const char *path = file->path;
+    const char *code = lf->input + lf->bom;
+    long len = lf->size - lf->bom;
+    uint64_t t_lex = trace_begin();
+
+    if (needs_lexer_output()) {
+        char *output = (char*)malloc(lf->size + 1);
+        if (!output) {
+            free(lf->input);
+            lf->input = NULL;
+            fprintf(stderr, "Memory allocation failed (output buffer)\n");
+            return -1;
+        }
+        long out_len;
+        if (needs_func_tracking()) {
+            goline_funcs gf;
+            out_len = goline_strip_funcs(g_goline, code, (size_t)len, output, (size_t)lf->size + 1,
+                                         g_opts.complexity, &gf);
+            if (out_len >= 0 && adopt_funcs(file, &gf) != 0)
+                out_len = GOLINE_ENOMEM;
+            goline_funcs_free(g_goline, &gf);
+        } else {
+            out_len = goline_strip_comments(code, (size_t)len, output, (size_t)lf->size + 1);
+        }
+        if (out_len < 0) {
+            free(output);
+            free(lf->input);
+            lf->input = NULL;
+            fprintf(stderr, "Memory allocation failed (function list)\n");
+            return -1;
+        }
+        long lines = g_opts.duplicates ? dup_scan(file, output, out_len) : goline_count_code_lines(output, (size_t)out_len);
+        free(output);
+        trace_end("lex", t_lex, path);
+        finish_one_file(file, lf, lines);
+        return 0;
+    }
+
+    int nchunks = goline_split_chunks(g_goline, (size_t)len);
+    if (nchunks > 1) {
+        long lines = goline_count_lines_split(g_goline, code, len, nchunks);
+        trace_end("lex (split)", t_lex, path);
+        finish_one_file(file, lf, lines);
+        return 0;
+    }
+
+    long lines = goline_count_lines(code, len, len);
+    trace_end("lex", t_lex, path);
+    finish_one_file(file, lf, lines);
+    return 0;
+}
+
+/*
+ * Reads and counts one file. Returns 0 when counted, 1 when the file was
+ * excluded by a filter or rejected as binary or invalid UTF-8 (file->invalid),
+ * -1 on error.
+ */
+static int process_one_file(GoFile *file) {
+    LoadedFile lf;
+    int rc = load_one_file(file, &lf);
+    if (rc != 2)
+        return rc;
+    return lex_one_file(file, &lf);
+}
+
+/*
+ * Counts files[0..n) like process_one_file(), lexing up to GOLINE_INTERLEAVE
+ * small files together with goline_count_lines_n(). Results go to rcs.
+ */
+static void process_file_group(GoFile *files, int *rcs, int n) {
+    LoadedFile lf[GOLINE_INTERLEAVE];
+    const char *bufs[GOLINE_INTERLEAVE];
+    long lens[GOLINE_INTERLEAVE], counts[GOLINE_INTERLEAVE];
+    int slot[GOLINE_INTERLEAVE], alias[GOLINE_INTERLEAVE];
+    int nlex = 0;
+    for (int k = 0; k < n; k++) {
+        rcs[k] = load_one_file(&files[k], &lf[k]);
+        if (rcs[k] != 2)
+            continue;
+        if (needs_lexer_output() || goline_split_chunks(g_goline, (size_t)(lf[k].size - lf[k].bom)) > 1) {
+            rcs[k] = lex_one_file(&files[k], &lf[k]);
+            continue;
+        }
+        /* The dedup table only learns a content after it is lexed, so catch repeats within the group here. */
+        alias[k] = -1;
+        for (int j = 0; g_opts.dedup && j < nlex; j++) {
+            LoadedFile *o = &lf[slot[j]];
+            if (o->size == lf[k].size && o->digest.lo == lf[k].digest.lo && o->digest.hi == lf[k].digest.hi) {
+                alias[k] = j;
+                break;
+            }
+        }
+        if (alias[k] >= 0)
+            continue;
+        bufs[nlex] = lf[k].input + lf[k].bom;
+        lens[nlex] = lf[k].size - lf[k].bom;
+        slot[nlex++] = k;
+    }
+    if (nlex == 0)
+        return;
+    uint64_t t_lex = trace_begin();
+    goline_count_lines_n(bufs, lens, counts, nlex);
+    trace_end(nlex > 1 ? "lex (interleaved)" : "lex", t_lex, files[slot[0]].path);
+    for (int j = 0; j < nlex; j++) {
+        finish_one_file(&files[slot[j]], &lf[slot[j]], counts[j]);
+        rcs[slot[j]] = 0;
+    }
+    for (int k = 0; k < n; k++) {
+        if (rcs[k] != 2)
+            continue;
+        files[k].line_count = counts[alias[k]];
+        __atomic_fetch_add(&g_dedup_files_saved, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&g_dedup_bytes_saved, (long long)lf[k].size, __ATOMIC_RELAXED);
+        free(lf[k].input);
+        rcs[k] = 0;
+    }
+}
+
+
+/*
+ * Small-file slabs. The files of a batched unit are read back to back into
+ * one reused, 64-byte aligned buffer, with a boundary table of where each
+ * file's code starts and ends, and then lexed in a single goline_count_lines()
+ * pass that restarts the DFA at every boundary. Against load_one_file() this
+ * drops the stdio stream, the allocation and the size probes per file (the
+ * walker's st_size is used), and the padding after the last file lets each
+ * 16-byte load run to a file's end without a scalar tail.
+ */
+#define SLAB_ALIGN 64
+#define SLAB_PAD 64
+
+typedef struct {
+    long start;
+    long len;
+    size_t file;
+} SlabSeg;
+
+typedef struct {
+    char *buf;
+    long cap;
+    SlabSeg *segs;
+    GoFile *files;
+    int *rcs;
+    size_t *index;
+    size_t files_cap;
+} Slab;
+
+static void slab_free(Slab *sl) {
+    free(sl->buf);
+    free(sl->segs);
+    free(sl->files);
+    free(sl->rcs);
+    free(sl->index);
+}
+
+/* Function tracking needs the lexer output; --dedup keeps its per-group repeat check. */
+static int slab_eligible(void) {
+    return !needs_lexer_output() && !g_opts.dedup;
+}
+
+static void slab_reserve(Slab *sl, size_t nfiles, long bytes) {
+    if (nfiles > sl->files_cap) {
+        size_t cap = sl->files_cap ? sl->files_cap : 64;
+        while (cap < nfiles)
+            cap *= 2;
+        sl->segs = (SlabSeg*)realloc(sl->segs, cap * sizeof(SlabSeg));
+        sl->files = (GoFile*)realloc(sl->files, cap * sizeof(GoFile));
+        sl->rcs = (int*)realloc(sl->rcs, cap * sizeof(int));
+        sl->index = (size_t*)realloc(sl->index, cap * sizeof(size_t));
+        if (!sl->segs || !sl->files || !sl->rcs || !sl->index) {
+            fprintf(stderr, "Memory allocation failed (slab)\n");
+            exit(1);
+        }
+        sl->files_cap = cap;
+    }
+    if (bytes + SLAB_PAD > sl->cap) {
+        long cap = sl->cap ? sl->cap * 2 : 1L << 16;
+        while (cap < bytes + SLAB_PAD)
+            cap *= 2;
+        void *buf = NULL;
+        if (posix_memalign(&buf, SLAB_ALIGN, (size_t)cap) != 0) {
+            fprintf(stderr, "Memory allocation failed (slab)\n");
+            exit(1);
+        }
+        free(sl->buf);
+        sl->buf = (char*)buf;
+        sl->cap = cap;
+    }
+}
+
+/*
+ * Reads one file of the slab to buf and applies the text, generated-file and
+ * build-constraint checks of load_one_file(). With a header filter active,
+ * only the first HEADER_CHUNK bytes are read until the header has passed.
+ * One byte more than the walk size is asked for, to see whether the file
+ * grew; buf needs room for it. Returns 2 when the file's len bytes are
+ * ready to lex, otherwise what process_one_file() returns; 3 when the file
+ * grew and has to go through process_one_file() instead.
+ */
+static int slab_load(GoFile *file, char *buf, long *len, long *bom) {
+    int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: '%s': %s\n", file->path, strerror(errno));
+        file->load_error = LOAD_OPEN_FAILED;
+        return -1;
+    }
+    long want = file->bytes;
+    int filtered = g_opts.generated_mode != GEN_ALL || build_filtering();
+    long head = filtered && want > HEADER_CHUNK ? HEADER_CHUNK : want;
+    rate_limit_acquire(head);
+    long got = goline_read(fd, buf, head < want ? head : want + 1);
+    int rc = 2;
+    int decided = 0;
+    size_t text_pos = 0;
+    if (got == head && head < want) {
+        long b = (long)goline_bom_len(buf, (size_t)got);
+        file->generated = goline_scan_header(buf + b, got - b, 0, build_filtering(), &decided);
+        if (g_opts.invalid_files != INVALID_COUNT) {
+            int status = goline_text_check(buf, got, 0, &text_pos);
+            if (status != GOLINE_COUNTED) {
+                file->invalid = status;
+                file->invalid_offset = (long)text_pos;
+                rc = 1;
+            }
+        }
+        if (rc == 2 && decided && header_excludes(file, buf + b, got - b))
+            rc = 1;
+        if (rc == 2) {
+            rate_limit_acquire(want - head);
+            long rest = goline_read(fd, buf + got, want - head + 1);
+            got = rest < 0 ? -1 : got + rest;
+        }
+    }
+    if (rc == 2 && got > want)
+        rc = 3;
+    close_input(fd);
+    if (rc == 1) {
+        file->excluded = 1;
+        return 1;
+    }
+    if (got < 0) {
+        fprintf(stderr, "Failed to read file: '%s': %s\n", file->path, strerror(errno));
+        file->load_error = LOAD_READ_FAILED;
+        return -1;
+    }
+    if (rc == 3)
+        return 3;
+
+    file->bytes = got;
+    if (g_opts.invalid_files != INVALID_COUNT) {
+        int status = goline_text_check(buf, got, 1, &text_pos);
+        if (status != GOLINE_COUNTED) {
+            file->invalid = status;
+            file->invalid_offset = (long)text_pos;
+            file->excluded = 1;
+            return 1;
+        }
+    }
+    *bom = (long)goline_bom_len(buf, (size_t)got);
+    if (!decided) {
+        file->generated = goline_scan_header(buf + *bom, got - *bom, 1, build_filtering(), &decided);
+        if (header_excludes(file, buf + *bom, got - *bom)) {
+            file->excluded = 1;
+            return 1;
+        }
+    }
+    *len = got;
+    return 2;
+}
+
+/* Counts sl->files[0..n) through one slab; results go to sl->rcs. */
+static void process_file_slab(Slab *sl, size_t n) {
+    long bytes = 0;
+    for (size_t k = 0; k < n; k++)
+        bytes += sl->files[k].bytes;
+    slab_reserve(sl, n, bytes);
+
+    uint64_t t_read = trace_begin();
+    long pos = 0;
+    size_t nseg = 0;
+    for (size_t k = 0; k < n; k++) {
+        GoFile *f = &sl->files[k];
+        long len = 0, bom = 0;
+        int rc = slab_load(f, sl->buf + pos, &len, &bom);
+        if (rc == 3)
+            rc = process_one_file(f);
+        sl->rcs[k] = rc;
+        if (rc != 2)
+            continue;
+        sl->segs[nseg].start = pos + bom;
+        sl->segs[nseg].len = len - bom;
+        sl->segs[nseg++].file = k;
+        pos += len;
+    }
+    trace_end("read (slab)", t_read, n ? sl->files[0].path : NULL);
+    /* Loads past the last file only feed masked-off bits, but keep them defined. */
+    memset(sl->buf + pos, 0, SLAB_PAD);
+
+    uint64_t t_lex = trace_begin();
+    for (size_t j = 0; j < nseg; j++) {
+        const SlabSeg *sg = &sl->segs[j];
+        sl->files[sg->file].line_count = goline_count_lines(sl->buf + sg->start, sg->len, pos + SLAB_PAD - sg->start);
+        sl->rcs[sg->file] = 0;
+    }
+    trace_end("lex (slab)", t_lex, NULL);
+}
+    
+/*
+ * Work scheduling. Files are grouped into units and handed out largest first
+ * (LPT) using the st_size the walker recorded, so a huge file found late in
+ * the walk starts early instead of leaving the other workers idle at the end.
+ * Files smaller than --batch-bytes are batched into units of about that many
+ * bytes to amortise the per-unit handoff. With --files-from there are no
+ * sizes yet: a feeder thread reads the list and workers take paths in order
+ * as they arrive. Workers process a copy of each GoFile and hand it back to
+ * the main thread, which owns the file list and does all aggregation and
+ * output.
+ */
+#define DEFAULT_BATCH_BYTES (256L << 10)
+
+typedef struct {
+    size_t first;
+    size_t count;
+    long bytes;
+} WorkUnit;
+
+/* Units [next, end) that workers take before the planned order (--tui). */
+#define WORK_PRIO_MAX 8
+
+typedef struct {
+    size_t next;
+    size_t end;
+} WorkRange;
+
+typedef struct {
+    double busy;
+    double idle;
+    double finish;
+    size_t units;
+    size_t files;
+    long long bytes;
+} WorkerStats;
+
+typedef struct {
+    size_t index;
+    int rc;
+    GoFile file;
+} WorkDone;
+
+typedef struct WorkPool WorkPool;
+
+typedef struct {
+    WorkPool *pool;
+    int id;
+} WorkerArg;
+
+struct WorkPool {
+    GoFileList *list;
+    size_t *order;
+    WorkUnit *units;
+    size_t nunits;
+    size_t next_unit;
+    WorkDone *done;
+    size_t ndone;
+    size_t done_cap;
+    size_t consumed;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FILE *feed_fp;
+    int feed_delim;
+    const char *feed_root;
+    char **feed;
+    size_t nfeed;
+    size_t feed_cap;
+    size_t next_feed;
+    int feed_done;
+    int feed_started;
+    pthread_cond_t feed_cond;
+    pthread_t feed_thread;
+    pthread_t *threads;
+    WorkerArg *args;
+    WorkerStats *stats;
+    int nworkers;
+    struct timespec start;
+    double wall;
+    unsigned char *claimed;
+    WorkRange prio[WORK_PRIO_MAX];
+    int nprio;
+    int cancel;
+};
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int compare_by_size_desc(const void *a, const void *b, void *ctx) {
+    const GoFileList *list = (const GoFileList*)ctx;
+    size_t ia = *(const size_t*)a, ib = *(const size_t*)b;
+    long sa = list->data[ia].bytes, sb = list->data[ib].bytes;
+    if (sa != sb)
+        return (sa < sb) - (sa > sb);
+    return (ia > ib) - (ia < ib);
+}
+
+/*
+ * A given order is still sorted by size within windows of this many files, so
+ * the interleaved lexer gets groups of similar sizes.
+ */
+#define PLAN_ORDER_WINDOW 64
+
+/*
+ * Sorts files by size, largest first, or takes the given order (--stream wants
+ * files finished in output order), and cuts the order into units.
+ */
+static int work_pool_plan(WorkPool *p, long batch_bytes, const size_t *order) {
+    size_t n = p->list->size;
+    p->order = (size_t*)malloc((n ? n : 1) * sizeof(size_t));
+    p->units = (WorkUnit*)malloc((n ? n : 1) * sizeof(WorkUnit));
+    if (!p->order || !p->units)
+        return -1;
+    if (order) {
+        memcpy(p->order, order, n * sizeof(size_t));
+        for (size_t i = 0; i < n; i += PLAN_ORDER_WINDOW) {
+            size_t len = n - i < PLAN_ORDER_WINDOW ? n - i : PLAN_ORDER_WINDOW;
+            qsort_r(p->order + i, len, sizeof(size_t), compare_by_size_desc, p->list);
+        }
+    } else {
+        for (size_t i = 0; i < n; i++)
+            p->order[i] = i;
+        qsort_r(p->order, n, sizeof(size_t), compare_by_size_desc, p->list);
+    }
+
+    p->nunits = 0;
+    for (size_t i = 0; i < n; i++) {
+        long sz = p->list->data[p->order[i]].bytes;
+        WorkUnit *u = p->nunits ? &p->units[p->nunits - 1] : NULL;
+        if (u && sz < batch_bytes && u->bytes < batch_bytes &&
+            p->list->data[p->order[u->first]].bytes < batch_bytes) {
+            u->count++;
+            u->bytes += sz;
+        } else {
+            p->units[p->nunits].first = i;
+            p->units[p->nunits].count = 1;
+            p->units[p->nunits].bytes = sz;
+            p->nunits++;
+        }
+    }
+    return 0;
+}
+
+/* Hands n results to the main thread under one lock and one wakeup. */
+static void work_pool_push_done(WorkPool *p, const size_t *index, const int *rc, const GoFile *files, size_t n) {
+    uint64_t t0 = trace_begin();
+    pthread_mutex_lock(&p->lock);
+    if (p->consumed == p->ndone)
+        p->consumed = p->ndone = 0;
+    if (p->ndone + n > p->done_cap) {
+        size_t new_cap = p->done_cap ? p->done_cap * 2 : 256;
+        while (new_cap < p->ndone + n)
+            new_cap *= 2;
+        WorkDone *done = (WorkDone*)realloc(p->done, new_cap * sizeof(WorkDone));
+        if (!done) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        p->done = done;
+        p->done_cap = new_cap;
+    }
+    for (size_t k = 0; k < n; k++) {
+        p->done[p->ndone].index = index[k];
+        p->done[p->ndone].rc = rc[k];
+        p->done[p->ndone].file = files[k];
+        p->ndone++;
+    }
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    trace_end("hand off", t0, NULL);
+}
+
+static void work_pool_worker_exit(WorkPool *p, WorkerStats *st) {
+    st->finish = elapsed_seconds(&p->start);
+    pthread_mutex_lock(&p->lock);
+    p->running--;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * The next unit to process, or SIZE_MAX when there is none. With priorities
+ * (p->claimed set) the prioritized ranges are tried first, and every unit is
+ * claimed so that neither path processes it twice.
+ */
+static size_t work_pool_claim(WorkPool *p) {
+    if (!p->claimed)
+        return __atomic_fetch_add(&p->next_unit, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&p->cancel, __ATOMIC_RELAXED))
+        return SIZE_MAX;
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->nprio; i++) {
+        WorkRange *r = &p->prio[i];
+        while (r->next < r->end) {
+            size_t u = r->next++;
+            if (!__atomic_exchange_n(&p->claimed[u], 1, __ATOMIC_ACQ_REL)) {
+                pthread_mutex_unlock(&p->lock);
+                return u;
+            }
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    for (;;) {
+        size_t u = __atomic_fetch_add(&p->next_unit, 1, __ATOMIC_RELAXED);
+        if (u >= p->nunits)
+            return SIZE_MAX;
+        if (!__atomic_exchange_n(&p->claimed[u], 1, __ATOMIC_ACQ_REL))
+            return u;
+    }
+}
+
+/* The unit that holds position pos of the order. */
+static size_t work_pool_unit_at(const WorkPool *p, size_t pos) {
+    size_t lo = 0, hi = p->nunits;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (p->units[mid].first <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Replaces the prioritized stretches of the order with [lo[i], hi[i]), most
+ * urgent first. Only for pools started with priorities.
+ */
+static void work_pool_prioritize(WorkPool *p, const size_t *lo, const size_t *hi, int n) {
+    if (n > WORK_PRIO_MAX)
+        n = WORK_PRIO_MAX;
+    pthread_mutex_lock(&p->lock);
+    p->nprio = 0;
+    for (int i = 0; i < n; i++) {
+        if (lo[i] >= hi[i] || p->nunits == 0)
+            continue;
+        p->prio[p->nprio].next = work_pool_unit_at(p, lo[i]);
+        p->prio[p->nprio].end = work_pool_unit_at(p, hi[i] - 1) + 1;
+        p->nprio++;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Workers stop after their current unit; only for pools started with priorities. */
+static void work_pool_cancel(WorkPool *p) {
+    __atomic_store_n(&p->cancel, 1, __ATOMIC_RELAXED);
+}
+
+static void *work_pool_worker(void *arg) {
+    WorkerArg *wa = (WorkerArg*)arg;
+    WorkPool *p = wa->pool;
+    WorkerStats *st = &p->stats[wa->id];
+    Slab slab;
+    memset(&slab, 0, sizeof(slab));
+    trace_thread_name("worker");
+    for (;;) {
+        uint64_t t_wait = trace_begin();
+        size_t u = work_pool_claim(p);
+        if (u >= p->nunits)
+            break;
+        trace_end("take unit", t_wait, NULL);
+        const WorkUnit *unit = &p->units[u];
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (unit->count > 1 && slab_eligible()) {
+            slab_reserve(&slab, unit->count, 0);
+            for (size_t k = 0; k < unit->count; k++) {
+                slab.index[k] = p->order[unit->first + k];
+                slab.files[k] = p->list->data[slab.index[k]];
+            }
+            process_file_slab(&slab, unit->count);
+            work_pool_push_done(p, slab.index, slab.rcs, slab.files, unit->count);
+        } else {
+            for (size_t k = 0; k < unit->count; k += GOLINE_INTERLEAVE) {
+                GoFile f[GOLINE_INTERLEAVE];
+                int rcs[GOLINE_INTERLEAVE];
+                size_t index[GOLINE_INTERLEAVE];
+                int n = (unit->count - k < GOLINE_INTERLEAVE) ? (int)(unit->count - k) : GOLINE_INTERLEAVE;
+                for (int j = 0; j < n; j++) {
+                    index[j] = p->order[unit->first + k + j];
+                    f[j] = p->list->data[index[j]];
+                }
+                process_file_group(f, rcs, n);
+                work_pool_push_done(p, index, rcs, f, (size_t)n);
+            }
+        }
+        st->busy += elapsed_seconds(&t0);
+        st->units++;
+        st->files += unit->count;
+        st->bytes += unit->bytes;
+    }
+    slab_free(&slab);
+    work_pool_worker_exit(p, st);
+    return NULL;
+}
+
+static void *work_pool_stream_worker(void *arg) {
+    WorkerArg *wa = (WorkerArg*)arg;
+    WorkPool *p = wa->pool;
+    WorkerStats *st = &p->stats[wa->id];
+    trace_thread_name("worker");
+    for (;;) {
+        uint64_t t_wait = trace_begin();
+        pthread_mutex_lock(&p->lock);
+        while (p->next_feed == p->nfeed && !p->feed_done)
+            pthread_cond_wait(&p->feed_cond, &p->lock);
+        if (p->next_feed == p->nfeed) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        GoFile f;
+        memset(&f, 0, sizeof(f));
+        f.path = p->feed[p->next_feed];
+        p->feed[p->next_feed++] = NULL;
+        pthread_mutex_unlock(&p->lock);
+        trace_end("wait for path", t_wait, NULL);
+
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int rc = process_one_file(&f);
+        st->busy += elapsed_seconds(&t0);
+        st->units++;
+        st->files++;
+        st->bytes += f.bytes;
+        size_t index = SIZE_MAX;
+        work_pool_push_done(p, &index, &rc, &f, 1);
+    }
+    work_pool_worker_exit(p, st);
+    return NULL;
+}
+
+/*
+ * Joins path onto base (unless it is absolute) and resolves "." and ".."
+ * lexically, without touching the file system.
+ */
+static int lexical_path(const char *base, const char *path, char *out, size_t out_size) {
+    char joined[PATH_MAX];
+    int written = (path[0] == '/') ? snprintf(joined, sizeof(joined), "%s", path)
+                                   : snprintf(joined, sizeof(joined), "%s/%s", base, path);
+    if (written < 0 || (size_t)written >= sizeof(joined) || out_size < 2)
+        return -1;
+    size_t len = 0;
+    const char *p = joined;
+    while (*p) {
+        while (*p == '/')
+            p++;
+        const char *seg = p;
+        while (*p && *p != '/')
+            p++;
+        size_t seg_len = (size_t)(p - seg);
+        if (seg_len == 0 || (seg_len == 1 && seg[0] == '.'))
+            continue;
+        if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+            while (len > 0 && out[len - 1] != '/')
+                len--;
+            if (len > 0)
+                len--;
+            continue;
+        }
+        if (len + 1 + seg_len + 1 > out_size)
+            return -1;
+        out[len++] = '/';
+        memcpy(out + len, seg, seg_len);
+        len += seg_len;
+    }
+    if (len == 0)
+        out[len++] = '/';
+    out[len] = '\0';
+    return 0;
+}
+
+/*
+ * --files-from reader: paths are handed to the workers as soon as they are
+ * read. Only .go files are kept, and a file listed twice is counted once.
+ */
+static void *work_pool_feeder(void *arg) {
+    WorkPool *p = (WorkPool*)arg;
+    size_t root_len = strlen(p->feed_root);
+    trace_thread_name("file list reader");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getdelim(&line, &cap, p->feed_delim, p->feed_fp)) >= 0) {
+        if (len > 0 && line[len - 1] == (char)p->feed_delim)
+            line[--len] = '\0';
+        if (p->feed_delim == '\n' && len > 0 && line[len - 1] == '\r')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        char full[PATH_MAX];
+        if (lexical_path(p->feed_root, line, full, sizeof(full)) != 0) {
+            fprintf(stderr, "Path too long: '%s'\n", line);
+            continue;
+        }
+        if (strncmp(full, p->feed_root, root_len) != 0 || full[root_len] != '/') {
+            fprintf(stderr, "Skipping path outside '%s': '%s'\n", p->feed_root, line);
+            continue;
+        }
+        if (!goline_is_go_file(full) || skip_by_build_name(full))
+            continue;
+        /*
+         * Like the walker, count each file once however often or under
+         * whichever names it is listed. A path that cannot be stat()ed is
+         * passed on for the worker to report.
+         */
+        int fresh = goline_visit(g_goline, full);
+        if (fresh == GOLINE_ENOMEM)
+            fprintf(stderr, "Out of memory tracking listed files, skipping: %s\n", full);
+        if (fresh == 0 || fresh == GOLINE_ENOMEM)
+            continue;
+        char *path = strdup(full);
+        pthread_mutex_lock(&p->lock);
+        if (path && p->nfeed == p->feed_cap) {
+            size_t new_cap = p->feed_cap ? p->feed_cap * 2 : 1024;
+            char **feed = (char**)realloc(p->feed, new_cap * sizeof(char*));
+            if (feed) {
+                p->feed = feed;
+                p->feed_cap = new_cap;
+            }
+        }
+        if (path && p->nfeed < p->feed_cap) {
+            p->feed[p->nfeed++] = path;
+            pthread_cond_signal(&p->feed_cond);
+        } else {
+            fprintf(stderr, "Memory allocation failed (file list)\n");
+            free(path);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (ferror(p->feed_fp))
+        fprintf(stderr, "Failed to read file list: %s\n", strerror(errno));
+    free(line);
+    pthread_mutex_lock(&p->lock);
+    p->feed_done = 1;
+    pthread_cond_broadcast(&p->feed_cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void work_pool_free(WorkPool *p) {
+    for (size_t i = p->next_feed; i < p->nfeed; i++)
+        free(p->feed[i]);
+    free(p->feed);
+    free(p->order);
+    free(p->units);
+    free(p->done);
+    free(p->threads);
+    free(p->args);
+    free(p->stats);
+    free(p->claimed);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    pthread_cond_destroy(&p->feed_cond);
+}
+
+/*
+ * Starts the workers over list, in the given order or largest first, or, when
+ * feed_fp is set, over the paths read from it (split on delim and resolved
+ * against root). A prioritized pool accepts work_pool_prioritize() and
+ * work_pool_cancel().
+ */
+static int work_pool_start(WorkPool *p, GoFileList *list, const size_t *order, int prioritized,
+                           int nworkers, long batch_bytes, FILE *feed_fp, int delim, const char *root) {
+    memset(p, 0, sizeof(*p));
+    p->list = list;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_cond_init(&p->feed_cond, NULL);
+    p->threads = (pthread_t*)calloc((size_t)nworkers, sizeof(pthread_t));
+    p->args = (WorkerArg*)calloc((size_t)nworkers, sizeof(WorkerArg));
+    p->stats = (WorkerStats*)calloc((size_t)nworkers, sizeof(WorkerStats));
+    if (!p->threads || !p->args || !p->stats || (!feed_fp && work_pool_plan(p, batch_bytes, order) != 0)) {
+        fprintf(stderr, "Memory allocation failed (work pool)\n");
+        return -1;
+    }
+    if (prioritized && !feed_fp) {
+        p->claimed = (unsigned char*)calloc(p->nunits ? p->nunits : 1, 1);
+        if (!p->claimed) {
+            fprintf(stderr, "Memory allocation failed (work pool)\n");
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    if (feed_fp) {
+        p->feed_fp = feed_fp;
+        p->feed_delim = delim;
+        p->feed_root = root;
+        int rc = pthread_create(&p->feed_thread, NULL, work_pool_feeder, p);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to start file list reader: %s\n", strerror(rc));
+            return -1;
+        }
+        p->feed_started = 1;
+    }
+    for (int w = 0; w < nworkers; w++) {
+        p->args[w].pool = p;
+        p->args[w].id = w;
+        pthread_mutex_lock(&p->lock);
+        p->running++;
+        pthread_mutex_unlock(&p->lock);
+        int rc = pthread_create(&p->threads[w], NULL, feed_fp ? work_pool_stream_worker : work_pool_worker,
+                                &p->args[w]);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to start worker thread: %s\n", strerror(rc));
+            pthread_mutex_lock(&p->lock);
+            p->running--;
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        p->nworkers++;
+    }
+    if (p->nworkers == 0)
+        return -1;
+    return 0;
+}
+
+/* Blocks until the next file is finished. Returns 0 once every worker is done. */
+static int work_pool_next(WorkPool *p, WorkDone *out) {
+    uint64_t t0 = trace_begin();
+    pthread_mutex_lock(&p->lock);
+    while (p->consumed == p->ndone && p->running > 0)
+        pthread_cond_wait(&p->cond, &p->lock);
+    int got = (p->consumed < p->ndone);
+    if (got)
+        *out = p->done[p->consumed++];
+    pthread_mutex_unlock(&p->lock);
+    trace_end("wait for result", t0, NULL);
+    return got;
+}
+
+/* Like work_pool_next() without waiting: 1 with a file, 0 if none is ready yet, -1 once all are done. */
+static int work_pool_poll(WorkPool *p, WorkDone *out) {
+    pthread_mutex_lock(&p->lock);
+    int rc = -1;
+    if (p->consumed < p->ndone) {
+        *out = p->done[p->consumed++];
+        rc = 1;
+    } else if (p->running > 0) {
+        rc = 0;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return rc;
+}
+
+/* Files known so far: the whole list, or the paths read from --files-from. */
+static size_t work_pool_total(WorkPool *p) {
+    if (!p->feed_fp)
+        return p->list->size;
+    pthread_mutex_lock(&p->lock);
+    size_t n = p->nfeed;
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+static void work_pool_join(WorkPool *p) {
+    if (p->feed_started)
+        pthread_join(p->feed_thread, NULL);
+    for (int w = 0; w < p->nworkers; w++)
+        pthread_join(p->threads[w], NULL);
+    p->wall = elapsed_seconds(&p->start);
+    for (int w = 0; w < p->nworkers; w++)
+        p->stats[w].idle = p->wall - p->stats[w].busy;
+}
+
+static void work_pool_totals(const WorkPool *p, size_t *pFiles, long long *pBytes) {
+    *pFiles = 0;
+    *pBytes = 0;
+    for (int w = 0; w < p->nworkers; w++) {
+        *pFiles += p->stats[w].files;
+        *pBytes += p->stats[w].bytes;
+    }
+}
+
+/* Reports the scan's own read rate, for tuning --io-rate and -j. */
+static void print_throughput(const WorkPool *p) {
+    long long bytes;
+    size_t files;
+    work_pool_totals(p, &files, &bytes);
+    double wall = p->wall > 0 ? p->wall : 1e-9;
+    fprintf(stderr, "Throughput: %zu files, %.1f MiB in %.3fs (%.1f MiB/s, %.0f files/s)",
+            files, (double)bytes / (1 << 20), p->wall, (double)bytes / (1 << 20) / wall, (double)files / wall);
+    if (g_opts.io_rate > 0)
+        fprintf(stderr, ", cap %.1f MiB/s", (double)g_opts.io_rate / (1 << 20));
+    fprintf(stderr, "\n");
+}
+
+static void print_worker_stats(const WorkPool *p) {
+    double first = p->wall;
+    for (int w = 0; w < p->nworkers; w++) {
+        if (p->stats[w].finish < first)
+            first = p->stats[w].finish;
+    }
+    fprintf(stderr, "Workers: %d, units: %zu, wall %.3fs, tail %.3fs (first idle worker to last finish)\n",
+            p->nworkers, p->nunits, p->wall, p->wall - first);
+    for (int w = 0; w < p->nworkers; w++) {
+        const WorkerStats *st = &p->stats[w];
+        fprintf(stderr, "  worker %2d: %6zu units %8zu files %12lld bytes  busy %.3fs  idle %.3fs\n",
+                w, st->units, st->files, st->bytes, st->busy, st->idle);
+    }
+}
+
+/*
+ * Go modules met by the walk. Every directory belongs to the module of the
+ * nearest go.mod at or above it; files get that module's index. A module's
+ * vendor/ tree is its own entry so reports can tell vendored code apart.
+ */
+#define GO_MOD_MAX (64L << 10)
+
+typedef struct {
+    char *path;
+    char *dir;
+    int vendor;
+    int nested;
+    long lines;
+    long generated;
+    long bytes;
+    long files;
+} GoModule;
+
+static GoModule *g_modules;
+static size_t g_nmodules;
+static size_t g_modules_cap;
+static long g_modules_skipped;
+static long g_vendor_skipped;
+
+static int module_tracking(void) {
+    return g_opts.module_report || g_opts.no_nested_modules || g_opts.no_vendor;
+}
+
+static int add_module(const char *path, size_t path_len, const char *dir, int vendor, int nested) {
+    if (g_nmodules == g_modules_cap) {
+        size_t new_cap = g_modules_cap ? g_modules_cap * 2 : 16;
+        GoModule *m = (GoModule*)realloc(g_modules, new_cap * sizeof(GoModule));
+        if (!m) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        g_modules = m;
+        g_modules_cap = new_cap;
+    }
+    GoModule *m = &g_modules[g_nmodules];
+    memset(m, 0, sizeof(*m));
+    m->path = strndup(path, path_len);
+    m->dir = strdup(dir);
+    if (!m->path || !m->dir) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    m->vendor = vendor;
+    m->nested = nested;
+    return (int)g_nmodules++;
+}
+
+static void free_modules(void) {
+    for (size_t i = 0; i < g_nmodules; i++) {
+        free(g_modules[i].path);
+        free(g_modules[i].dir);
+    }
+    free(g_modules);
+    g_modules = NULL;
+    g_nmodules = g_modules_cap = 0;
+}
+
+/*
+ * Reads the module path from the `module` directive of a go.mod, quoted or
+ * not. Returns its length, or 0 if the file has none.
+ */
+static size_t read_module_path(const char *gomod, char *out, size_t size) {
+    FILE *fp = fopen(gomod, "r");
+    if (!fp)
+        return 0;
+    char *buf = (char*)malloc(GO_MOD_MAX + 1);
+    size_t n = buf ? fread(buf, 1, GO_MOD_MAX, fp) : 0;
+    fclose(fp);
+    if (!buf)
+        return 0;
+    buf[n] = '\0';
+    size_t len = 0;
+    for (char *line = buf; line && *line; ) {
+        char *next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        while (*line == ' ' || *line == '\t')
+            line++;
+        if (strncmp(line, "module", 6) == 0 && (line[6] == ' ' || line[6] == '\t' || line[6] == '"' || line[6] == '`')) {
+            char *p = line + 6;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            char *end;
+            if (*p == '"' || *p == '`') {
+                end = strchr(p + 1, *p);
+                p++;
+            } else {
+                end = p;
+                while (*end && *end != ' ' && *end != '\t' && *end != '\r' && strncmp(end, "//", 2) != 0)
+                    end++;
+            }
+            if (end && end > p && (size_t)(end - p) < size) {
+                len = (size_t)(end - p);
+                memcpy(out, p, len);
+                out[len] = '\0';
+            }
+            break;
+        }
+        line = next;
+    }
+    free(buf);
+    return len;
+}
+
+static int has_go_mod(const char *dir) {
+    char gomod[PATH_MAX];
+    struct stat st;
+    int n = snprintf(gomod, sizeof(gomod), "%s/go.mod", dir);
+    if (n < 0 || (size_t)n >= sizeof(gomod))
+        return 0;
+    return stat(gomod, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Registers the module rooted at dir; a go.mod without a module directive gives an empty path. */
+static int add_module_at(const char *dir, int nested) {
+    char gomod[PATH_MAX];
+    char path[PATH_MAX];
+    int n = snprintf(gomod, sizeof(gomod), "%s/go.mod", dir);
+    size_t len = n < 0 || (size_t)n >= sizeof(gomod) ? 0 : read_module_path(gomod, path, sizeof(path));
+    return add_module(path, len, dir, 0, nested);
+}
+
+/* The module the walk root belongs to: the nearest go.mod at or above it. */
+static int root_module(const char *root) {
+    char dir[PATH_MAX];
+    fast_strcpy(dir, root, sizeof(dir));
+    for (;;) {
+        if (has_go_mod(dir))
+            return add_module_at(dir, 0);
+        char *slash = strrchr(dir, '/');
+        if (!slash)
+            break;
+        if (slash == dir) {
+            if (dir[1] == '\0')
+                break;
+            dir[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+    return add_module("", 0, root, 0, 0);
+}
+
+/* A directory on the walk's path from the root. */
+typedef struct {
+    int module;
+    int module_root;
+    uint64_t t0;
+} WalkDir;
+
+typedef struct {
+    GoFileList *list;
+    WalkDir *dirs;
+    size_t dirs_cap;
+} WalkState;
+
+/*
+ * goline_walk() callback that lists the files. dirs[depth] holds the module
+ * of each directory on the path, or -1 when modules are not tracked.
+ * Directories with their own go.mod are checked before they are read, so
+ * --no-nested-modules and --no-vendor prune whole subtrees.
+ */
+static int walk_event(void *user, int event, const goline_walk_entry *e) {
+    WalkState *ws = (WalkState*)user;
+    if (event == GOLINE_WALK_FILE) {
+        if (skip_by_build_name(e->name))
+            return 0;
+        push_go_file(ws->list, e->path);
+        ws->list->data[ws->list->size - 1].bytes = e->size;
+        ws->list->data[ws->list->size - 1].module = ws->dirs[e->depth - 1].module;
+        return 0;
+    }
+    if (event == GOLINE_WALK_UNTRACKED) {
+        fprintf(stderr, "Out of memory tracking visited paths, skipping: %s\n", e->path);
+        return 0;
+    }
+    if (event == GOLINE_WALK_LEAVE) {
+        trace_end("readdir", ws->dirs[e->depth].t0, e->path);
+        return 0;
+    }
+
+    if ((size_t)e->depth == ws->dirs_cap) {
+        size_t new_cap = ws->dirs_cap ? ws->dirs_cap * 2 : 16;
+        WalkDir *dirs = (WalkDir*)realloc(ws->dirs, new_cap * sizeof(WalkDir));
+        if (!dirs) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        ws->dirs = dirs;
+        ws->dirs_cap = new_cap;
+    }
+    WalkDir *d = &ws->dirs[e->depth];
+    if (e->depth == 0) {
+        d->module = module_tracking() ? root_module(e->path) : -1;
+        d->module_root = d->module >= 0 && strcmp(g_modules[d->module].dir, e->path) == 0;
+    } else {
+        const WalkDir *parent = &ws->dirs[e->depth - 1];
+        int module = parent->module;
+        d->module = module;
+        d->module_root = 0;
+        if (module >= 0) {
+            int vendor = !g_modules[module].vendor && parent->module_root && strcmp(e->name, "vendor") == 0;
+            if (vendor && g_opts.no_vendor) {
+                g_vendor_skipped++;
+                return GOLINE_WALK_PRUNE;
+            }
+            int nested = !vendor && has_go_mod(e->path);
+            if (nested && g_opts.no_nested_modules) {
+                g_modules_skipped++;
+                return GOLINE_WALK_PRUNE;
+            }
+            if (nested)
+                d->module = add_module_at(e->path, 1);
+            else if (vendor)
+                d->module = add_module(g_modules[module].path, strlen(g_modules[module].path), e->path, 1, 0);
+            d->module_root = nested || vendor;
+        }
+    }
+    d->t0 = trace_begin();
+    return 0;
+}
+
+static void find_go_files(const char *root, GoFileList *list) {
+    WalkState ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.list = list;
+    int rc = goline_walk(g_goline, root, walk_event, &ws);
+    if (rc == GOLINE_ENOMEM)
+        fprintf(stderr, "Memory allocation failed\n");
+    free(ws.dirs);
+}
+    
+/*
+ * All result output goes through one large user-space buffer that is handed
+ * to write(2) only when it fills up or a streaming consumer needs a record.
+ */
+#define OUT_BUF_SIZE (1L << 20)
+#define OUT_STREAM_FLUSH_NS 50000000L
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd;
+    int failed;
+    int streamed;
+    struct timespec last_flush;
+} OutBuf;
+
+static OutBuf g_out;
+
+static void out_init(int fd) {
+    g_out.buf = (char*)malloc(OUT_BUF_SIZE);
+    g_out.cap = g_out.buf ? OUT_BUF_SIZE : 0;
+    g_out.len = 0;
+    g_out.fd = fd;
+    g_out.failed = 0;
+    g_out.streamed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &g_out.last_flush);
+}
+
+static void out_write_all(const char *p, size_t n) {
+    while (n > 0 && !g_out.failed) {
+        ssize_t w = write(g_out.fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            g_out.failed = 1;
+            break;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+}
+
+static void out_flush(void) {
+    if (g_out.len > 0)
+        out_write_all(g_out.buf, g_out.len);
+    g_out.len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &g_out.last_flush);
+}
+
+static void out_close(void) {
+    out_flush();
+    free(g_out.buf);
+    g_out.buf = NULL;
+    g_out.cap = 0;
+}
+
+/* Flushes the first streamed record at once, later ones at most every 50 ms. */
+static void out_stream_tick(void) {
+    if (!g_out.streamed) {
+        g_out.streamed = 1;
+        out_flush();
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed = (now.tv_sec - g_out.last_flush.tv_sec) * 1000000000L +
+                   (now.tv_nsec - g_out.last_flush.tv_nsec);
+    if (elapsed >= OUT_STREAM_FLUSH_NS)
+        out_flush();
+}
+
+static void out_write(const char *p, size_t n) {
+    if (g_out.len + n > g_out.cap) {
+        out_flush();
+        if (n > g_out.cap) {
+            out_write_all(p, n);
+            return;
+        }
+    }
+    memcpy(g_out.buf + g_out.len, p, n);
+    g_out.len += n;
+}
+
+static void out_puts(const char *s) {
+    out_write(s, strlen(s));
+}
+
+static void out_printf(const char *fmt, ...) {
+    va_list ap;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t room = g_out.cap - g_out.len;
+        va_start(ap, fmt);
+        int n = vsnprintf(g_out.buf + g_out.len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < room) {
+            g_out.len += (size_t)n;
+            return;
+        }
+        if (attempt == 0 && g_out.len > 0) {
+            out_flush();
+            continue;
+        }
+        char *tmp = (char*)malloc((size_t)n + 1);
+        if (!tmp)
+            return;
+        va_start(ap, fmt);
+        vsnprintf(tmp, (size_t)n + 1, fmt, ap);
+        va_end(ap);
+        out_write(tmp, (size_t)n);
+        free(tmp);
+        return;
+    }
+}
+
+static void out_long(long v) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long u = (v < 0) ? 0UL - (unsigned long)v : (unsigned long)v;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        *--p = '-';
+    out_write(p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+static void out_json_string(const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    out_write("\"", 1);
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        out_write(run, (size_t)(s - run));
+        char esc[6] = { '\\', (char)c, 0, 0, 0, 0 };
+        size_t n = 2;
+        if (c == '\n') {
+            esc[1] = 'n';
+        } else if (c == '\t') {
+            esc[1] = 't';
+        } else if (c == '\r') {
+            esc[1] = 'r';
+        } else if (c < 0x20) {
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 15];
+            n = 6;
+        }
+        out_write(esc, n);
+        run = s + 1;
+    }
+    out_write(run, (size_t)(s - run));
+    out_write("\"", 1);
+}
+
+static void out_csv_field(const char *s) {
+    if (!strpbrk(s, ",\"\r\n")) {
+        out_puts(s);
+        return;
+    }
+    out_write("\"", 1);
+    for (; *s; s++) {
+        if (*s == '"')
+            out_write("\"", 1);
+        out_write(s, 1);
+    }
+    out_write("\"", 1);
+}
+
+static long compute_dir_go_lines(const char *dir, const GoFileList *list, long *pGenerated) {
+    long sum = 0;
+    long generated = 0;
+    size_t dlen = fast_strlen(dir);
+    for (size_t i = 0; i < list->size; i++) {
+        const char *p = list->data[i].path;
+        if (strncasecmp(p, dir, dlen) == 0) {
+            char c = p[dlen];
+            if (c == '\0' || c == '/') {
+                sum += list->data[i].line_count;
+                if (list->data[i].generated)
+                    generated += list->data[i].line_count;
+            }
+        }
+    }
+    if (pGenerated)
+        *pGenerated = generated;
+    return sum;
+}
+    
+static int has_go_file_in_dir(const char *dir, const GoFileList *list) {
+    long lines = compute_dir_go_lines(dir, list, NULL);
+    return (lines > 0);
+}
+
+static const GoFile *find_go_file(const GoFileList *list, const char *path) {
+    for (size_t k = 0; k < list->size; k++) {
+        if (strcasecmp(list->data[k].path, path) == 0)
+            return &list->data[k];
+    }
+    return NULL;
+}
+
+static void print_line_count(long lines, long generated) {
+    if (generated > 0)
+        out_printf("  %ld lines (%ld generated)\n", lines, generated);
+    else
+        out_printf("  %ld lines\n", lines);
+}
+
+static double dup_percent(long dup, long lines) {
+    return lines > 0 ? 100.0 * dup / lines : 0.0;
+}
+
+/* print_line_count() plus the --duplicates and --complexity figures when enabled. */
+static void print_node_count(long lines, long generated, long dup, long complexity) {
+    const char *sep = " (";
+    out_printf("  %ld lines", lines);
+    if (generated > 0) {
+        out_printf("%s%ld generated", sep, generated);
+        sep = ", ";
+    }
+    if (g_opts.duplicates) {
+        out_printf("%s%ld duplicated, %.1f%%", sep, dup, dup_percent(dup, lines));
+        sep = ", ";
+    }
+    if (g_opts.complexity) {
+        out_printf("%scomplexity %ld", sep, complexity);
+        sep = ", ";
+    }
+    out_puts(sep[0] == ',' ? ")\n" : "\n");
+}
+    
+static void print_progress_bar_with_filename(size_t current, size_t total, const char *filepath) {
+    int barWidth = 50;
+    double progress = (double)current / (double)total;
+    int pos = (int)(barWidth * progress);
+    
+    const char *filename = strrchr(filepath, '/');
+    if (filename)
+        filename++;
+    else
+        filename = filepath;
+    
+    printf("\r%-80s\r", "");
+    
+    printf("[");
+    for (int i = 0; i < barWidth; i++) {
+        if (i < pos)
+            printf("=");
+        else if (i == pos)
+            printf(">");
+        else
+            printf(" ");
+    }
+    printf("] %3d%%  (%s)", (int)(progress * 100), filename);
+    fflush(stdout);
+}
+    
+#define MAX_DIR_ENTRIES 1000
+
+typedef struct {
+    char name[PATH_MAX];
+    int is_dir;
+} DirEntry;
+    
+static void print_tree_only_go(const char *dir, const char *prefix, int is_last, const GoFileList *list) {
+    long generated = 0;
+    long sum = compute_dir_go_lines(dir, list, &generated);
+    if (sum == 0)
+        return;
+
+    const char *slash = strrchr(dir, '/');
+    const char *basename = slash ? (slash + 1) : dir;
+
+    if (prefix[0] == '\0') {
+        out_puts(basename);
+    } else {
+        out_printf("%s%s%s",
+               prefix,
+               (is_last ? "└── " : "├── "),
+               basename);
+    }
+    print_line_count(sum, generated);
+
+    char newPrefix[256];
+    snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix, (is_last ? "    " : "│   "));
+
+    DIR *dp = opendir(dir);
+    if (!dp)
+        return;
+
+    DirEntry *items = (DirEntry*)malloc(MAX_DIR_ENTRIES * sizeof(DirEntry));
+    if (!items) {
+        closedir(dp);
+        fprintf(stderr, "Memory allocation failed (directory entries)\n");
+        return;
+    }
+
+    struct dirent *entry;
+    int count = 0;
+    while ((entry = readdir(dp)) != NULL && count < MAX_DIR_ENTRIES) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        items[count].is_dir = 0;
+        fast_strcpy(items[count].name, entry->d_name, sizeof(items[count].name));
+
+        char full[PATH_MAX];
+        int written = snprintf(full, sizeof(full), "%s/%s", dir, entry->d_name);
+        if (written < 0 || written >= sizeof(full)) {
+            fprintf(stderr, "Path too long: '%s/%s'\n", dir, entry->d_name);
+            continue;
+        }
+
+        struct stat st;
+        if (stat(full, &st) == 0 && S_ISDIR(st.st_mode))
+            items[count].is_dir = 1;
+        count++;
+    }
+    closedir(dp);
+
+    for (int i = 0; i < count - 1; i++) {
+        for (int j = i + 1; j < count; j++) {
+            if (strcasecmp(items[i].name, items[j].name) > 0) {
+                DirEntry tmp = items[i];
+                items[i] = items[j];
+                items[j] = tmp;
+            }
+        }
+    }
+
+    int realCount = 0;
+    for (int i = 0; i < count; i++) {
+        char full[PATH_MAX];
+        int written = snprintf(full, sizeof(full), "%s/%s", dir, items[i].name);
+        if (written < 0 || written >= sizeof(full)) {
+            fprintf(stderr, "Path too long: '%s/%s'\n", dir, items[i].name);
+            continue;
+        }
+
+        if (items[i].is_dir) {
+            if (has_go_file_in_dir(full, list))
+                realCount++;
+        } else {
+            size_t ln = fast_strlen(items[i].name);
+            if (ln > 3 && strcasecmp(items[i].name + (ln - 3), ".go") == 0) {
+                const GoFile *gf = find_go_file(list, full);
+                if (gf && !gf->excluded)
+                    realCount++;
+            }
+        }
+    }
+
+    int passIndex = 0;
+    for (int i = 0; i < count; i++) {
+        char full[PATH_MAX];
+        int written = snprintf(full, sizeof(full), "%s/%s", dir, items[i].name);
+        if (written < 0 || written >= sizeof(full)) {
+            fprintf(stderr, "Path too long: '%s/%s'\n", dir, items[i].name);
+            continue;
+        }
+
+        int lastChild = 0;
+        if (items[i].is_dir) {
+            if (!has_go_file_in_dir(full, list))
+                continue;
+            passIndex++;
+            lastChild = (passIndex == realCount);
+            print_tree_only_go(full, newPrefix, lastChild, list);
+        } else {
+            size_t ln = fast_strlen(items[i].name);
+            if (!(ln > 3 && strcasecmp(items[i].name + (ln - 3), ".go") == 0))
+                continue;
+            const GoFile *gf = find_go_file(list, full);
+            if (!gf || gf->excluded)
+                continue;
+            passIndex++;
+            lastChild = (passIndex == realCount);
+            long lines = gf->line_count;
+            out_printf("%s%s%s",
+                   newPrefix,
+                   (lastChild ? "└── " : "├── "),
+                   items[i].name);
+            print_line_count(lines, gf->generated ? lines : 0);
+        }
+    }
+    free(items);
+}
+
+/*
+ * String-keyed map from a root-relative path to a line count, used to hold the
+ * per-file and per-directory totals of a --baseline result.
+ */
+typedef struct {
+    char *key;
+    long value;
+} PathMapEntry;
+
+typedef struct {
+    PathMapEntry *slots;
+    size_t capacity;
+    size_t count;
+} PathMap;
+
+static uint64_t hash_path(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void path_map_init(PathMap *m) {
+    m->slots = NULL;
+    m->capacity = 0;
+    m->count = 0;
+}
+
+static void path_map_free(PathMap *m) {
+    for (size_t i = 0; i < m->capacity; i++)
+        free(m->slots[i].key);
+    free(m->slots);
+    path_map_init(m);
+}
+
+static PathMapEntry *path_map_probe(PathMapEntry *slots, size_t capacity, const char *key, size_t len) {
+    size_t idx = (size_t)hash_path(key, len) & (capacity - 1);
+    for (;;) {
+        PathMapEntry *e = &slots[idx];
+        if (!e->key || (strncmp(e->key, key, len) == 0 && e->key[len] == '\0'))
+            return e;
+        idx = (idx + 1) & (capacity - 1);
+    }
+}
+
+static long path_map_get(const PathMap *m, const char *key, size_t len) {
+    if (m->capacity == 0)
+        return 0;
+    PathMapEntry *e = path_map_probe(m->slots, m->capacity, key, len);
+    return e->key ? e->value : 0;
+}
+
+static int path_map_add(PathMap *m, const char *key, size_t len, long delta) {
+    if ((m->count + 1) * 4 > m->capacity * 3) {
+        size_t new_cap = m->capacity ? m->capacity * 2 : 256;
+        PathMapEntry *slots = (PathMapEntry*)calloc(new_cap, sizeof(PathMapEntry));
+        if (!slots)
+            return -1;
+        for (size_t i = 0; i < m->capacity; i++) {
+            if (m->slots[i].key) {
+                const char *k = m->slots[i].key;
+                *path_map_probe(slots, new_cap, k, strlen(k)) = m->slots[i];
+            }
+        }
+        free(m->slots);
+        m->slots = slots;
+        m->capacity = new_cap;
+    }
+    PathMapEntry *e = path_map_probe(m->slots, m->capacity, key, len);
+    if (!e->key) {
+        e->key = strndup(key, len);
+        if (!e->key)
+            return -1;
+        e->value = 0;
+        m->count++;
+    }
+    e->value += delta;
+    return 0;
+}
+
+/*
+ * Bounded min-heap that keeps the K largest keys seen so far. Entries that can
+ * grow after insertion (directory totals) pass a pos pointer so the heap can
+ * find and re-sift them in place.
+ */
+typedef struct {
+    long key;
+    size_t id;
+    int *pos;
+} TopEntry;
+
+typedef struct {
+    TopEntry *e;
+    size_t size;
+    size_t k;
+} TopHeap;
+
+static int top_heap_init(TopHeap *h, size_t k) {
+    h->e = (TopEntry*)malloc((k ? k : 1) * sizeof(TopEntry));
+    h->size = 0;
+    h->k = k;
+    return h->e ? 0 : -1;
+}
+
+static void top_heap_free(TopHeap *h) {
+    free(h->e);
+    h->e = NULL;
+    h->size = 0;
+}
+
+static void top_heap_set(TopHeap *h, size_t i, TopEntry ent) {
+    h->e[i] = ent;
+    if (ent.pos)
+        *ent.pos = (int)i;
+}
+
+static void top_heap_sift(TopHeap *h, size_t i) {
+    TopEntry ent = h->e[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (h->e[parent].key <= ent.key)
+            break;
+        top_heap_set(h, i, h->e[parent]);
+        i = parent;
+    }
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= h->size)
+            break;
+        if (child + 1 < h->size && h->e[child + 1].key < h->e[child].key)
+            child++;
+        if (h->e[child].key >= ent.key)
+            break;
+        top_heap_set(h, i, h->e[child]);
+        i = child;
+    }
+    top_heap_set(h, i, ent);
+}
+
+static void top_heap_offer(TopHeap *h, long key, size_t id, int *pos) {
+    if (h->k == 0)
+        return;
+    if (pos && *pos >= 0) {
+        h->e[*pos].key = key;
+        top_heap_sift(h, (size_t)*pos);
+        return;
+    }
+    TopEntry ent = { key, id, pos };
+    if (h->size < h->k) {
+        h->e[h->size++] = ent;
+        top_heap_sift(h, h->size - 1);
+    } else if (key > h->e[0].key) {
+        if (h->e[0].pos)
+            *h->e[0].pos = -1;
+        h->e[0] = ent;
+        top_heap_sift(h, 0);
+    }
+}
+
+static int compare_top_desc(const void *a, const void *b) {
+    long ka = ((const TopEntry*)a)->key;
+    long kb = ((const TopEntry*)b)->key;
+    return (ka < kb) - (ka > kb);
+}
+
+/*
+ * Per-directory aggregation built while results arrive. Directory nodes are
+ * created on demand from each file's root-relative path.
+ */
+typedef struct DirNode {
+    char *name;
+    char *rel;
+    struct DirNode *parent;
+    struct DirNode **dirs;
+    size_t ndirs;
+    size_t dirs_cap;
+    struct DirNode *last_hit;
+    size_t *files;
+    size_t nfiles;
+    size_t files_cap;
+    long lines;
+    long generated;
+    long bytes;
+    long file_count;
+    long base_lines;
+    long dup_lines;
+    long complexity;
+    int heap_pos;
+    long pending;
+    long total_files;
+    size_t next_dir;
+    size_t next_file;
+    size_t order_lo;
+    size_t order_hi;
+    int expanded;
+    long sampled_files;
+    double exact_lines;
+    double estimate;
+    double variance;
+} DirNode;
+
+typedef struct {
+    DirNode *root;
+    const char *root_path;
+    size_t root_len;
+    TopHeap dir_heap;
+    TopHeap file_heap;
+    PathMap base_files;
+    PathMap base_dirs;
+    const GoFileList *list;
+    TopHeap func_heap;
+    const FuncSpan **long_funcs;
+    size_t nlong_funcs;
+    size_t long_funcs_cap;
+    const FuncSpan **complex_funcs;
+    size_t ncomplex_funcs;
+    size_t complex_funcs_cap;
+} Report;
+
+static DirNode *dir_node_new(const char *name, size_t name_len, const char *rel, size_t rel_len, DirNode *parent) {
+    DirNode *n = (DirNode*)calloc(1, sizeof(DirNode));
+    if (!n)
+        return NULL;
+    n->name = strndup(name, name_len);
+    n->rel = strndup(rel, rel_len);
+    if (!n->name || !n->rel) {
+        free(n->name);
+        free(n->rel);
+        free(n);
+        return NULL;
+    }
+    n->parent = parent;
+    n->heap_pos = -1;
+    return n;
+}
+
+static void dir_node_free(DirNode *n) {
+    if (!n)
+        return;
+    for (size_t i = 0; i < n->ndirs; i++)
+        dir_node_free(n->dirs[i]);
+    free(n->dirs);
+    free(n->files);
+    free(n->name);
+    free(n->rel);
+    free(n);
+}
+
+static DirNode *dir_node_child(DirNode *n, const char *name, size_t len, const char *rel, size_t rel_len) {
+    DirNode *hit = n->last_hit;
+    if (hit && strncmp(hit->name, name, len) == 0 && hit->name[len] == '\0')
+        return hit;
+    for (size_t i = 0; i < n->ndirs; i++) {
+        DirNode *c = n->dirs[i];
+        if (strncmp(c->name, name, len) == 0 && c->name[len] == '\0') {
+            n->last_hit = c;
+            return c;
+        }
+    }
+    if (n->ndirs == n->dirs_cap) {
+        size_t new_cap = n->dirs_cap ? n->dirs_cap * 2 : 4;
+        DirNode **dirs = (DirNode**)realloc(n->dirs, new_cap * sizeof(DirNode*));
+        if (!dirs)
+            return NULL;
+        n->dirs = dirs;
+        n->dirs_cap = new_cap;
+    }
+    DirNode *c = dir_node_new(name, len, rel, rel_len, n);
+    if (!c)
+        return NULL;
+    n->dirs[n->ndirs++] = c;
+    n->last_hit = c;
+    return c;
+}
+
+static void dir_node_add_file(DirNode *n, size_t index) {
+    if (n->nfiles == n->files_cap) {
+        size_t new_cap = n->files_cap ? n->files_cap * 2 : 8;
+        size_t *files = (size_t*)realloc(n->files, new_cap * sizeof(size_t));
+        if (files) {
+            n->files = files;
+            n->files_cap = new_cap;
+        }
+    }
+    if (n->nfiles < n->files_cap)
+        n->files[n->nfiles++] = index;
+}
+
+static const char *relative_path(const Report *r, const char *path) {
+    if (strlen(path) > r->root_len && path[r->root_len] == '/')
+        return path + r->root_len + 1;
+    return path;
+}
+
+static const char *node_path(const DirNode *n) {
+    return n->rel[0] ? n->rel : ".";
+}
+
+static long top_dir_key(const DirNode *n) {
+    if (g_opts.top_by == TOP_BY_BYTES)
+        return n->bytes;
+    if (g_opts.top_by == TOP_BY_GROWTH)
+        return n->lines - n->base_lines;
+    return n->lines;
+}
+
+static void func_list_push(const FuncSpan ***list, size_t *n, size_t *cap, const FuncSpan *fs) {
+    if (*n == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 16;
+        const FuncSpan **arr = (const FuncSpan**)realloc(*list, new_cap * sizeof(*arr));
+        if (!arr)
+            return;
+        *list = arr;
+        *cap = new_cap;
+    }
+    (*list)[(*n)++] = fs;
+}
+
+static void report_add(Report *r, size_t index) {
+    const GoFile *f = &r->list->data[index];
+    const char *rel = relative_path(r, f->path);
+    DirNode *n = r->root;
+    n->lines += f->line_count;
+    n->bytes += f->bytes;
+    n->file_count++;
+    n->complexity += f->complexity;
+    if (f->generated)
+        n->generated += f->line_count;
+    if (g_opts.module_report && f->module >= 0) {
+        GoModule *m = &g_modules[f->module];
+        m->lines += f->line_count;
+        m->bytes += f->bytes;
+        m->files++;
+        if (f->generated)
+            m->generated += f->line_count;
+    }
+
+    const char *p = rel;
+    const char *slash;
+    while ((slash = strchr(p, '/')) != NULL) {
+        size_t rel_len = (size_t)(slash - rel);
+        DirNode *c = dir_node_child(n, p, (size_t)(slash - p), rel, rel_len);
+        if (!c)
+            break;
+        if (c->file_count == 0 && c->heap_pos < 0 && g_opts.top_by == TOP_BY_GROWTH)
+            c->base_lines = path_map_get(&r->base_dirs, rel, rel_len);
+        c->lines += f->line_count;
+        c->bytes += f->bytes;
+        c->file_count++;
+        c->complexity += f->complexity;
+        if (f->generated)
+            c->generated += f->line_count;
+        top_heap_offer(&r->dir_heap, top_dir_key(c), (size_t)(uintptr_t)c, &c->heap_pos);
+        n = c;
+        p = slash + 1;
+    }
+
+    if (!g_opts.stream)
+        dir_node_add_file(n, index);
+
+    long key = f->line_count;
+    if (g_opts.top_by == TOP_BY_BYTES)
+        key = f->bytes;
+    else if (g_opts.top_by == TOP_BY_GROWTH)
+        key = f->line_count - path_map_get(&r->base_files, rel, strlen(rel));
+    top_heap_offer(&r->file_heap, key, index, NULL);
+
+    for (size_t k = 0; k < f->nfuncs; k++) {
+        const FuncSpan *fs = &f->funcs[k];
+        top_heap_offer(&r->func_heap, fs->fn.lines, (size_t)(uintptr_t)fs, NULL);
+        if (g_opts.max_func_lines > 0 && fs->fn.lines > g_opts.max_func_lines)
+            func_list_push(&r->long_funcs, &r->nlong_funcs, &r->long_funcs_cap, fs);
+        if (g_opts.max_complexity > 0 && fs->fn.complexity > g_opts.max_complexity)
+            func_list_push(&r->complex_funcs, &r->ncomplex_funcs, &r->complex_funcs_cap, fs);
+    }
+}
+
+static int load_baseline(Report *r, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to open baseline: '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        char *end;
+        long lines = strtol(line, &end, 10);
+        if (*end != '\t')
+            continue;
+        strtol(end + 1, &end, 10);
+        if (*end != '\t')
+            continue;
+        const char *rel = end + 1;
+        size_t rel_len = strlen(rel);
+        if (path_map_add(&r->base_files, rel, rel_len, lines) != 0)
+            break;
+        for (size_t i = 0; i < rel_len; i++) {
+            if (rel[i] == '/')
+                path_map_add(&r->base_dirs, rel, i, lines);
+        }
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+static int save_counts(const char *path, const GoFileList *list, size_t root_len) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open '%s' for writing: %s\n", path, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < list->size; i++) {
+        const GoFile *f = &list->data[i];
+        if (f->excluded)
+            continue;
+        const char *rel = f->path + root_len + (f->path[root_len] == '/');
+        fprintf(fp, "%ld\t%ld\t%s\n", f->line_count, f->bytes, rel);
+    }
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int report_init(Report *r, const char *root, const GoFileList *list) {
+    memset(r, 0, sizeof(*r));
+    r->list = list;
+    r->root_path = root;
+    r->root_len = strlen(root);
+    path_map_init(&r->base_files);
+    path_map_init(&r->base_dirs);
+    const char *slash = strrchr(root, '/');
+    const char *base = (slash && slash[1]) ? slash + 1 : root;
+    r->root = dir_node_new(base, strlen(base), "", 0, NULL);
+    if (!r->root)
+        return -1;
+    if (top_heap_init(&r->dir_heap, g_opts.top_k) != 0 ||
+        top_heap_init(&r->file_heap, g_opts.top_k) != 0 ||
+        top_heap_init(&r->func_heap, g_opts.top_funcs) != 0)
+        return -1;
+    if (g_opts.top_by == TOP_BY_GROWTH && load_baseline(r, g_opts.baseline_path) != 0)
+        return -1;
+    return 0;
+}
+
+static void report_free(Report *r) {
+    top_heap_free(&r->dir_heap);
+    top_heap_free(&r->file_heap);
+    top_heap_free(&r->func_heap);
+    free(r->long_funcs);
+    r->long_funcs = NULL;
+    free(r->complex_funcs);
+    r->complex_funcs = NULL;
+    path_map_free(&r->base_files);
+    path_map_free(&r->base_dirs);
+    dir_node_free(r->root);
+    r->root = NULL;
+}
+
+static void print_top_section(const char *what, TopHeap *h, const Report *r, int dirs) {
+    static const char *by_names[] = { "lines", "bytes", "growth" };
+    TopEntry *sorted = (TopEntry*)malloc((h->size ? h->size : 1) * sizeof(TopEntry));
+    if (!sorted)
+        return;
+    memcpy(sorted, h->e, h->size * sizeof(TopEntry));
+    qsort(sorted, h->size, sizeof(TopEntry), compare_top_desc);
+
+    if (g_opts.format == FORMAT_TREE)
+        out_printf("Top %zu %s by %s:\n", h->size, what, by_names[g_opts.top_by]);
+    else if (g_opts.format == FORMAT_JSON)
+        out_printf(",\"top_%s\":[", what);
+    for (size_t i = 0; i < h->size; i++) {
+        const char *name;
+        if (dirs)
+            name = node_path((const DirNode*)(uintptr_t)sorted[i].id);
+        else
+            name = relative_path(r, r->list->data[sorted[i].id].path);
+        switch (g_opts.format) {
+            case FORMAT_JSON:
+            case FORMAT_NDJSON:
+                if (g_opts.format == FORMAT_JSON)
+                    out_puts(i ? ",{\"rank\":" : "{\"rank\":");
+                else
+                    out_printf("{\"type\":\"top_%s\",\"rank\":", dirs ? "dir" : "file");
+                out_long((long)i + 1);
+                out_puts(",\"path\":");
+                out_json_string(name);
+                out_printf(",\"%s\":%ld}", by_names[g_opts.top_by], sorted[i].key);
+                if (g_opts.format == FORMAT_NDJSON)
+                    out_write("\n", 1);
+                break;
+            case FORMAT_CSV:
+                out_printf("top_%s,%zu,", dirs ? "dir" : "file", i + 1);
+                out_csv_field(name);
+                out_printf(",%ld\n", sorted[i].key);
+                break;
+            default:
+                if (g_opts.top_by == TOP_BY_GROWTH)
+                    out_printf("  %+12ld  %s\n", sorted[i].key, name);
+                else
+                    out_printf("  %12ld  %s\n", sorted[i].key, name);
+                break;
+        }
+    }
+    if (g_opts.format == FORMAT_JSON)
+        out_write("]", 1);
+    free(sorted);
+}
+
+static void print_top_report(Report *r) {
+    out_printf("Total: %ld lines, %ld bytes in %ld files\n\n", r->root->lines, r->root->bytes, r->root->file_count);
+    print_top_section("directories", &r->dir_heap, r, 1);
+    out_puts("\n");
+    print_top_section("files", &r->file_heap, r, 0);
+}
+
+static int compare_funcs_desc(const void *a, const void *b) {
+    const FuncSpan *fa = *(const FuncSpan* const*)a;
+    const FuncSpan *fb = *(const FuncSpan* const*)b;
+    if (fa->fn.lines != fb->fn.lines)
+        return (fa->fn.lines < fb->fn.lines) - (fa->fn.lines > fb->fn.lines);
+    int c = strcmp(fa->path, fb->path);
+    if (c != 0)
+        return c;
+    return (fa->fn.line > fb->fn.line) - (fa->fn.line < fb->fn.line);
+}
+
+static int compare_funcs_by_complexity(const void *a, const void *b) {
+    const FuncSpan *fa = *(const FuncSpan* const*)a;
+    const FuncSpan *fb = *(const FuncSpan* const*)b;
+    if (fa->fn.complexity != fb->fn.complexity)
+        return (fa->fn.complexity < fb->fn.complexity) - (fa->fn.complexity > fb->fn.complexity);
+    return compare_funcs_desc(a, b);
+}
+
+/*
+ * kind is "top" for the --top-funcs ranking, "long" for --max-func-lines and
+ * "complex" for --max-complexity violations.
+ */
+static void print_func_section(const char *kind, const FuncSpan **funcs, size_t n, const Report *r) {
+    int top = (kind[0] == 't');
+    int complex = (kind[0] == 'c');
+    qsort(funcs, n, sizeof(*funcs), complex ? compare_funcs_by_complexity : compare_funcs_desc);
+    if (g_opts.format == FORMAT_TREE) {
+        if (top)
+            out_printf("Top %zu functions by lines:\n", n);
+        else if (complex)
+            out_printf("%zu functions over complexity %ld:\n", n, g_opts.max_complexity);
+        else
+            out_printf("%zu functions over %ld lines:\n", n, g_opts.max_func_lines);
+    } else if (g_opts.format == FORMAT_JSON) {
+        if (complex)
+            out_printf(",\"max_complexity\":%ld", g_opts.max_complexity);
+        else if (!top)
+            out_printf(",\"max_func_lines\":%ld", g_opts.max_func_lines);
+        out_printf(",\"%s_functions\":[", kind);
+    }
+    for (size_t i = 0; i < n; i++) {
+        const FuncSpan *fs = funcs[i];
+        const char *path = relative_path(r, fs->path);
+        if (g_opts.format == FORMAT_TREE) {
+            if (complex)
+                out_printf("  %12ld  %s:%ld  %s  (%ld lines)\n", fs->fn.complexity, path, fs->fn.line, fs->fn.name, fs->fn.lines);
+            else if (g_opts.complexity)
+                out_printf("  %12ld  %s:%ld  %s  (complexity %ld)\n", fs->fn.lines, path, fs->fn.line, fs->fn.name, fs->fn.complexity);
+            else
+                out_printf("  %12ld  %s:%ld  %s\n", fs->fn.lines, path, fs->fn.line, fs->fn.name);
+            continue;
+        }
+        if (g_opts.format == FORMAT_JSON)
+            out_puts(i ? ",{" : "{");
+        else
+            out_printf("{\"type\":\"%s_function\",", kind);
+        if (top)
+            out_printf("\"rank\":%zu,", i + 1);
+        out_puts("\"path\":");
+        out_json_string(path);
+        out_printf(",\"line\":%ld,\"name\":", fs->fn.line);
+        out_json_string(fs->fn.name);
+        out_printf(",\"lines\":%ld", fs->fn.lines);
+        if (g_opts.complexity)
+            out_printf(",\"complexity\":%ld", fs->fn.complexity);
+        out_write("}", 1);
+        if (g_opts.format == FORMAT_NDJSON)
+            out_write("\n", 1);
+    }
+    if (g_opts.format == FORMAT_JSON)
+        out_write("]", 1);
+}
+
+static void print_func_report(Report *r) {
+    if (g_opts.top_funcs) {
+        TopHeap *h = &r->func_heap;
+        const FuncSpan **funcs = (const FuncSpan**)malloc((h->size ? h->size : 1) * sizeof(*funcs));
+        if (funcs) {
+            for (size_t i = 0; i < h->size; i++)
+                funcs[i] = (const FuncSpan*)(uintptr_t)h->e[i].id;
+            if (g_opts.format == FORMAT_TREE)
+                out_puts("\n");
+            print_func_section("top", funcs, h->size, r);
+            free(funcs);
+        }
+    }
+    if (g_opts.max_func_lines > 0) {
+        if (g_opts.format == FORMAT_TREE)
+            out_puts("\n");
+        print_func_section("long", r->long_funcs, r->nlong_funcs, r);
+    }
+    if (g_opts.max_complexity > 0) {
+        if (g_opts.format == FORMAT_TREE)
+            out_puts("\n");
+        print_func_section("complex", r->complex_funcs, r->ncomplex_funcs, r);
+    }
+}
+
+/* Fills in dup_lines of every directory once dup_finish() has run. */
+static long dup_aggregate(DirNode *n, const GoFileList *list) {
+    long dup = 0;
+    for (size_t i = 0; i < n->nfiles; i++) {
+        const GoFile *f = &list->data[n->files[i]];
+        if (f->dup)
+            dup += f->dup->dup_lines;
+    }
+    for (size_t i = 0; i < n->ndirs; i++)
+        dup += dup_aggregate(n->dirs[i], list);
+    n->dup_lines = dup;
+    return dup;
+}
+
+static void print_dup_report(const Report *r) {
+    const DirNode *root = r->root;
+    size_t n = g_dup_nblocks < g_opts.dup_blocks ? g_dup_nblocks : g_opts.dup_blocks;
+    if (g_opts.format == FORMAT_TREE) {
+        out_printf("\nDuplicated: %ld of %ld lines (%.1f%%) in %zu blocks of at least %d lines",
+                   root->dup_lines, root->lines, dup_percent(root->dup_lines, root->lines),
+                   g_dup_nblocks, g_opts.duplicates);
+        if (g_dup_bits)
+            out_printf(", estimated from 1/%llu of the hash space", 1ULL << g_dup_bits);
+        out_puts("\n");
+        if (n)
+            out_printf("Top %zu duplicated blocks:\n", n);
+    } else if (g_opts.format == FORMAT_JSON) {
+        out_printf(",\"duplicates\":{\"window\":%d,\"sample_bits\":%d,\"fingerprints\":%zu,"
+                   "\"duplicated_lines\":%ld,\"block_count\":%zu,\"blocks\":[",
+                   g_opts.duplicates, g_dup_bits, g_dup_nall, root->dup_lines, g_dup_nblocks);
+    }
+    for (size_t i = 0; i < n; i++) {
+        const DupBlock *b = &g_dup_blocks[i];
+        const char *path = relative_path(r, b->file->path);
+        const char *other = relative_path(r, b->other->path);
+        if (g_opts.format == FORMAT_TREE) {
+            out_printf("  %12ld  %s:%u-%u  (%zu copies, also %s:%u)\n", b->lines, path,
+                       b->src_start, b->src_end, b->copies, other, b->other_start);
+            continue;
+        }
+        if (g_opts.format == FORMAT_JSON)
+            out_puts(i ? ",{" : "{");
+        else
+            out_puts("{\"type\":\"duplicate_block\",");
+        out_printf("\"rank\":%zu,\"path\":", i + 1);
+        out_json_string(path);
+        out_printf(",\"line\":%u,\"end_line\":%u,\"lines\":%ld,\"copies\":%zu,\"other_path\":",
+                   b->src_start, b->src_end, b->lines, b->copies);
+        out_json_string(other);
+        out_printf(",\"other_line\":%u}", b->other_start);
+        if (g_opts.format == FORMAT_NDJSON)
+            out_write("\n", 1);
+    }
+    if (g_opts.format == FORMAT_JSON)
+        out_puts("]}");
+}
+
+static int compare_modules_desc(const void *a, const void *b) {
+    const GoModule *ma = *(const GoModule* const*)a;
+    const GoModule *mb = *(const GoModule* const*)b;
+    if (ma->lines != mb->lines)
+        return (ma->lines < mb->lines) - (ma->lines > mb->lines);
+    return strcmp(ma->dir, mb->dir);
+}
+
+/* Modules by lines; the tree format prints a table, the others one record per module. */
+static void print_module_report(const Report *r) {
+    const GoModule **mods = (const GoModule**)malloc((g_nmodules ? g_nmodules : 1) * sizeof(*mods));
+    if (!mods)
+        return;
+    for (size_t i = 0; i < g_nmodules; i++)
+        mods[i] = &g_modules[i];
+    qsort(mods, g_nmodules, sizeof(*mods), compare_modules_desc);
+
+    if (g_opts.format == FORMAT_TREE)
+        out_printf("%zu modules by lines:\n", g_nmodules);
+    else if (g_opts.format == FORMAT_JSON)
+        out_puts(",\"modules\":[");
+    for (size_t i = 0; i < g_nmodules; i++) {
+        const GoModule *m = mods[i];
+        const char *dir = strcmp(m->dir, r->root_path) == 0 ? "." : relative_path(r, m->dir);
+        if (g_opts.format == FORMAT_TREE) {
+            out_printf("  %12ld  %8ld files  %s%s  (%s)\n", m->lines, m->files,
+                       m->path[0] ? m->path : "(no module path)", m->vendor ? " [vendor]" : "", dir);
+        } else if (g_opts.format == FORMAT_CSV) {
+            out_puts(m->vendor ? "vendor," : "module,");
+            out_csv_field(m->path);
+            out_printf(",%ld,%ld,%ld,%ld\n", m->lines, m->generated, m->bytes, m->files);
+        } else {
+            if (g_opts.format == FORMAT_JSON)
+                out_puts(i ? ",{\"module\":" : "{\"module\":");
+            else
+                out_puts("{\"type\":\"module\",\"module\":");
+            out_json_string(m->path);
+            out_puts(",\"dir\":");
+            out_json_string(dir);
+            out_printf(",\"vendor\":%s,\"nested\":%s,\"lines\":%ld,\"generated_lines\":%ld,\"bytes\":%ld,\"file_count\":%ld}",
+                       m->vendor ? "true" : "false", m->nested ? "true" : "false",
+                       m->lines, m->generated, m->bytes, m->files);
+            if (g_opts.format == FORMAT_NDJSON)
+                out_write("\n", 1);
+        }
+    }
+    if (g_opts.format == FORMAT_JSON)
+        out_write("]", 1);
+    free(mods);
+}
+
+static int compare_dir_nodes(const void *a, const void *b) {
+    const DirNode *da = *(const DirNode* const*)a;
+    const DirNode *db = *(const DirNode* const*)b;
+    return strcasecmp(da->name, db->name);
+}
+
+static const char *path_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static int compare_file_indices(const void *a, const void *b, void *ctx) {
+    const GoFileList *list = (const GoFileList*)ctx;
+    const char *pa = list->data[*(const size_t*)a].path;
+    const char *pb = list->data[*(const size_t*)b].path;
+    return strcasecmp(path_basename(pa), path_basename(pb));
+}
+
+static void report_sort(DirNode *n, const GoFileList *list) {
+    qsort(n->dirs, n->ndirs, sizeof(DirNode*), compare_dir_nodes);
+    qsort_r(n->files, n->nfiles, sizeof(size_t), compare_file_indices, (void*)list);
+    for (size_t i = 0; i < n->ndirs; i++)
+        report_sort(n->dirs[i], list);
+}
+
+/* Same layout as print_tree_only_go(), built from the report instead of readdir. */
+static void print_report_tree(const DirNode *n, const char *prefix, int is_last, const GoFileList *list) {
+    if (n->lines == 0)
+        return;
+    if (prefix[0] == '\0')
+        out_puts(n->name);
+    else
+        out_printf("%s%s%s", prefix, (is_last ? "└── " : "├── "), n->name);
+    print_node_count(n->lines, n->generated, n->dup_lines, n->complexity);
+
+    char newPrefix[256];
+    snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix, (is_last ? "    " : "│   "));
+
+    size_t visible = n->nfiles;
+    for (size_t i = 0; i < n->ndirs; i++)
+        visible += (n->dirs[i]->lines != 0);
+    size_t di = 0, fi = 0, shown = 0;
+    while (di < n->ndirs || fi < n->nfiles) {
+        const GoFile *f = (fi < n->nfiles) ? &list->data[n->files[fi]] : NULL;
+        if (di < n->ndirs && (!f || strcasecmp(n->dirs[di]->name, path_basename(f->path)) <= 0)) {
+            const DirNode *d = n->dirs[di++];
+            if (d->lines == 0)
+                continue;
+            shown++;
+            print_report_tree(d, newPrefix, shown == visible, list);
+        } else {
+            fi++;
+            shown++;
+            out_printf("%s%s%s", newPrefix, (shown == visible ? "└── " : "├── "), path_basename(f->path));
+            print_node_count(f->line_count, f->generated ? f->line_count : 0, f->dup ? f->dup->dup_lines : 0,
+                             f->complexity);
+        }
+    }
+}
+
+static void emit_ndjson_file(const Report *r, size_t index) {
+    const GoFile *f = &r->list->data[index];
+    out_puts("{\"type\":\"file\",\"path\":");
+    out_json_string(relative_path(r, f->path));
+    out_puts(",\"lines\":");
+    out_long(f->line_count);
+    out_puts(",\"bytes\":");
+    out_long(f->bytes);
+    if (g_opts.complexity) {
+        out_puts(",\"complexity\":");
+        out_long(f->complexity);
+    }
+    out_puts(f->generated ? ",\"generated\":true}\n" : ",\"generated\":false}\n");
+    out_stream_tick();
+}
+
+static void emit_json_counts(const DirNode *n) {
+    out_puts(",\"lines\":");
+    out_long(n->lines);
+    out_puts(",\"generated_lines\":");
+    out_long(n->generated);
+    out_puts(",\"bytes\":");
+    out_long(n->bytes);
+    out_puts(",\"file_count\":");
+    out_long(n->file_count);
+    if (g_opts.duplicates) {
+        out_puts(",\"duplicated_lines\":");
+        out_long(n->dup_lines);
+    }
+    if (g_opts.complexity) {
+        out_puts(",\"complexity\":");
+        out_long(n->complexity);
+    }
+}
+
+static void emit_json_dir(const Report *r, const DirNode *n) {
+    out_puts("{\"name\":");
+    out_json_string(n->name);
+    out_puts(",\"path\":");
+    out_json_string(node_path(n));
+    emit_json_counts(n);
+    out_puts(",\"files\":[");
+    for (size_t i = 0; i < n->nfiles; i++) {
+        const GoFile *f = &r->list->data[n->files[i]];
+        out_puts(i ? ",{\"name\":" : "{\"name\":");
+        out_json_string(path_basename(f->path));
+        out_puts(",\"path\":");
+        out_json_string(relative_path(r, f->path));
+        out_puts(",\"lines\":");
+        out_long(f->line_count);
+        out_puts(",\"bytes\":");
+        out_long(f->bytes);
+        if (g_opts.duplicates) {
+            out_puts(",\"duplicated_lines\":");
+            out_long(f->dup ? f->dup->dup_lines : 0);
+        }
+        if (g_opts.complexity) {
+            out_puts(",\"complexity\":");
+            out_long(f->complexity);
+        }
+        out_puts(f->generated ? ",\"generated\":true}" : ",\"generated\":false}");
+    }
+    out_puts("],\"dirs\":[");
+    for (size_t i = 0; i < n->ndirs; i++) {
+        if (i)
+            out_write(",", 1);
+        emit_json_dir(r, n->dirs[i]);
+    }
+    out_puts("]}");
+}
+
+static void emit_ndjson_dir(const DirNode *n) {
+    out_puts("{\"type\":\"dir\",\"path\":");
+    out_json_string(node_path(n));
+    emit_json_counts(n);
+    out_puts("}\n");
+}
+
+static void emit_ndjson_dirs(const DirNode *n) {
+    emit_ndjson_dir(n);
+    for (size_t i = 0; i < n->ndirs; i++)
+        emit_ndjson_dirs(n->dirs[i]);
+}
+
+static void emit_csv_dir_row(const DirNode *n) {
+    out_puts("dir,");
+    out_csv_field(node_path(n));
+    out_printf(",%ld,%ld,%ld,%ld\n", n->lines, n->generated, n->bytes, n->file_count);
+}
+
+static void emit_csv_file_row(const Report *r, const GoFile *f) {
+    out_puts("file,");
+    out_csv_field(relative_path(r, f->path));
+    out_printf(",%ld,%ld,%ld,1\n", f->line_count, f->generated ? f->line_count : 0, f->bytes);
+}
+
+static void emit_csv_dir(const Report *r, const DirNode *n) {
+    emit_csv_dir_row(n);
+    for (size_t i = 0; i < n->nfiles; i++)
+        emit_csv_file_row(r, &r->list->data[n->files[i]]);
+    for (size_t i = 0; i < n->ndirs; i++)
+        emit_csv_dir(r, n->dirs[i]);
+}
+
+/*
+ * --stream and --tui lay the tree out from the walked list before any file is
+ * read, with the number of files still pending below every directory, and
+ * feed the workers files in depth-first order, so every directory's files are
+ * one contiguous stretch of the work order.
+ *
+ * --stream writes rows in final sorted order while files are still being
+ * counted, each directory right after its contents. The cursor stops at the
+ * first file that is not finished; a directory row is written once its pending
+ * count drops to zero. Only rows behind the cursor are held back.
+ */
+#define LAYOUT_PENDING 0
+#define LAYOUT_COUNTED 1
+#define LAYOUT_SKIPPED 2
+
+typedef struct {
+    Report *r;
+    DirNode **leaf;
+    unsigned char *state;
+    size_t *order;
+    size_t norder;
+    size_t blocker;
+} TreeLayout;
+
+static void tree_layout_free(TreeLayout *s) {
+    free(s->leaf);
+    free(s->state);
+    free(s->order);
+    memset(s, 0, sizeof(*s));
+}
+
+static void tree_layout_order(TreeLayout *s, DirNode *n) {
+    const GoFileList *list = s->r->list;
+    size_t di = 0, fi = 0;
+    n->order_lo = s->norder;
+    while (di < n->ndirs || fi < n->nfiles) {
+        if (di < n->ndirs && (fi == n->nfiles ||
+                              strcasecmp(n->dirs[di]->name, path_basename(list->data[n->files[fi]].path)) <= 0))
+            tree_layout_order(s, n->dirs[di++]);
+        else
+            s->order[s->norder++] = n->files[fi++];
+    }
+    n->order_hi = s->norder;
+}
+
+/* Lays out the tree of every walked file and the order the files are printed in. */
+static int tree_layout_init(TreeLayout *s, Report *r) {
+    const GoFileList *list = r->list;
+    size_t n = list->size;
+    memset(s, 0, sizeof(*s));
+    s->r = r;
+    s->leaf = (DirNode**)malloc((n ? n : 1) * sizeof(DirNode*));
+    s->state = (unsigned char*)calloc(n ? n : 1, 1);
+    s->order = (size_t*)malloc((n ? n : 1) * sizeof(size_t));
+    if (!s->leaf || !s->state || !s->order) {
+        fprintf(stderr, "Memory allocation failed (stream)\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const char *rel = relative_path(r, list->data[i].path);
+        DirNode *d = r->root;
+        d->pending++;
+        d->total_files++;
+        const char *p = rel;
+        const char *slash;
+        while ((slash = strchr(p, '/')) != NULL) {
+            DirNode *c = dir_node_child(d, p, (size_t)(slash - p), rel, (size_t)(slash - rel));
+            if (!c) {
+                fprintf(stderr, "Memory allocation failed (stream)\n");
+                return -1;
+            }
+            c->pending++;
+            c->total_files++;
+            d = c;
+            p = slash + 1;
+        }
+        dir_node_add_file(d, i);
+        s->leaf[i] = d;
+    }
+    report_sort(r->root, list);
+    tree_layout_order(s, r->root);
+    s->blocker = s->norder ? s->order[0] : SIZE_MAX;
+    return 0;
+}
+
+static void subtree_stream_file(const TreeLayout *s, const GoFile *f) {
+    if (g_opts.format == FORMAT_NDJSON) {
+        emit_ndjson_file(s->r, (size_t)(f - s->r->list->data));
+        return;
+    }
+    if (g_opts.format == FORMAT_CSV) {
+        emit_csv_file_row(s->r, f);
+    } else {
+        out_puts(relative_path(s->r, f->path));
+        print_node_count(f->line_count, f->generated ? f->line_count : 0, 0, f->complexity);
+    }
+    out_stream_tick();
+}
+
+static void subtree_stream_dir(const DirNode *n) {
+    if (n->file_count == 0)
+        return;
+    if (g_opts.format == FORMAT_NDJSON) {
+        emit_ndjson_dir(n);
+    } else if (g_opts.format == FORMAT_CSV) {
+        emit_csv_dir_row(n);
+    } else {
+        if (n->lines == 0)
+            return;
+        out_puts(node_path(n));
+        if (n->parent)
+            out_write("/", 1);
+        print_node_count(n->lines, n->generated, 0, n->complexity);
+    }
+    out_stream_tick();
+}
+
+/* Writes every row that is ready under n; returns 1 once n itself is written. */
+static int subtree_stream_flush(TreeLayout *s, DirNode *n) {
+    const GoFileList *list = s->r->list;
+    while (n->next_dir < n->ndirs || n->next_file < n->nfiles) {
+        DirNode *d = n->next_dir < n->ndirs ? n->dirs[n->next_dir] : NULL;
+        size_t fi = n->next_file < n->nfiles ? n->files[n->next_file] : SIZE_MAX;
+        if (d && (fi == SIZE_MAX || strcasecmp(d->name, path_basename(list->data[fi].path)) <= 0)) {
+            if (!subtree_stream_flush(s, d))
+                return 0;
+            n->next_dir++;
+        } else {
+            if (s->state[fi] == LAYOUT_PENDING) {
+                s->blocker = fi;
+                return 0;
+            }
+            if (s->state[fi] == LAYOUT_COUNTED)
+                subtree_stream_file(s, &list->data[fi]);
+            n->next_file++;
+        }
+    }
+    if (n->pending > 0)
+        return 0;
+    n->pending = -1;
+    subtree_stream_dir(n);
+    return 1;
+}
+
+/* Called for each finished file, after report_add() for counted ones. */
+static void tree_layout_done(TreeLayout *s, size_t index, int counted) {
+    s->state[index] = counted ? LAYOUT_COUNTED : LAYOUT_SKIPPED;
+    for (DirNode *d = s->leaf[index]; d; d = d->parent)
+        d->pending--;
+    if (g_opts.stream && index == s->blocker)
+        subtree_stream_flush(s, s->r->root);
+}
+
+/*
+ * --tui: a terminal browser over the laid-out tree. The tree is shown as soon
+ * as the walk is done and subtree counts fill in as workers finish. The main
+ * thread interleaves results, keys and frames: it drains finished files,
+ * checks for input and redraws at most every TUI_FRAME_NS, drawing only the
+ * rows on screen. The directory under the cursor and recently expanded ones
+ * are handed to the pool as priorities, so their files are counted first.
+ */
+#define TUI_FRAME_NS 16000000L
+#define TUI_RESORT_NS 500000000L
+#define TUI_RESORT_MAX_ROWS 50000
+
+typedef struct {
+    DirNode *dir;
+    size_t file;
+    int depth;
+} TuiRow;
+
+typedef struct {
+    TreeLayout *layout;
+    WorkPool *pool;
+    const struct timespec *start;
+    TuiRow *rows;
+    size_t nrows;
+    size_t rows_cap;
+    size_t cursor;
+    size_t top;
+    int height;
+    int width;
+    int by_size;
+    int quit;
+    int relayout;
+    int redraw;
+    long files_done;
+    DirNode *recent[WORK_PRIO_MAX];
+    int nrecent;
+    struct timespec last_frame;
+    struct timespec last_layout;
+} Tui;
+
+static struct termios g_tui_saved;
+static int g_tui_active;
+static volatile sig_atomic_t g_tui_signal;
+static volatile sig_atomic_t g_tui_resized;
+static volatile sig_atomic_t g_tui_stopped;
+
+static void tui_restore(void) {
+    if (!g_tui_active)
+        return;
+    g_tui_active = 0;
+    static const char leave[] = "\033[?25h\033[?1049l";
+    if (write(STDOUT_FILENO, leave, sizeof(leave) - 1) < 0) {
+        /* Nothing left to do with a terminal that cannot be written. */
+    }
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_tui_saved);
+}
+
+static void tui_size(Tui *t) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 2 && ws.ws_col > 20) {
+        t->height = ws.ws_row - 2;
+        t->width = ws.ws_col;
+    } else {
+        t->height = 22;
+        t->width = 80;
+    }
+}
+
+static void tui_on_signal(int sig) {
+    if (sig == SIGWINCH)
+        g_tui_resized = 1;
+    else if (sig == SIGTSTP)
+        g_tui_stopped = 1;
+    else
+        g_tui_signal = 1;
+}
+
+/* Raw input and the alternate screen; used on open and again after a resume. */
+static int tui_enter(void) {
+    struct termios raw = g_tui_saved;
+    raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+    raw.c_iflag &= ~(tcflag_t)(IXON | ICRNL);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0)
+        return -1;
+    g_tui_active = 1;
+    static const char enter[] = "\033[?1049h\033[?25l\033[2J";
+    if (write(STDOUT_FILENO, enter, sizeof(enter) - 1) < 0) {
+        /* The next frame reports nothing useful either; keep going. */
+    }
+    return 0;
+}
+
+static void tui_handle(int sig) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = tui_on_signal;
+    sigaction(sig, &sa, NULL);
+}
+
+/*
+ * Ctrl-Z: hands the terminal back in its original state before stopping, and
+ * sets it up again once the shell continues us.
+ */
+static void tui_suspend(Tui *t) {
+    g_tui_stopped = 0;
+    out_flush();
+    tui_restore();
+    signal(SIGTSTP, SIG_DFL);
+    raise(SIGTSTP);
+    /* Execution resumes here after SIGCONT. */
+    tui_handle(SIGTSTP);
+    if (tui_enter() != 0) {
+        t->quit = 1;
+        return;
+    }
+    tui_size(t);
+    t->redraw = 1;
+}
+
+static int tui_open(Tui *t, TreeLayout *layout, WorkPool *pool, const struct timespec *start) {
+    memset(t, 0, sizeof(*t));
+    t->layout = layout;
+    t->pool = pool;
+    t->start = start;
+    if (tcgetattr(STDIN_FILENO, &g_tui_saved) != 0) {
+        fprintf(stderr, "Failed to set up the terminal: %s\n", strerror(errno));
+        return -1;
+    }
+    if (tui_enter() != 0) {
+        fprintf(stderr, "Failed to set up the terminal: %s\n", strerror(errno));
+        return -1;
+    }
+    atexit(tui_restore);
+    tui_handle(SIGINT);
+    tui_handle(SIGTERM);
+    tui_handle(SIGWINCH);
+    tui_handle(SIGTSTP);
+    tui_size(t);
+    layout->r->root->expanded = 1;
+    t->relayout = t->redraw = 1;
+    return 0;
+}
+
+static void tui_close(Tui *t) {
+    out_flush();
+    tui_restore();
+    free(t->rows);
+    t->rows = NULL;
+}
+
+static void tui_push_row(Tui *t, DirNode *dir, size_t file, int depth) {
+    if (t->nrows == t->rows_cap) {
+        size_t new_cap = t->rows_cap ? t->rows_cap * 2 : 256;
+        TuiRow *rows = (TuiRow*)realloc(t->rows, new_cap * sizeof(TuiRow));
+        if (!rows) {
+            fprintf(stderr, "Memory allocation failed (tui)\n");
+            exit(1);
+        }
+        t->rows = rows;
+        t->rows_cap = new_cap;
+    }
+    t->rows[t->nrows].dir = dir;
+    t->rows[t->nrows].file = file;
+    t->rows[t->nrows].depth = depth;
+    t->nrows++;
+}
+
+static long tui_row_lines(const Tui *t, const TuiRow *row) {
+    if (row->dir)
+        return row->dir->lines;
+    return t->layout->state[row->file] == LAYOUT_COUNTED ? t->layout->r->list->data[row->file].line_count : 0;
+}
+
+static const char *tui_row_name(const Tui *t, const TuiRow *row) {
+    return row->dir ? row->dir->name : path_basename(t->layout->r->list->data[row->file].path);
+}
+
+static int compare_tui_rows(const void *a, const void *b, void *ctx) {
+    const Tui *t = (const Tui*)ctx;
+    const TuiRow *ra = (const TuiRow*)a, *rb = (const TuiRow*)b;
+    if (t->by_size) {
+        long la = tui_row_lines(t, ra), lb = tui_row_lines(t, rb);
+        if (la != lb)
+            return (la < lb) - (la > lb);
+    }
+    int c = strcasecmp(tui_row_name(t, ra), tui_row_name(t, rb));
+    if (c == 0 && !ra->dir != !rb->dir)
+        return ra->dir ? -1 : 1;
+    return c;
+}
+
+/* Appends the children of an expanded directory, sorted, and recurses into expanded ones. */
+static void tui_flatten(Tui *t, DirNode *n, int depth) {
+    size_t first = t->nrows;
+    for (size_t i = 0; i < n->ndirs; i++)
+        tui_push_row(t, n->dirs[i], SIZE_MAX, depth);
+    for (size_t i = 0; i < n->nfiles; i++)
+        tui_push_row(t, NULL, n->files[i], depth);
+    size_t count = t->nrows - first;
+    qsort_r(t->rows + first, count, sizeof(TuiRow), compare_tui_rows, t);
+
+    /* Expanded children go right below their row; move the tail out of the way first. */
+    TuiRow *kids = (TuiRow*)malloc((count ? count : 1) * sizeof(TuiRow));
+    if (!kids) {
+        fprintf(stderr, "Memory allocation failed (tui)\n");
+        exit(1);
+    }
+    memcpy(kids, t->rows + first, count * sizeof(TuiRow));
+    t->nrows = first;
+    for (size_t i = 0; i < count; i++) {
+        tui_push_row(t, kids[i].dir, kids[i].file, depth);
+        if (kids[i].dir && kids[i].dir->expanded)
+            tui_flatten(t, kids[i].dir, depth + 1);
+    }
+    free(kids);
+}
+
+static void tui_relayout(Tui *t) {
+    TuiRow keep = { NULL, SIZE_MAX, 0 };
+    if (t->cursor < t->nrows)
+        keep = t->rows[t->cursor];
+    t->nrows = 0;
+    DirNode *root = t->layout->r->root;
+    tui_push_row(t, root, SIZE_MAX, 0);
+    if (root->expanded)
+        tui_flatten(t, root, 1);
+    t->cursor = 0;
+    for (size_t i = 0; i < t->nrows; i++) {
+        if (t->rows[i].dir == keep.dir && t->rows[i].file == keep.file) {
+            t->cursor = i;
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t->last_layout);
+    t->relayout = 0;
+    t->redraw = 1;
+}
+
+static long tui_elapsed_ns(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000L + (now.tv_nsec - since->tv_nsec);
+}
+
+/* Writes at most width columns of s, cutting at a character boundary. */
+static int tui_put_clipped(const char *s, int width) {
+    int cols = 0;
+    const char *p = s;
+    while (*p && cols < width) {
+        const char *q = p + 1;
+        while ((*q & 0xC0) == 0x80)
+            q++;
+        p = q;
+        cols++;
+    }
+    out_write(s, (size_t)(p - s));
+    return cols;
+}
+
+static void tui_draw_row(Tui *t, const TuiRow *row, int selected) {
+    char count[48];
+    if (row->dir) {
+        const DirNode *d = row->dir;
+        if (d->pending > 0 && d->total_files > 0)
+            snprintf(count, sizeof(count), "%ld+ lines %3ld%%", d->lines,
+                     100 * (d->total_files - d->pending) / d->total_files);
+        else
+            snprintf(count, sizeof(count), "%ld lines     ", d->lines);
+    } else {
+        unsigned char st = t->layout->state[row->file];
+        if (st == LAYOUT_PENDING)
+            snprintf(count, sizeof(count), "...      ");
+        else if (st == LAYOUT_SKIPPED)
+            snprintf(count, sizeof(count), "skipped      ");
+        else
+            snprintf(count, sizeof(count), "%ld lines     ", t->layout->r->list->data[row->file].line_count);
+    }
+    int count_len = (int)strlen(count);
+    int indent = row->depth * 2;
+    int room = t->width - count_len - 2;
+    if (selected)
+        out_puts("\033[7m");
+    int used = 0;
+    for (int i = 0; i < indent && used < room; i++, used++)
+        out_write(" ", 1);
+    if (used + 2 <= room) {
+        out_puts(row->dir ? (row->dir->expanded ? "\xe2\x96\xbe " : "\xe2\x96\xb8 ") : "  ");
+        used += 2;
+    }
+    if (used < room) {
+        used += tui_put_clipped(tui_row_name(t, row), room - used);
+        if (row->dir && row->dir->parent && used < room) {
+            out_write("/", 1);
+            used++;
+        }
+    }
+    for (; used < t->width - count_len; used++)
+        out_write(" ", 1);
+    out_puts(count);
+    out_puts(selected ? "\033[0m\033[K\r\n" : "\033[K\r\n");
+}
+
+static void tui_draw(Tui *t) {
+    uint64_t t0 = trace_begin();
+    if (t->cursor >= t->nrows)
+        t->cursor = t->nrows ? t->nrows - 1 : 0;
+    if (t->cursor < t->top)
+        t->top = t->cursor;
+    if (t->cursor >= t->top + (size_t)t->height)
+        t->top = t->cursor - (size_t)t->height + 1;
+
+    const DirNode *root = t->layout->r->root;
+    size_t total = t->layout->r->list->size;
+    char head[256];
+    int len = snprintf(head, sizeof(head), " goline  %ld/%zu files  %ld lines  %.1fs  sort: %s",
+                       t->files_done, total, root->lines, tui_elapsed_ns(t->start) / 1e9,
+                       t->by_size ? "size" : "name");
+    out_puts("\033[H\033[7m");
+    tui_put_clipped(head, t->width);
+    for (int i = len; i < t->width; i++)
+        out_write(" ", 1);
+    out_puts("\033[0m\r\n");
+    for (int i = 0; i < t->height; i++) {
+        size_t r = t->top + (size_t)i;
+        if (r < t->nrows)
+            tui_draw_row(t, &t->rows[r], r == t->cursor);
+        else
+            out_puts("\033[K\r\n");
+    }
+    tui_put_clipped(" \xe2\x86\x91\xe2\x86\x93 move  \xe2\x86\x92/enter expand  \xe2\x86\x90 collapse  s sort by size/name  q quit",
+                    t->width);
+    out_puts("\033[K");
+    out_flush();
+    clock_gettime(CLOCK_MONOTONIC, &t->last_frame);
+    t->redraw = 0;
+    trace_end("frame", t0, NULL);
+}
+
+/* Hands the hovered directory and the recently expanded ones to the pool. */
+static void tui_prioritize(Tui *t) {
+    size_t lo[WORK_PRIO_MAX], hi[WORK_PRIO_MAX];
+    int n = 0;
+    DirNode *hover = NULL;
+    if (t->cursor < t->nrows)
+        hover = t->rows[t->cursor].dir;
+    DirNode *cand[WORK_PRIO_MAX + 1];
+    int ncand = 0;
+    if (hover)
+        cand[ncand++] = hover;
+    for (int i = 0; i < t->nrecent; i++)
+        cand[ncand++] = t->recent[i];
+    for (int i = 0; i < ncand && n < WORK_PRIO_MAX; i++) {
+        DirNode *d = cand[i];
+        if (!d->parent || d->pending <= 0 || (i > 0 && d == hover))
+            continue;
+        /* Plans sort by size within windows, so widen the stretch to whole windows. */
+        lo[n] = d->order_lo - d->order_lo % PLAN_ORDER_WINDOW;
+        hi[n] = d->order_hi + (PLAN_ORDER_WINDOW - d->order_hi % PLAN_ORDER_WINDOW) % PLAN_ORDER_WINDOW;
+        if (hi[n] > t->layout->norder)
+            hi[n] = t->layout->norder;
+        n++;
+    }
+    work_pool_prioritize(t->pool, lo, hi, n);
+}
+
+static void tui_expand(Tui *t, DirNode *d, int on) {
+    if (d->expanded == on)
+        return;
+    d->expanded = on;
+    t->relayout = 1;
+    int k = 0;
+    for (int i = 0; i < t->nrecent; i++) {
+        if (t->recent[i] != d)
+            t->recent[k++] = t->recent[i];
+    }
+    t->nrecent = k;
+    if (on) {
+        if (t->nrecent == WORK_PRIO_MAX)
+            t->nrecent--;
+        memmove(t->recent + 1, t->recent, (size_t)t->nrecent * sizeof(DirNode*));
+        t->recent[0] = d;
+        t->nrecent++;
+    }
+}
+
+static void tui_key(Tui *t, const char *k, size_t len) {
+    size_t page = (size_t)(t->height > 1 ? t->height - 1 : 1);
+    TuiRow *row = t->cursor < t->nrows ? &t->rows[t->cursor] : NULL;
+    size_t old = t->cursor;
+    if (len == 1 && (k[0] == 'q' || k[0] == 3)) {
+        t->quit = 1;
+    } else if ((len == 1 && k[0] == 'k') || (len == 3 && memcmp(k, "\033[A", 3) == 0)) {
+        if (t->cursor > 0)
+            t->cursor--;
+    } else if ((len == 1 && k[0] == 'j') || (len == 3 && memcmp(k, "\033[B", 3) == 0)) {
+        if (t->cursor + 1 < t->nrows)
+            t->cursor++;
+    } else if (len == 4 && memcmp(k, "\033[5~", 4) == 0) {
+        t->cursor = t->cursor > page ? t->cursor - page : 0;
+    } else if (len == 4 && memcmp(k, "\033[6~", 4) == 0) {
+        t->cursor = t->cursor + page < t->nrows ? t->cursor + page : (t->nrows ? t->nrows - 1 : 0);
+    } else if ((len == 1 && k[0] == 'g') || (len == 3 && memcmp(k, "\033[H", 3) == 0)) {
+        t->cursor = 0;
+    } else if ((len == 1 && k[0] == 'G') || (len == 3 && memcmp(k, "\033[F", 3) == 0)) {
+        t->cursor = t->nrows ? t->nrows - 1 : 0;
+    } else if ((len == 1 && (k[0] == 'l' || k[0] == '\r' || k[0] == '\n')) ||
+               (len == 3 && memcmp(k, "\033[C", 3) == 0)) {
+        if (row && row->dir)
+            tui_expand(t, row->dir, 1);
+    } else if (len == 1 && k[0] == ' ') {
+        if (row && row->dir)
+            tui_expand(t, row->dir, !row->dir->expanded);
+    } else if ((len == 1 && k[0] == 'h') || (len == 3 && memcmp(k, "\033[D", 3) == 0)) {
+        if (row && row->dir && row->dir->expanded && row->dir->parent) {
+            tui_expand(t, row->dir, 0);
+        } else if (row) {
+            while (t->cursor > 0 && t->rows[t->cursor].depth >= row->depth)
+                t->cursor--;
+        }
+    } else if (len == 1 && k[0] == 's') {
+        t->by_size = !t->by_size;
+        t->relayout = 1;
+    }
+    if (t->cursor != old || t->relayout) {
+        t->redraw = 1;
+        if (t->relayout)
+            tui_relayout(t);
+        tui_prioritize(t);
+    }
+}
+
+static void tui_input(Tui *t) {
+    char buf[64];
+    ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+    for (ssize_t i = 0; i < n; ) {
+        size_t len = 1;
+        if (buf[i] == '\033' && i + 2 < n && buf[i + 1] == '[') {
+            len = 3;
+            while (i + (ssize_t)len <= n && len < 6 && !(buf[i + len - 1] >= 0x40 && buf[i + len - 1] <= 0x7E))
+                len++;
+            if (i + (ssize_t)len > n)
+                len = (size_t)(n - i);
+        }
+        tui_key(t, buf + i, len);
+        i += (ssize_t)len;
+    }
+}
+
+/* Input, layout and drawing that are due now; wait_ns > 0 also waits that long for a key. */
+static void tui_tick(Tui *t, long wait_ns) {
+    if (g_tui_signal)
+        t->quit = 1;
+    if (g_tui_stopped)
+        tui_suspend(t);
+    if (g_tui_resized) {
+        g_tui_resized = 0;
+        tui_size(t);
+        out_puts("\033[2J");
+        t->redraw = 1;
+    }
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&pfd, 1, (int)(wait_ns / 1000000L)) > 0)
+        tui_input(t);
+    if (t->quit || (!t->redraw && t->layout->r->root->pending <= 0))
+        return;
+    if (tui_elapsed_ns(&t->last_frame) < TUI_FRAME_NS)
+        return;
+    if (t->by_size && t->layout->r->root->pending > 0 && t->nrows < TUI_RESORT_MAX_ROWS &&
+        tui_elapsed_ns(&t->last_layout) >= TUI_RESORT_NS)
+        t->relayout = 1;
+    if (t->relayout)
+        tui_relayout(t);
+    tui_draw(t);
+}
+
+/*
+ * work_pool_next() for --tui: keeps the screen live while waiting. Returns 0
+ * once the pool is done; after the user quits, remaining work is cancelled and
+ * drained without drawing.
+ */
+static int tui_next(Tui *t, WorkDone *out) {
+    for (;;) {
+        if (t->quit) {
+            work_pool_cancel(t->pool);
+            return work_pool_next(t->pool, out);
+        }
+        int rc = work_pool_poll(t->pool, out);
+        if (rc > 0) {
+            t->files_done++;
+            if (tui_elapsed_ns(&t->last_frame) >= TUI_FRAME_NS)
+                tui_tick(t, 0);
+            return 1;
+        }
+        if (rc < 0) {
+            /* Final counts may change the size order even without a pending re-sort. */
+            t->relayout |= t->by_size;
+            t->redraw = 1;
+            tui_tick(t, 0);
+            return 0;
+        }
+        long wait = TUI_FRAME_NS - tui_elapsed_ns(&t->last_frame);
+        tui_tick(t, wait > 1000000L ? wait : 1000000L);
+    }
+}
+
+/* Browsing after the scan is done, until the user quits. */
+static void tui_browse(Tui *t) {
+    t->redraw = 1;
+    while (!t->quit) {
+        long wait = t->redraw ? TUI_FRAME_NS - tui_elapsed_ns(&t->last_frame) : 250000000L;
+        tui_tick(t, wait > 1000000L ? wait : 1000000L);
+    }
+}
+
+static void emit_json_dedup(void) {
+    out_printf("{\"files_saved\":%ld,\"bytes_saved\":%lld,\"unique_contents\":%zu}",
+               g_dedup_files_saved, g_dedup_bytes_saved, dedup_unique_count());
+}
+
+/* Writes the aggregated result in the --format selected machine format. */
+static void emit_machine_report(Report *r, size_t excluded, size_t invalid) {
+    static const char *by_names[] = { "lines", "bytes", "growth" };
+    report_sort(r->root, r->list);
+    const DirNode *root = r->root;
+
+    if (g_opts.format == FORMAT_JSON) {
+        out_puts("{\"root\":");
+        out_json_string(r->root_path);
+        out_printf(",\"excluded\":%zu,\"invalid\":%zu", excluded, invalid);
+        if (g_opts.no_nested_modules)
+            out_printf(",\"skipped_modules\":%ld", g_modules_skipped);
+        if (g_opts.no_vendor)
+            out_printf(",\"skipped_vendor\":%ld", g_vendor_skipped);
+        if (g_opts.no_tests)
+            out_printf(",\"skipped_tests\":%ld", g_tests_skipped);
+        if (build_filtering())
+            out_printf(",\"skipped_constraints\":%ld", g_constraint_skipped);
+        emit_json_counts(root);
+        if (g_opts.top_k) {
+            out_printf(",\"top_by\":\"%s\"", by_names[g_opts.top_by]);
+            print_top_section("directories", &r->dir_heap, r, 1);
+            print_top_section("files", &r->file_heap, r, 0);
+        } else {
+            out_puts(",\"tree\":");
+            emit_json_dir(r, root);
+        }
+        print_func_report(r);
+        if (g_opts.duplicates)
+            print_dup_report(r);
+        if (g_opts.module_report)
+            print_module_report(r);
+        if (g_opts.dedup) {
+            out_puts(",\"dedup\":");
+            emit_json_dedup();
+        }
+        out_puts("}\n");
+    } else if (g_opts.format == FORMAT_NDJSON) {
+        if (g_opts.top_k) {
+            print_top_section("directories", &r->dir_heap, r, 1);
+            print_top_section("files", &r->file_heap, r, 0);
+        } else if (!g_opts.stream) {
+            emit_ndjson_dirs(root);
+        }
+        print_func_report(r);
+        if (g_opts.duplicates)
+            print_dup_report(r);
+        if (g_opts.module_report)
+            print_module_report(r);
+        out_printf("{\"type\":\"summary\",\"file_count\":%ld,\"excluded\":%zu,\"invalid\":%zu",
+                   root->file_count, excluded, invalid);
+        out_printf(",\"lines\":%ld,\"generated_lines\":%ld,\"bytes\":%ld", root->lines, root->generated, root->bytes);
+        if (g_opts.duplicates)
+            out_printf(",\"duplicated_lines\":%ld", root->dup_lines);
+        if (g_opts.complexity)
+            out_printf(",\"complexity\":%ld", root->complexity);
+        if (g_opts.dedup) {
+            out_puts(",\"dedup\":");
+            emit_json_dedup();
+        }
+        out_puts("}\n");
+    } else if (g_opts.format == FORMAT_CSV) {
+        if (g_opts.top_k) {
+            out_printf("type,rank,path,%s\n", by_names[g_opts.top_by]);
+            print_top_section("directories", &r->dir_heap, r, 1);
+            print_top_section("files", &r->file_heap, r, 0);
+        } else if (!g_opts.stream) {
+            out_puts("type,path,lines,generated_lines,bytes,files\n");
+            emit_csv_dir(r, root);
+        }
+        if (g_opts.module_report)
+            print_module_report(r);
+    }
+}
+
+/*
+ * --metrics-file: the aggregated result in the Prometheus text exposition
+ * format, for node_exporter's textfile collector. Every series is a gauge
+ * labelled with the scanned root. Directories are listed to --depth (default
+ * METRICS_DEFAULT_DEPTH) so that a deep tree cannot blow up the series count.
+ * The file is written under a temporary name in the same directory and
+ * renamed over FILE, so a scrape never sees a partial file.
+ */
+#define METRICS_DEFAULT_DEPTH 2
+
+enum {
+    METRIC_LINES,
+    METRIC_GENERATED,
+    METRIC_FILES,
+    METRIC_BYTES
+};
+
+typedef struct {
+    double walk;
+    double scan;
+    double output;
+    double total;
+    size_t files_read;
+    long long bytes_read;
+    size_t excluded;
+    size_t invalid;
+    size_t open_failed;
+    size_t read_failed;
+    size_t other_failed;
+} RunMetrics;
+
+static void metrics_family(FILE *fp, const char *name, const char *help) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+}
+
+static void metrics_label_value(FILE *fp, const char *s) {
+    for (; *s; s++) {
+        if (*s == '\\' || *s == '"')
+            fputc('\\', fp);
+        if (*s == '\n')
+            fputs("\\n", fp);
+        else
+            fputc(*s, fp);
+    }
+}
+
+/* Writes `name{root="...",key="value"} ` up to the sample value. */
+static void metrics_series(FILE *fp, const char *name, const char *root, const char *key, const char *value) {
+    fprintf(fp, "%s{root=\"", name);
+    metrics_label_value(fp, root);
+    if (key) {
+        fprintf(fp, "\",%s=\"", key);
+        metrics_label_value(fp, value);
+    }
+    fputs("\"} ", fp);
+}
+
+static void metrics_dirs(FILE *fp, const char *name, const char *root, const DirNode *n, int which, int depth) {
+    long v = which == METRIC_LINES ? n->lines : which == METRIC_GENERATED ? n->generated
+           : which == METRIC_FILES ? n->file_count : n->bytes;
+    metrics_series(fp, name, root, "dir", node_path(n));
+    fprintf(fp, "%ld\n", v);
+    int max_depth = g_opts.max_depth >= 0 ? g_opts.max_depth : METRICS_DEFAULT_DEPTH;
+    if (depth >= max_depth)
+        return;
+    for (size_t i = 0; i < n->ndirs; i++)
+        metrics_dirs(fp, name, root, n->dirs[i], which, depth + 1);
+}
+
+static void metrics_value(FILE *fp, const char *name, const char *root, const char *key, const char *value,
+                          double v) {
+    metrics_series(fp, name, root, key, value);
+    fprintf(fp, v == (double)(long long)v ? "%.0f\n" : "%.6f\n", v);
+}
+
+static int write_metrics(const char *path, Report *r, const RunMetrics *m) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid()) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "Metrics file path too long: '%s'\n", path);
+        return -1;
+    }
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open '%s' for writing: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    const char *root = r->root_path;
+    report_sort(r->root, r->list);
+
+    static const struct {
+        const char *name;
+        const char *help;
+    } dir_families[] = {
+        { "goline_dir_lines", "Code lines (not blank, not comment) per directory, subdirectories included." },
+        { "goline_dir_generated_lines", "Code lines of generated files per directory." },
+        { "goline_dir_files", "Counted .go files per directory." },
+        { "goline_dir_bytes", "Bytes of counted .go files per directory." },
+    };
+    for (int k = 0; k < 4; k++) {
+        metrics_family(fp, dir_families[k].name, dir_families[k].help);
+        metrics_dirs(fp, dir_families[k].name, root, r->root, k, 0);
+    }
+
+    metrics_family(fp, "goline_files_skipped", "Files left out of the counts, by reason.");
+    metrics_value(fp, "goline_files_skipped", root, "reason", "generated_filter", (double)m->excluded);
+    metrics_value(fp, "goline_files_skipped", root, "reason", "invalid_text", (double)m->invalid);
+    metrics_value(fp, "goline_files_skipped", root, "reason", "build_constraints", (double)g_constraint_skipped);
+    metrics_value(fp, "goline_files_skipped", root, "reason", "tests", (double)g_tests_skipped);
+    metrics_family(fp, "goline_file_errors", "Files that could not be counted, by failing step.");
+    metrics_value(fp, "goline_file_errors", root, "reason", "open", (double)m->open_failed);
+    metrics_value(fp, "goline_file_errors", root, "reason", "read", (double)m->read_failed);
+    metrics_value(fp, "goline_file_errors", root, "reason", "other", (double)m->other_failed);
+    metrics_family(fp, "goline_files_scanned", "Files handed to the workers.");
+    metrics_value(fp, "goline_files_scanned", root, NULL, NULL, (double)m->files_read);
+    metrics_family(fp, "goline_bytes_scanned", "Bytes of the files handed to the workers.");
+    metrics_value(fp, "goline_bytes_scanned", root, NULL, NULL, (double)m->bytes_read);
+
+    metrics_family(fp, "goline_phase_duration_seconds", "Wall time of each phase of the run.");
+    metrics_value(fp, "goline_phase_duration_seconds", root, "phase", "walk", m->walk);
+    metrics_value(fp, "goline_phase_duration_seconds", root, "phase", "scan", m->scan);
+    metrics_value(fp, "goline_phase_duration_seconds", root, "phase", "output", m->output);
+    metrics_family(fp, "goline_duration_seconds", "Wall time of the whole run.");
+    metrics_value(fp, "goline_duration_seconds", root, NULL, NULL, m->total);
+    double scan = m->scan > 0 ? m->scan : 1e-9;
+    metrics_family(fp, "goline_scan_bytes_per_second", "Bytes scanned per second of the scan phase.");
+    metrics_value(fp, "goline_scan_bytes_per_second", root, NULL, NULL, (double)m->bytes_read / scan);
+    metrics_family(fp, "goline_scan_files_per_second", "Files scanned per second of the scan phase.");
+    metrics_value(fp, "goline_scan_files_per_second", root, NULL, NULL, (double)m->files_read / scan);
+    metrics_family(fp, "goline_last_run_timestamp_seconds", "Unix time at which the run finished.");
+    metrics_value(fp, "goline_last_run_timestamp_seconds", root, NULL, NULL, (double)time(NULL));
+
+    int rc = 0;
+    if (ferror(fp) || fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        rc = -1;
+    if (fclose(fp) != 0)
+        rc = -1;
+    if (rc == 0 && rename(tmp, path) != 0)
+        rc = -1;
+    if (rc != 0) {
+        fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+    return rc;
+}
+
+/*
+ * --save-snapshot / `goline diff`: the aggregated tree in a flat binary file
+ * that is used in place through mmap. Nodes are stored breadth first, so the
+ * children of a node are contiguous and sorted by name (byte order); diff
+ * walks two snapshots together like a merge. Integers are in the writer's
+ * byte order, which the header records, so a snapshot from a host of the
+ * other byte order is rejected instead of misread. Version 1 files have no
+ * marker and were always written little-endian.
+ */
+#define SNAP_MAGIC "GOLNSNAP"
+#define SNAP_VERSION 2
+#define SNAP_BYTE_ORDER 0x0102030405060708ULL
+#define SNAP_DIR 1u
+#define SNAP_GENERATED 2u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t node_count;
+    uint64_t nodes_offset;
+    uint64_t string_bytes;
+    uint64_t strings_offset;
+    int64_t created;
+    uint64_t byte_order;
+} SnapHeader;
+
+typedef struct {
+    uint32_t name_off;
+    uint32_t name_len;
+    uint32_t first_child;
+    uint32_t child_count;
+    uint32_t flags;
+    uint32_t reserved;
+    int64_t lines;
+    int64_t bytes;
+    int64_t generated;
+    int64_t files;
+} SnapNode;
+
+typedef struct {
+    const char *name;
+    const DirNode *dir;
+    size_t file;
+} SnapChild;
+
+typedef struct {
+    SnapNode *nodes;
+    const DirNode **dirs;
+    size_t count;
+    size_t cap;
+    char *strings;
+    size_t string_bytes;
+    size_t string_cap;
+} SnapWriter;
+
+static int compare_snap_children(const void *a, const void *b) {
+    return strcmp(((const SnapChild*)a)->name, ((const SnapChild*)b)->name);
+}
+
+static int snap_push(SnapWriter *w, const char *name, const DirNode *dir, const GoFile *f) {
+    size_t len = strlen(name);
+    if (w->count == w->cap) {
+        size_t new_cap = w->cap ? w->cap * 2 : 256;
+        SnapNode *nodes = (SnapNode*)realloc(w->nodes, new_cap * sizeof(SnapNode));
+        if (!nodes)
+            return -1;
+        w->nodes = nodes;
+        const DirNode **dirs = (const DirNode**)realloc(w->dirs, new_cap * sizeof(*dirs));
+        if (!dirs)
+            return -1;
+        w->dirs = dirs;
+        w->cap = new_cap;
+    }
+    if (w->string_bytes + len + 1 > w->string_cap) {
+        size_t new_cap = w->string_cap ? w->string_cap * 2 : 4096;
+        while (new_cap < w->string_bytes + len + 1)
+            new_cap *= 2;
+        char *strings = (char*)realloc(w->strings, new_cap);
+        if (!strings)
+            return -1;
+        w->strings = strings;
+        w->string_cap = new_cap;
+    }
+    if (w->count >= UINT32_MAX || w->string_bytes + len + 1 > UINT32_MAX)
+        return -1;
+    SnapNode *n = &w->nodes[w->count];
+    memset(n, 0, sizeof(*n));
+    n->name_off = (uint32_t)w->string_bytes;
+    n->name_len = (uint32_t)len;
+    memcpy(w->strings + w->string_bytes, name, len + 1);
+    w->string_bytes += len + 1;
+    if (dir) {
+        n->flags = SNAP_DIR;
+        n->lines = dir->lines;
+        n->bytes = dir->bytes;
+        n->generated = dir->generated;
+        n->files = dir->file_count;
+    } else {
+        n->flags = f->generated ? SNAP_GENERATED : 0;
+        n->lines = f->line_count;
+        n->bytes = f->bytes;
+        n->generated = f->generated ? f->line_count : 0;
+        n->files = 1;
+    }
+    w->dirs[w->count++] = dir;
+    return 0;
+}
+
+/*
+ * With --stream the layout has put every walked file and its directories in
+ * the tree, so only the files it marks counted, and the directories holding
+ * any, are written.
+ */
+static int save_snapshot(const char *path, const Report *r, const TreeLayout *layout) {
+    SnapWriter w;
+    memset(&w, 0, sizeof(w));
+    SnapChild *kids = NULL;
+    size_t kids_cap = 0;
+    int rc = snap_push(&w, r->root->name, r->root, NULL);
+    for (size_t q = 0; rc == 0 && q < w.count; q++) {
+        const DirNode *d = w.dirs[q];
+        if (!d)
+            continue;
+        size_t nk = d->ndirs + d->nfiles;
+        if (nk > kids_cap) {
+            SnapChild *k = (SnapChild*)realloc(kids, nk * sizeof(SnapChild));
+            if (!k) {
+                rc = -1;
+                break;
+            }
+            kids = k;
+            kids_cap = nk;
+        }
+        nk = 0;
+        for (size_t i = 0; i < d->ndirs; i++) {
+            if (d->dirs[i]->file_count == 0)
+                continue;
+            kids[nk].name = d->dirs[i]->name;
+            kids[nk++].dir = d->dirs[i];
+        }
+        for (size_t i = 0; i < d->nfiles; i++) {
+            if (layout && layout->state[d->files[i]] != LAYOUT_COUNTED)
+                continue;
+            kids[nk].name = path_basename(r->list->data[d->files[i]].path);
+            kids[nk].dir = NULL;
+            kids[nk++].file = d->files[i];
+        }
+        qsort(kids, nk, sizeof(SnapChild), compare_snap_children);
+        w.nodes[q].first_child = (uint32_t)w.count;
+        w.nodes[q].child_count = (uint32_t)nk;
+        for (size_t i = 0; rc == 0 && i < nk; i++)
+            rc = snap_push(&w, kids[i].name, kids[i].dir, kids[i].dir ? NULL : &r->list->data[kids[i].file]);
+    }
+    free(kids);
+    if (rc != 0) {
+        fprintf(stderr, "Memory allocation failed (snapshot)\n");
+        free(w.nodes);
+        free(w.dirs);
+        free(w.strings);
+        return -1;
+    }
+
+    SnapHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, 8);
+    h.version = SNAP_VERSION;
+    h.byte_order = SNAP_BYTE_ORDER;
+    h.header_size = sizeof(SnapHeader);
+    h.node_count = w.count;
+    h.nodes_offset = sizeof(SnapHeader);
+    h.string_bytes = w.string_bytes;
+    h.strings_offset = h.nodes_offset + w.count * sizeof(SnapNode);
+    h.created = (int64_t)time(NULL);
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open '%s' for writing: %s\n", path, strerror(errno));
+        rc = -1;
+    } else {
+        if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+            fwrite(w.nodes, sizeof(SnapNode), w.count, fp) != w.count ||
+            fwrite(w.strings, 1, w.string_bytes, fp) != w.string_bytes)
+            rc = -1;
+        if (fclose(fp) != 0)
+            rc = -1;
+        if (rc != 0)
+            fprintf(stderr, "Failed to write '%s': %s\n", path, strerror(errno));
+    }
+    free(w.nodes);
+    free(w.dirs);
+    free(w.strings);
+    return rc;
+}
+
+typedef struct {
+    void *map;
+    size_t size;
+    const SnapHeader *h;
+    const SnapNode *nodes;
+    const char *strings;
+} Snapshot;
+
+static void snapshot_close(Snapshot *s) {
+    if (s->map)
+        munmap(s->map, s->size);
+    s->map = NULL;
+}
+
+/* Maps a snapshot and checks that every node and name lies inside the file. */
+static int snapshot_open(Snapshot *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open snapshot: '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapHeader)) {
+        fprintf(stderr, "Not a goline snapshot: '%s'\n", path);
+        close(fd);
+        return -1;
+    }
+    s->size = (size_t)st.st_size;
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        fprintf(stderr, "Failed to map snapshot: '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    const SnapHeader *h = (const SnapHeader*)s->map;
+    if (memcmp(h->magic, SNAP_MAGIC, 8) != 0) {
+        fprintf(stderr, "Not a goline snapshot: '%s'\n", path);
+        snapshot_close(s);
+        return -1;
+    }
+    if (h->byte_order == __builtin_bswap64(SNAP_BYTE_ORDER)) {
+        fprintf(stderr, "Snapshot '%s' was written on a host with the other byte order\n", path);
+        snapshot_close(s);
+        return -1;
+    }
+    if (h->version != SNAP_VERSION && h->version != 1) {
+        fprintf(stderr, "Unsupported snapshot version %u in '%s'\n", h->version, path);
+        snapshot_close(s);
+        return -1;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    int order_ok = h->version == 1 ? h->byte_order == 0 : h->byte_order == SNAP_BYTE_ORDER;
+#else
+    int order_ok = h->version != 1 && h->byte_order == SNAP_BYTE_ORDER;
+#endif
+    if (!order_ok) {
+        fprintf(stderr, "Corrupt snapshot: '%s'\n", path);
+        snapshot_close(s);
+        return -1;
+    }
+    if (h->header_size < sizeof(SnapHeader) || h->node_count == 0 ||
+        h->nodes_offset % 8 != 0 || h->nodes_offset > s->size ||
+        h->node_count > (s->size - h->nodes_offset) / sizeof(SnapNode) ||
+        h->strings_offset > s->size || h->string_bytes > s->size - h->strings_offset) {
+        fprintf(stderr, "Corrupt snapshot: '%s'\n", path);
+        snapshot_close(s);
+        return -1;
+    }
+    s->h = h;
+    s->nodes = (const SnapNode*)((const char*)s->map + h->nodes_offset);
+    s->strings = (const char*)s->map + h->strings_offset;
+    /* Child ranges follow their parents in ascending order and never overlap, so no node has two parents. */
+    uint64_t next_child = 1;
+    for (uint64_t i = 0; i < h->node_count; i++) {
+        const SnapNode *n = &s->nodes[i];
+        if ((uint64_t)n->name_off + n->name_len >= h->string_bytes ||
+            (n->child_count && (n->first_child <= i || n->first_child < next_child ||
+                                (uint64_t)n->first_child + n->child_count > h->node_count))) {
+            fprintf(stderr, "Corrupt snapshot: '%s'\n", path);
+            snapshot_close(s);
+            return -1;
+        }
+        if (n->child_count)
+            next_child = (uint64_t)n->first_child + n->child_count;
+    }
+    return 0;
+}
+
+static int snap_name_cmp(const Snapshot *a, const SnapNode *na, const Snapshot *b, const SnapNode *nb) {
+    uint32_t la = na->name_len, lb = nb->name_len;
+    int c = memcmp(a->strings + na->name_off, b->strings + nb->name_off, la < lb ? la : lb);
+    if (c != 0)
+        return c;
+    return (la > lb) - (la < lb);
+}
+
+typedef struct {
+    const Snapshot *a;
+    const Snapshot *b;
+    char path[PATH_MAX];
+    size_t rows;
+} SnapDiff;
+
+static void emit_diff_row(SnapDiff *d, const SnapNode *na, const SnapNode *nb) {
+    static const char *status_names[] = { "changed", "added", "removed" };
+    const SnapNode *n = nb ? nb : na;
+    int dir = (n->flags & SNAP_DIR) != 0;
+    int status = !na ? 1 : !nb ? 2 : 0;
+    long old_lines = na ? (long)na->lines : 0, new_lines = nb ? (long)nb->lines : 0;
+    long old_bytes = na ? (long)na->bytes : 0, new_bytes = nb ? (long)nb->bytes : 0;
+    const char *path = d->path[0] ? d->path : ".";
+    d->rows++;
+    switch (g_opts.format) {
+        case FORMAT_JSON:
+        case FORMAT_NDJSON:
+            if (g_opts.format == FORMAT_JSON)
+                out_puts(d->rows > 1 ? ",{\"path\":" : "{\"path\":");
+            else
+                out_puts("{\"type\":\"delta\",\"path\":");
+            out_json_string(path);
+            out_printf(",\"kind\":\"%s\",\"status\":\"%s\"", dir ? "dir" : "file", status_names[status]);
+            out_printf(",\"old_lines\":%ld,\"new_lines\":%ld,\"delta\":%ld", old_lines, new_lines, new_lines - old_lines);
+            out_printf(",\"old_bytes\":%ld,\"new_bytes\":%ld}", old_bytes, new_bytes);
+            if (g_opts.format == FORMAT_NDJSON)
+                out_write("\n", 1);
+            break;
+        case FORMAT_CSV:
+            out_printf("%s,", dir ? "dir" : "file");
+            out_csv_field(path);
+            out_printf(",%s,%ld,%ld,%ld,%ld,%ld\n", status_names[status], old_lines, new_lines,
+                       new_lines - old_lines, old_bytes, new_bytes);
+            break;
+        default: {
+            char before[24], after[24];
+            if (na)
+                snprintf(before, sizeof(before), "%ld", old_lines);
+            else
+                strcpy(before, "-");
+            if (nb)
+                snprintf(after, sizeof(after), "%ld", new_lines);
+            else
+                strcpy(after, "-");
+            out_printf("%+10ld  %10s -> %-10s  %s%s%s\n", new_lines - old_lines, before, after, path,
+                       dir && d->path[0] ? "/" : "", status ? (status == 1 ? "  (added)" : "  (removed)") : "");
+            break;
+        }
+    }
+}
+
+/* Pre-order walk over the union of both trees; either side may be absent. */
+static void snap_diff_walk(SnapDiff *d, const SnapNode *na, const SnapNode *nb) {
+    if (!na || !nb || na->lines != nb->lines || na->bytes != nb->bytes ||
+        (na->flags & SNAP_DIR) != (nb->flags & SNAP_DIR))
+        emit_diff_row(d, na, nb);
+    if (na && nb && (na->flags & SNAP_DIR) != (nb->flags & SNAP_DIR)) {
+        /* A file replaced by a directory (or back): report the two sides separately. */
+        if (na->child_count)
+            snap_diff_walk(d, na, NULL);
+        if (nb->child_count)
+            snap_diff_walk(d, NULL, nb);
+        return;
+    }
+
+    size_t base = strlen(d->path);
+    const SnapNode *ca = na ? d->a->nodes + na->first_child : NULL;
+    const SnapNode *cb = nb ? d->b->nodes + nb->first_child : NULL;
+    size_t ia = 0, ib = 0;
+    size_t ka = na ? na->child_count : 0, kb = nb ? nb->child_count : 0;
+    while (ia < ka || ib < kb) {
+        const SnapNode *xa = NULL, *xb = NULL;
+        if (ia < ka && ib < kb) {
+            int c = snap_name_cmp(d->a, &ca[ia], d->b, &cb[ib]);
+            if (c <= 0)
+                xa = &ca[ia++];
+            if (c >= 0)
+                xb = &cb[ib++];
+        } else if (ia < ka) {
+            xa = &ca[ia++];
+        } else {
+            xb = &cb[ib++];
+        }
+        const Snapshot *src = xa ? d->a : d->b;
+        const SnapNode *x = xa ? xa : xb;
+        int written = snprintf(d->path + base, sizeof(d->path) - base, "%s%.*s", base ? "/" : "",
+                               (int)x->name_len, src->strings + x->name_off);
+        if (written < 0 || (size_t)written >= sizeof(d->path) - base) {
+            fprintf(stderr, "Path too long in snapshot: '%s'\n", d->path);
+            d->path[base] = '\0';
+            continue;
+        }
+        snap_diff_walk(d, xa, xb);
+        d->path[base] = '\0';
+    }
+}
+
+/* goline diff [--format=FMT] OLD NEW */
+static int run_diff(int argc, char **argv) {
+    const char *paths[2];
+    int npaths = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--format=", 9) == 0) {
+            const char *fmt = argv[i] + 9;
+            if (strcmp(fmt, "tree") == 0 || strcmp(fmt, "text") == 0) {
+                g_opts.format = FORMAT_TREE;
+            } else if (strcmp(fmt, "json") == 0) {
+                g_opts.format = FORMAT_JSON;
+            } else if (strcmp(fmt, "ndjson") == 0) {
+                g_opts.format = FORMAT_NDJSON;
+            } else if (strcmp(fmt, "csv") == 0) {
+                g_opts.format = FORMAT_CSV;
+            } else {
+                fprintf(stderr, "Invalid value for --format: '%s'\n", fmt);
+                return 1;
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Unknown option: '%s'\n", argv[i]);
+            return 1;
+        } else if (npaths < 2) {
+            paths[npaths++] = argv[i];
+        } else {
+            npaths++;
+        }
+    }
+    if (npaths != 2) {
+        fprintf(stderr, "Usage: goline diff [--format=FMT] OLD_SNAPSHOT NEW_SNAPSHOT\n");
+        return 1;
+    }
+
+    Snapshot a, b;
+    if (snapshot_open(&a, paths[0]) != 0)
+        return 1;
+    if (snapshot_open(&b, paths[1]) != 0) {
+        snapshot_close(&a);
+        return 1;
+    }
+    SnapDiff d;
+    memset(&d, 0, sizeof(d));
+    d.a = &a;
+    d.b = &b;
+
+    out_init(STDOUT_FILENO);
+    if (g_opts.format == FORMAT_JSON)
+        out_puts("{\"deltas\":[");
+    else if (g_opts.format == FORMAT_CSV)
+        out_puts("kind,path,status,old_lines,new_lines,delta,old_bytes,new_bytes\n");
+    snap_diff_walk(&d, &a.nodes[0], &b.nodes[0]);
+
+    const SnapNode *ra = &a.nodes[0], *rb = &b.nodes[0];
+    if (g_opts.format == FORMAT_JSON) {
+        out_printf("],\"old\":{\"lines\":%lld,\"bytes\":%lld,\"files\":%lld,\"created\":%lld}",
+                   (long long)ra->lines, (long long)ra->bytes, (long long)ra->files, (long long)a.h->created);
+        out_printf(",\"new\":{\"lines\":%lld,\"bytes\":%lld,\"files\":%lld,\"created\":%lld}}\n",
+                   (long long)rb->lines, (long long)rb->bytes, (long long)rb->files, (long long)b.h->created);
+    } else if (g_opts.format == FORMAT_TREE) {
+        if (d.rows == 0)
+            out_puts("No changes.\n");
+        out_printf("\nTotal: %lld -> %lld lines (%+lld), %lld -> %lld files\n",
+                   (long long)ra->lines, (long long)rb->lines, (long long)(rb->lines - ra->lines),
+                   (long long)ra->files, (long long)rb->files);
+    }
+    out_close();
+    snapshot_close(&a);
+    snapshot_close(&b);
+    return 0;
+}
+
+/*
+ * --estimate: lex a stratified random sample of files and extrapolate line
+ * counts with a ratio estimator (lines per byte) per stratum. Strata are the
+ * top-level directory crossed with floor(log2(st_size)).
+ */
+#define EST_SIZE_CLASSES 48
+#define EST_Z95 1.96
+
+/* Estimator.sampled */
+enum {
+    EST_UNSEEN,
+    EST_SAMPLED,
+    EST_DROPPED
+};
+
+typedef struct {
+    size_t *members;
+    size_t nmembers;
+    size_t cap;
+    size_t next;
+    size_t dropped;
+    long n;
+    double sum_x;
+    double sum_y;
+    double sum_xx;
+    double sum_xy;
+    double sum_yy;
+    double total_x;
+} Stratum;
+
+typedef struct {
+    Stratum *strata;
+    size_t nstrata;
+    size_t cap;
+    PathMap index;
+    int *file_stratum;
+    unsigned char *sampled;
+    double pooled_s2;
+    uint64_t seed;
+    uint64_t rng;
+} Estimator;
+
+static uint64_t est_rand(Estimator *e) {
+    uint64_t x = e->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    e->rng = x;
+    return x;
+}
+
+static int size_class(long size) {
+    int c = 0;
+    while (size > 1 && c < EST_SIZE_CLASSES - 1) {
+        size >>= 1;
+        c++;
+    }
+    return c;
+}
+
+/* Members that still count: drawn files that turned out excluded or unreadable are known to add nothing. */
+static double stratum_size(const Stratum *st) {
+    return (double)(st->nmembers - st->dropped);
+}
+
+static double stratum_ratio(const Stratum *st) {
+    return st->sum_x > 0 ? st->sum_y / st->sum_x : 0.0;
+}
+
+/* Residual variance per file around the stratum's lines-per-byte ratio. */
+static double stratum_s2(const Estimator *e, const Stratum *st) {
+    if (st->n < 2)
+        return e->pooled_s2;
+    double r = stratum_ratio(st);
+    double ss = st->sum_yy - 2.0 * r * st->sum_xy + r * r * st->sum_xx;
+    return ss > 0 ? ss / (double)(st->n - 1) : 0.0;
+}
+
+/* Variance of the stratum total: N^2 (1 - n/N) s^2 / n. */
+static double stratum_var(const Estimator *e, const Stratum *st) {
+    double N = stratum_size(st);
+    if (st->n == 0)
+        return N * N * e->pooled_s2;
+    if (st->n >= N)
+        return 0.0;
+    return N * N * (1.0 - st->n / N) * stratum_s2(e, st) / st->n;
+}
+
+static void estimator_free(Estimator *e) {
+    for (size_t i = 0; i < e->nstrata; i++)
+        free(e->strata[i].members);
+    free(e->strata);
+    free(e->file_stratum);
+    free(e->sampled);
+    path_map_free(&e->index);
+}
+
+/*
+ * Reads only the header of f, as load_one_file() does, and returns 1 when the
+ * generated-file or build filters leave it out. A file that cannot be read is
+ * left to the sampler.
+ */
+static int estimate_header_excluded(GoFile *f) {
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    char *buf = NULL;
+    long len = 0, limit = HEADER_CHUNK;
+    int decided = 0, excluded = 0;
+    for (;;) {
+        char *grown = (char*)realloc(buf, (size_t)limit);
+        if (!grown)
+            break;
+        buf = grown;
+        rate_limit_acquire(limit - len);
+        long got = goline_read(fd, buf + len, limit - len);
+        if (got < 0)
+            break;
+        len += got;
+        int complete = len < limit;
+        long bom = (long)goline_bom_len(buf, (size_t)len);
+        f->generated = goline_scan_header(buf + bom, len - bom, complete, build_filtering(), &decided);
+        if (decided || complete) {
+            excluded = header_excludes(f, buf + bom, len - bom);
+            break;
+        }
+        limit *= 2;
+    }
+    close_input(fd);
+    free(buf);
+    return excluded;
+}
+
+static int estimator_init(Estimator *e, GoFileList *list, size_t root_len) {
+    memset(e, 0, sizeof(*e));
+    path_map_init(&e->index);
+    e->seed = g_opts.has_seed ? g_opts.estimate_seed : ((uint64_t)time(NULL) * HASH_P1 ^ (uint64_t)getpid());
+    e->rng = e->seed * HASH_P1 + HASH_P2;
+    if (e->rng == 0)
+        e->rng = HASH_P2;
+    e->file_stratum = (int*)malloc((list->size ? list->size : 1) * sizeof(int));
+    e->sampled = (unsigned char*)calloc(list->size ? list->size : 1, 1);
+    if (!e->file_stratum || !e->sampled)
+        return -1;
+
+    /*
+     * Header filters are applied to every file up front: an excluded file is
+     * known to add nothing, and leaving it in a stratum would mix zero-line
+     * files into the lines-per-byte ratio.
+     */
+    int header_filters = g_opts.generated_mode != GEN_ALL || build_filtering();
+    char key[PATH_MAX + 8];
+    for (size_t i = 0; i < list->size; i++) {
+        GoFile *f = &list->data[i];
+        if (header_filters && estimate_header_excluded(f)) {
+            f->excluded = 1;
+            f->line_count = 0;
+            e->sampled[i] = EST_DROPPED;
+            e->file_stratum[i] = -1;
+            continue;
+        }
+        const char *rel = f->path + root_len + (f->path[root_len] == '/');
+        const char *slash = strchr(rel, '/');
+        int top_len = slash ? (int)(slash - rel) : 0;
+        int klen = snprintf(key, sizeof(key), "%.*s|%d", top_len, rel, size_class(f->bytes));
+        if (klen < 0 || (size_t)klen >= sizeof(key))
+            klen = (int)sizeof(key) - 1;
+
+        long idx = path_map_get(&e->index, key, (size_t)klen) - 1;
+        if (idx < 0) {
+            if (e->nstrata == e->cap) {
+                size_t new_cap = e->cap ? e->cap * 2 : 64;
+                Stratum *strata = (Stratum*)realloc(e->strata, new_cap * sizeof(Stratum));
+                if (!strata)
+                    return -1;
+                e->strata = strata;
+                e->cap = new_cap;
+            }
+            idx = (long)e->nstrata++;
+            memset(&e->strata[idx], 0, sizeof(Stratum));
+            if (path_map_add(&e->index, key, (size_t)klen, idx + 1) != 0)
+                return -1;
+        }
+        Stratum *st = &e->strata[idx];
+        if (st->nmembers == st->cap) {
+            size_t new_cap = st->cap ? st->cap * 2 : 16;
+            size_t *members = (size_t*)realloc(st->members, new_cap * sizeof(size_t));
+            if (!members)
+                return -1;
+            st->members = members;
+            st->cap = new_cap;
+        }
+        st->members[st->nmembers++] = i;
+        st->total_x += (double)f->bytes;
+        e->file_stratum[i] = (int)idx;
+    }
+
+    /* Fisher-Yates per stratum, so taking members in order is a random sample. */
+    for (size_t h = 0; h < e->nstrata; h++) {
+        Stratum *st = &e->strata[h];
+        for (size_t i = st->nmembers; i > 1; i--) {
+            size_t j = (size_t)(est_rand(e) % i);
+            size_t tmp = st->members[i - 1];
+            st->members[i - 1] = st->members[j];
+            st->members[j] = tmp;
+        }
+    }
+    return 0;
+}
+
+static void estimator_update_pooled(Estimator *e) {
+    double ss = 0.0;
+    long dof = 0;
+    for (size_t h = 0; h < e->nstrata; h++) {
+        const Stratum *st = &e->strata[h];
+        if (st->n < 2)
+            continue;
+        double r = stratum_ratio(st);
+        double s = st->sum_yy - 2.0 * r * st->sum_xy + r * r * st->sum_xx;
+        ss += s > 0 ? s : 0.0;
+        dof += st->n - 1;
+    }
+    e->pooled_s2 = dof > 0 ? ss / (double)dof : 0.0;
+}
+
+static void estimator_totals(const Estimator *e, double *pTotal, double *pVar) {
+    double total = 0.0, var = 0.0;
+    for (size_t h = 0; h < e->nstrata; h++) {
+        const Stratum *st = &e->strata[h];
+        total += stratum_ratio(st) * st->total_x;
+        var += stratum_var(e, st);
+    }
+    *pTotal = total;
+    *pVar = var;
+}
+
+/*
+ * Draws the next file of stratum h. A file that a filter excludes or that
+ * cannot be read is no sample of the counted population: it is dropped from
+ * the stratum, with its bytes, and the next file is drawn instead.
+ */
+static int estimator_sample(Estimator *e, GoFileList *list, size_t h) {
+    Stratum *st = &e->strata[h];
+    size_t i;
+    GoFile *f;
+    for (;;) {
+        if (st->next >= st->nmembers)
+            return -1;
+        i = st->members[st->next++];
+        f = &list->data[i];
+        if (process_one_file(f) == 0)
+            break;
+        f->line_count = 0;
+        st->dropped++;
+        st->total_x -= (double)f->bytes;
+        e->sampled[i] = EST_DROPPED;
+    }
+    double x = (double)f->bytes, y = (double)f->line_count;
+    st->n++;
+    st->sum_x += x;
+    st->sum_y += y;
+    st->sum_xx += x * x;
+    st->sum_xy += x * y;
+    st->sum_yy += y * y;
+    e->sampled[i] = EST_SAMPLED;
+    return 0;
+}
+
+/*
+ * Samples until the 95% interval of the total is within the error budget or
+ * the time budget runs out. Every stratum first gets two files; after that
+ * each draw goes to the stratum whose next sample shrinks the variance most.
+ */
+static void estimator_run(Estimator *e, GoFileList *list, const struct timespec *start) {
+    for (size_t h = 0; h < e->nstrata; h++) {
+        for (int k = 0; k < 2; k++)
+            estimator_sample(e, list, h);
+        if (g_opts.estimate_seconds > 0 && elapsed_seconds(start) >= g_opts.estimate_seconds)
+            return;
+    }
+    estimator_update_pooled(e);
+
+    for (long draws = 0;; draws++) {
+        if ((draws & 15) == 0) {
+            double total, var;
+            estimator_update_pooled(e);
+            estimator_totals(e, &total, &var);
+            double half = EST_Z95 * sqrt(var);
+            if (total <= 0.0 ? half == 0.0 : half / total <= g_opts.estimate_error)
+                return;
+            if (g_opts.estimate_seconds > 0 && elapsed_seconds(start) >= g_opts.estimate_seconds)
+                return;
+        }
+        size_t best = e->nstrata;
+        double best_gain = -1.0;
+        for (size_t h = 0; h < e->nstrata; h++) {
+            const Stratum *st = &e->strata[h];
+            if (st->next >= st->nmembers)
+                continue;
+            double N = stratum_size(st);
+            double n = (double)(st->n ? st->n : 1);
+            double gain = N * N * stratum_s2(e, st) * (1.0 / n - 1.0 / (n + 1.0));
+            if (gain > best_gain) {
+                best_gain = gain;
+                best = h;
+            }
+        }
+        if (best == e->nstrata)
+            return;
+        estimator_sample(e, list, best);
+    }
+}
+
+/*
+ * Fills DirNode estimates bottom-up. A directory below the root belongs to a
+ * single top-level stratum group, so its unsampled bytes and files are kept
+ * per size class and combined with that class's ratio and variance.
+ */
+static void estimate_dir(const Estimator *e, const Report *r, DirNode *n,
+                         double *unsampled_x, long *unsampled_m, int *strata_of_class) {
+    double x[EST_SIZE_CLASSES] = { 0 };
+    long m[EST_SIZE_CLASSES] = { 0 };
+    int cls_stratum[EST_SIZE_CLASSES];
+    for (int c = 0; c < EST_SIZE_CLASSES; c++)
+        cls_stratum[c] = -1;
+    double exact = 0.0;
+
+    for (size_t i = 0; i < n->nfiles; i++) {
+        size_t fi = n->files[i];
+        const GoFile *f = &r->list->data[fi];
+        if (e->sampled[fi]) {
+            exact += (double)f->line_count;
+            n->sampled_files += e->sampled[fi] == EST_SAMPLED;
+            continue;
+        }
+        int c = size_class(f->bytes);
+        x[c] += (double)f->bytes;
+        m[c]++;
+        cls_stratum[c] = e->file_stratum[fi];
+    }
+    for (size_t i = 0; i < n->ndirs; i++) {
+        DirNode *child = n->dirs[i];
+        double cx[EST_SIZE_CLASSES] = { 0 };
+        long cm[EST_SIZE_CLASSES] = { 0 };
+        int cs[EST_SIZE_CLASSES];
+        estimate_dir(e, r, child, cx, cm, cs);
+        exact += child->exact_lines;
+        n->sampled_files += child->sampled_files;
+        for (int c = 0; c < EST_SIZE_CLASSES; c++) {
+            x[c] += cx[c];
+            m[c] += cm[c];
+            if (cs[c] >= 0)
+                cls_stratum[c] = cs[c];
+        }
+    }
+
+    n->exact_lines = exact;
+    n->estimate = exact;
+    n->variance = 0.0;
+    for (int c = 0; c < EST_SIZE_CLASSES; c++) {
+        if (m[c] == 0)
+            continue;
+        const Stratum *st = &e->strata[cls_stratum[c]];
+        double s2 = stratum_s2(e, st);
+        n->estimate += stratum_ratio(st) * x[c];
+        /* Prediction error of the files themselves plus the shared ratio error. */
+        double ratio_var = 0.0;
+        if (st->n > 0 && st->sum_x > 0) {
+            double xbar = st->sum_x / st->n;
+            ratio_var = s2 / (st->n * xbar * xbar) * (1.0 - (double)st->n / stratum_size(st));
+        }
+        n->variance += m[c] * s2 + x[c] * x[c] * ratio_var;
+    }
+    for (int c = 0; c < EST_SIZE_CLASSES; c++) {
+        unsampled_x[c] = x[c];
+        unsampled_m[c] = m[c];
+        strata_of_class[c] = cls_stratum[c];
+    }
+}
+
+static void emit_estimate_dir(const DirNode *n, const char *prefix, int is_last, int depth) {
+    double half = EST_Z95 * sqrt(n->variance);
+    switch (g_opts.format) {
+        case FORMAT_JSON:
+        case FORMAT_NDJSON:
+            if (g_opts.format == FORMAT_JSON)
+                out_puts(depth ? ",{\"path\":" : "{\"path\":");
+            else
+                out_puts("{\"type\":\"estimate\",\"path\":");
+            out_json_string(node_path(n));
+            out_printf(",\"lines\":%.0f,\"ci95\":%.0f,\"sampled_files\":%ld,\"file_count\":%ld}",
+                       n->estimate, half, n->sampled_files, n->file_count);
+            if (g_opts.format == FORMAT_NDJSON)
+                out_write("\n", 1);
+            break;
+        case FORMAT_CSV:
+            out_csv_field(node_path(n));
+            out_printf(",%.0f,%.0f,%ld,%ld\n", n->estimate, half, n->sampled_files, n->file_count);
+            break;
+        default:
+            if (depth == 0)
+                out_puts(n->name);
+            else
+                out_printf("%s%s%s", prefix, is_last ? "└── " : "├── ", n->name);
+            out_printf("  ~%.0f ± %.0f lines\n", n->estimate, half);
+            break;
+    }
+    if (g_opts.max_depth >= 0 && depth >= g_opts.max_depth)
+        return;
+
+    char newPrefix[256];
+    snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix, depth == 0 ? "" : (is_last ? "    " : "│   "));
+    for (size_t i = 0; i < n->ndirs; i++)
+        emit_estimate_dir(n->dirs[i], newPrefix, i + 1 == n->ndirs, depth + 1);
+}
+
+static int run_estimate(GoFileList *g, const char *root, const struct timespec *start) {
+    Estimator est;
+    if (estimator_init(&est, g, strlen(root)) != 0) {
+        fprintf(stderr, "Memory allocation failed (estimator)\n");
+        estimator_free(&est);
+        return 1;
+    }
+    estimator_run(&est, g, start);
+    estimator_update_pooled(&est);
+
+    double total, var;
+    estimator_totals(&est, &total, &var);
+    double seconds = elapsed_seconds(start);
+
+    Report report;
+    if (report_init(&report, root, g) != 0) {
+        report_free(&report);
+        estimator_free(&est);
+        return 1;
+    }
+    for (size_t i = 0; i < g->size; i++) {
+        if (!g->data[i].excluded)
+            report_add(&report, i);
+    }
+    report_sort(report.root, g);
+    double cx[EST_SIZE_CLASSES];
+    long cm[EST_SIZE_CLASSES];
+    int cs[EST_SIZE_CLASSES];
+    estimate_dir(&est, &report, report.root, cx, cm, cs);
+    /* The root spans every stratum; use the stratified total and variance. */
+    report.root->estimate = total;
+    report.root->variance = var;
+
+    long sampled = 0;
+    size_t files = 0;
+    double sampled_bytes = 0.0, all_bytes = 0.0;
+    for (size_t i = 0; i < g->size; i++) {
+        if (g->data[i].excluded)
+            continue;
+        files++;
+        all_bytes += (double)g->data[i].bytes;
+        if (est.sampled[i] == EST_SAMPLED) {
+            sampled++;
+            sampled_bytes += (double)g->data[i].bytes;
+        }
+    }
+
+    out_init(STDOUT_FILENO);
+    double half = EST_Z95 * sqrt(var);
+    if (g_opts.format == FORMAT_TREE) {
+        out_printf("Estimated .go lines: ~%.0f ± %.0f (95%% CI, ±%.1f%%)\n",
+                   total, half, total > 0 ? 100.0 * half / total : 0.0);
+        out_printf("Sampled %ld of %zu files (%.1f MB of %.1f MB) in %zu strata, %.2f s, seed %llu\n\n",
+                   sampled, files, sampled_bytes / 1e6, all_bytes / 1e6, est.nstrata, seconds,
+                   (unsigned long long)est.seed);
+    } else if (g_opts.format == FORMAT_JSON) {
+        out_printf("{\"lines\":%.0f,\"ci95\":%.0f,\"sampled_files\":%ld,\"file_count\":%zu,"
+                   "\"sampled_bytes\":%.0f,\"bytes\":%.0f,\"strata\":%zu,\"seconds\":%.3f,\"seed\":%llu,\"dirs\":[",
+                   total, half, sampled, files, sampled_bytes, all_bytes, est.nstrata, seconds,
+                   (unsigned long long)est.seed);
+    } else if (g_opts.format == FORMAT_CSV) {
+        out_puts("path,lines,ci95,sampled_files,files\n");
+    }
+    emit_estimate_dir(report.root, "", 1, 0);
+    if (g_opts.format == FORMAT_JSON)
+        out_puts("]}\n");
+    out_close();
+
+    report_free(&report);
+    estimator_free(&est);
+    return 0;
+}
+    
+/*
+ * --history=REV_RANGE: line counts of every first-parent commit in the range,
+ * read from the object database instead of checked-out trees. `git ls-tree`
+ * lists the .go blobs of each commit and one `git cat-file --batch` process
+ * serves their contents. Counts are memoized by blob id, so a blob shared by
+ * many commits is read and lexed once; each commit is then summed per
+ * directory from the memo.
+ */
+#define HIST_BATCH 512
+#define GIT_MAX_HEX 64
+
+typedef struct {
+    pid_t pid;
+    FILE *in;
+    FILE *out;
+} GitPipe;
+
+/* Runs git -C dir args...; in is the child's stdin when want_stdin is set. */
+static int git_spawn(GitPipe *gp, const char *dir, const char *const *args, int want_stdin) {
+    memset(gp, 0, sizeof(*gp));
+    const char *argv[16];
+    int argc = 0;
+    argv[argc++] = "git";
+    argv[argc++] = "-C";
+    argv[argc++] = dir;
+    while (*args && argc < 15)
+        argv[argc++] = *args++;
+    argv[argc] = NULL;
+
+    int out_fd[2], in_fd[2] = { -1, -1 };
+    if (pipe2(out_fd, O_CLOEXEC) != 0)
+        return -1;
+    if (want_stdin && pipe2(in_fd, O_CLOEXEC) != 0) {
+        close(out_fd[0]);
+        close(out_fd[1]);
+        return -1;
+    }
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, out_fd[1], STDOUT_FILENO);
+    if (want_stdin)
+        posix_spawn_file_actions_adddup2(&fa, in_fd[0], STDIN_FILENO);
+    int err = posix_spawnp(&gp->pid, "git", &fa, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(out_fd[1]);
+    if (want_stdin)
+        close(in_fd[0]);
+    if (err != 0) {
+        close(out_fd[0]);
+        if (want_stdin)
+            close(in_fd[1]);
+        errno = err;
+        return -1;
+    }
+    gp->out = fdopen(out_fd[0], "r");
+    gp->in = want_stdin ? fdopen(in_fd[1], "w") : NULL;
+    return 0;
+}
+
+/* Closes the pipes and returns git's exit status, -1 if it did not exit. */
+static int git_wait(GitPipe *gp) {
+    if (gp->in)
+        fclose(gp->in);
+    if (gp->out)
+        fclose(gp->out);
+    gp->in = gp->out = NULL;
+    int status;
+    while (waitpid(gp->pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+typedef struct {
+    char sha[GIT_MAX_HEX + 1];
+    long time;
+} HistCommit;
+
+#define BLOB_UNKNOWN 0
+#define BLOB_QUEUED 1
+#define BLOB_COUNTED 2
+#define BLOB_SKIPPED 3
+
+/* Keyed by the leading 128 bits of the blob id. */
+typedef struct {
+    Hash128 id;
+    long lines;
+    int generated;
+    int state;
+} BlobCount;
+
+typedef struct {
+    BlobCount *slots;
+    size_t capacity;
+    size_t count;
+} BlobMemo;
+
+typedef struct {
+    char *path;
+    long *lines;
+    long *generated;
+    long *files;
+} HistDir;
+
+typedef struct {
+    HistCommit *commits;
+    size_t ncommits;
+    BlobMemo blobs;
+    PathMap dir_index;
+    HistDir *dirs;
+    size_t ndirs;
+    size_t dirs_cap;
+    long blobs_lexed;
+    long file_versions;
+} History;
+
+static int hex_nibble(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* The leading 128 bits of a hex object id; -1 if it is not one. */
+static int parse_oid(const char *hex, size_t len, Hash128 *out) {
+    if (len < 32 || len > GIT_MAX_HEX)
+        return -1;
+    uint64_t w[2] = { 0, 0 };
+    for (size_t i = 0; i < len; i++) {
+        int v = hex_nibble(hex[i]);
+        if (v < 0)
+            return -1;
+        if (i < 32)
+            w[i / 16] = (w[i / 16] << 4) | (uint64_t)v;
+    }
+    out->lo = w[0];
+    out->hi = w[1];
+    return 0;
+}
+
+static BlobCount *blob_memo_probe(BlobCount *slots, size_t capacity, Hash128 id) {
+    size_t idx = (size_t)id.lo & (capacity - 1);
+    for (;;) {
+        BlobCount *b = &slots[idx];
+        if (b->state == BLOB_UNKNOWN || (b->id.lo == id.lo && b->id.hi == id.hi))
+            return b;
+        idx = (idx + 1) & (capacity - 1);
+    }
+}
+
+/* The memo entry for id, created as BLOB_UNKNOWN when it is new. Entries move when the memo grows. */
+static BlobCount *blob_memo_get(BlobMemo *m, Hash128 id) {
+    if ((m->count + 1) * 2 > m->capacity) {
+        size_t new_cap = m->capacity ? m->capacity * 2 : 4096;
+        BlobCount *slots = (BlobCount*)calloc(new_cap, sizeof(BlobCount));
+        if (!slots) {
+            fprintf(stderr, "Memory allocation failed (blob memo)\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < m->capacity; i++) {
+            if (m->slots[i].state != BLOB_UNKNOWN)
+                *blob_memo_probe(slots, new_cap, m->slots[i].id) = m->slots[i];
+        }
+        free(m->slots);
+        m->slots = slots;
+        m->capacity = new_cap;
+    }
+    BlobCount *b = blob_memo_probe(m->slots, m->capacity, id);
+    if (b->state == BLOB_UNKNOWN) {
+        b->id = id;
+        m->count++;
+    }
+    return b;
+}
+
+static void history_free(History *h) {
+    for (size_t i = 0; i < h->ndirs; i++) {
+        free(h->dirs[i].path);
+        free(h->dirs[i].lines);
+    }
+    free(h->dirs);
+    free(h->commits);
+    free(h->blobs.slots);
+    path_map_free(&h->dir_index);
+    memset(h, 0, sizeof(*h));
+}
+
+static HistDir *history_dir(History *h, const char *path, size_t len) {
+    long idx = path_map_get(&h->dir_index, path, len);
+    if (idx > 0)
+        return &h->dirs[idx - 1];
+    if (h->ndirs == h->dirs_cap) {
+        size_t new_cap = h->dirs_cap ? h->dirs_cap * 2 : 64;
+        HistDir *dirs = (HistDir*)realloc(h->dirs, new_cap * sizeof(HistDir));
+        if (!dirs) {
+            fprintf(stderr, "Memory allocation failed (history)\n");
+            exit(1);
+        }
+        h->dirs = dirs;
+        h->dirs_cap = new_cap;
+    }
+    HistDir *d = &h->dirs[h->ndirs];
+    d->path = strndup(path, len);
+    d->lines = (long*)calloc(3 * h->ncommits, sizeof(long));
+    if (!d->path || !d->lines || path_map_add(&h->dir_index, path, len, (long)h->ndirs + 1) != 0) {
+        fprintf(stderr, "Memory allocation failed (history)\n");
+        exit(1);
+    }
+    d->generated = d->lines + h->ncommits;
+    d->files = d->generated + h->ncommits;
+    h->ndirs++;
+    return d;
+}
+
+static void history_add(History *h, size_t commit, const char *rel, const BlobCount *b) {
+    const char *slash = rel;
+    size_t len = 1;
+    const char *dir = ".";
+    for (;;) {
+        HistDir *d = history_dir(h, dir, len);
+        d->lines[commit] += b->lines;
+        d->files[commit]++;
+        if (b->generated)
+            d->generated[commit] += b->lines;
+        slash = strchr(slash, '/');
+        if (!slash)
+            break;
+        dir = rel;
+        len = (size_t)(slash - rel);
+        slash++;
+    }
+}
+
+static int history_commits(History *h, const char *root, const char *range) {
+    const char *args[] = { "rev-list", "--first-parent", "--reverse", "--timestamp", range, "--", NULL };
+    GitPipe gp;
+    if (git_spawn(&gp, root, args, 0) != 0) {
+        fprintf(stderr, "Failed to run git: %s\n", strerror(errno));
+        return -1;
+    }
+    size_t cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, gp.out)) > 0) {
+        char *end;
+        long t = strtol(line, &end, 10);
+        if (*end != ' ')
+            continue;
+        char *sha = end + 1;
+        size_t n = strcspn(sha, "\n");
+        if (n == 0 || n > GIT_MAX_HEX)
+            continue;
+        if (h->ncommits == cap) {
+            cap = cap ? cap * 2 : 64;
+            HistCommit *c = (HistCommit*)realloc(h->commits, cap * sizeof(HistCommit));
+            if (!c) {
+                fprintf(stderr, "Memory allocation failed (history)\n");
+                exit(1);
+            }
+            h->commits = c;
+        }
+        memcpy(h->commits[h->ncommits].sha, sha, n);
+        h->commits[h->ncommits].sha[n] = '\0';
+        h->commits[h->ncommits].time = t;
+        h->ncommits++;
+    }
+    free(line);
+    if (git_wait(&gp) != 0) {
+        fprintf(stderr, "git rev-list failed for '%s'\n", range);
+        return -1;
+    }
+    if (h->ncommits == 0) {
+        fprintf(stderr, "No commits in '%s'\n", range);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads one `git cat-file --batch` reply and counts it into b. */
+static int history_read_blob(History *h, FILE *in, BlobCount *b) {
+    char header[GIT_MAX_HEX + 64];
+    if (!fgets(header, sizeof(header), in)) {
+        fprintf(stderr, "git cat-file ended early\n");
+        return -1;
+    }
+    char *type = strchr(header, ' ');
+    if (!type || strncmp(type + 1, "blob ", 5) != 0) {
+        fprintf(stderr, "git cat-file: unexpected reply: %s", header);
+        return -1;
+    }
+    long sz = strtol(type + 6, NULL, 10);
+    char *input = (char*)malloc((size_t)sz + 1);
+    if (!input) {
+        fprintf(stderr, "Memory allocation failed (input buffer)\n");
+        return -1;
+    }
+    uint64_t t0 = trace_begin();
+    if (fread(input, 1, (size_t)sz, in) != (size_t)sz || fgetc(in) != '\n') {
+        free(input);
+        fprintf(stderr, "git cat-file ended early\n");
+        return -1;
+    }
+    trace_end("cat-file", t0, NULL);
+    goline_result res;
+    uint64_t t_lex = trace_begin();
+    int rc = goline_count_buffer(g_goline, input, (size_t)sz, &res);
+    trace_end("lex", t_lex, header);
+    free(input);
+    if (rc != GOLINE_OK) {
+        fprintf(stderr, "Memory allocation failed (lexer)\n");
+        return -1;
+    }
+    b->lines = res.lines;
+    b->generated = res.generated;
+    b->state = res.status == GOLINE_COUNTED ? BLOB_COUNTED : BLOB_SKIPPED;
+    h->blobs_lexed++;
+    return 0;
+}
+
+/*
+ * Lists the .go blobs of one commit, fetches and counts the ones not seen yet
+ * (HIST_BATCH requests at a time, which fit in the pipe buffer, so writing
+ * never waits for replies), then sums the commit per directory.
+ */
+static int history_commit(History *h, size_t ci, const char *root, GitPipe *cat) {
+    const char *args[] = { "ls-tree", "-r", "-z", h->commits[ci].sha, NULL };
+    GitPipe gp;
+    if (git_spawn(&gp, root, args, 0) != 0) {
+        fprintf(stderr, "Failed to run git: %s\n", strerror(errno));
+        return -1;
+    }
+    uint64_t t0 = trace_begin();
+    char *entry = NULL;
+    size_t entry_cap = 0;
+    char **paths = NULL;
+    Hash128 *ids = NULL;
+    size_t n = 0, cap = 0;
+    size_t *queue = NULL;
+    size_t nqueue = 0;
+    char (*oids)[GIT_MAX_HEX + 1] = NULL;
+    int rc = 0;
+    while (getdelim(&entry, &entry_cap, '\0', gp.out) > 0) {
+        /* <mode> SP blob SP <oid> TAB <path> */
+        char *tab = strchr(entry, '\t');
+        if (!tab || strncmp(entry, "100", 3) != 0 || !goline_is_go_file(tab + 1) || skip_by_build_name(tab + 1))
+            continue;
+        char *oid = strchr(entry, ' ');
+        if (!oid || strncmp(oid + 1, "blob ", 5) != 0)
+            continue;
+        oid += 6;
+        size_t oid_len = (size_t)(tab - oid);
+        Hash128 id;
+        if (parse_oid(oid, oid_len, &id) != 0)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            paths = (char**)realloc(paths, cap * sizeof(char*));
+            ids = (Hash128*)realloc(ids, cap * sizeof(Hash128));
+            queue = (size_t*)realloc(queue, cap * sizeof(size_t));
+            oids = (char (*)[GIT_MAX_HEX + 1])realloc(oids, cap * sizeof(*oids));
+            if (!paths || !ids || !queue || !oids) {
+                fprintf(stderr, "Memory allocation failed (history)\n");
+                exit(1);
+            }
+        }
+        paths[n] = strdup(tab + 1);
+        if (!paths[n]) {
+            fprintf(stderr, "Memory allocation failed (history)\n");
+            exit(1);
         }
+        BlobCount *b = blob_memo_get(&h->blobs, id);
+        if (b->state == BLOB_UNKNOWN) {
+            b->state = BLOB_QUEUED;
+            memcpy(oids[n], oid, oid_len);
+            oids[n][oid_len] = '\0';
+            queue[nqueue++] = n;
+        }
+        ids[n++] = id;
+    }
+    free(entry);
+    if (git_wait(&gp) != 0) {
+        fprintf(stderr, "git ls-tree failed for %s\n", h->commits[ci].sha);
+        rc = -1;
+    }
+    trace_end("ls-tree", t0, h->commits[ci].sha);
+
+    /* Nothing is added to the memo from here on, so entries stay put. */
+    for (size_t i = 0; i < nqueue && rc == 0; i += HIST_BATCH) {
+        size_t end = nqueue - i < HIST_BATCH ? nqueue : i + HIST_BATCH;
+        for (size_t k = i; k < end; k++)
+            fprintf(cat->in, "%s\n", oids[queue[k]]);
+        if (fflush(cat->in) != 0) {
+            fprintf(stderr, "Failed to write to git cat-file: %s\n", strerror(errno));
+            rc = -1;
+            break;
+        }
+        for (size_t k = i; k < end && rc == 0; k++) {
+            BlobCount *b = blob_memo_probe(h->blobs.slots, h->blobs.capacity, ids[queue[k]]);
+            rc = history_read_blob(h, cat->out, b);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        const BlobCount *b = blob_memo_probe(h->blobs.slots, h->blobs.capacity, ids[i]);
+        if (rc == 0 && b->state == BLOB_COUNTED) {
+            history_add(h, ci, paths[i], b);
+            h->file_versions++;
+        }
+        free(paths[i]);
     }
+    free(paths);
+    free(ids);
+    free(queue);
+    free(oids);
+    return rc;
 }
-    
+
+static int compare_hist_dirs(const void *a, const void *b) {
+    return strcmp(((const HistDir*)a)->path, ((const HistDir*)b)->path);
+}
+
+static int hist_dir_depth(const HistDir *d) {
+    if (strcmp(d->path, ".") == 0)
+        return 0;
+    int depth = 1;
+    for (const char *p = d->path; *p; p++)
+        depth += (*p == '/');
+    return depth;
+}
+
+static void emit_history(History *h, const char *range, double seconds) {
+    qsort(h->dirs, h->ndirs, sizeof(HistDir), compare_hist_dirs);
+    size_t width = 1;
+    for (size_t i = 0; i < h->ndirs; i++) {
+        size_t len = strlen(h->dirs[i].path);
+        if (len > width && len <= 48 && (g_opts.max_depth < 0 || hist_dir_depth(&h->dirs[i]) <= g_opts.max_depth))
+            width = len;
+    }
+
+    if (g_opts.format == FORMAT_TREE) {
+        out_printf("History of %s: %zu commits, %ld blobs lexed for %ld file versions, %.2f s\n\n",
+                   range, h->ncommits, h->blobs_lexed, h->file_versions, seconds);
+        out_puts("  commit        date            lines     files\n");
+        const HistDir *root = NULL;
+        for (size_t i = 0; i < h->ndirs && !root; i++) {
+            if (strcmp(h->dirs[i].path, ".") == 0)
+                root = &h->dirs[i];
+        }
+        for (size_t c = 0; c < h->ncommits; c++) {
+            char date[16];
+            time_t t = (time_t)h->commits[c].time;
+            struct tm tm;
+            strftime(date, sizeof(date), "%Y-%m-%d", gmtime_r(&t, &tm));
+            out_printf("  %.12s  %s  %9ld  %8ld\n", h->commits[c].sha, date,
+                       root ? root->lines[c] : 0L, root ? root->files[c] : 0L);
+        }
+        out_puts("\nLines per directory, oldest to newest:\n");
+    } else if (g_opts.format == FORMAT_JSON) {
+        out_puts("{\"range\":");
+        out_json_string(range);
+        out_printf(",\"blobs_lexed\":%ld,\"file_versions\":%ld,\"commits\":[", h->blobs_lexed, h->file_versions);
+        for (size_t c = 0; c < h->ncommits; c++)
+            out_printf("%s{\"commit\":\"%s\",\"time\":%ld}", c ? "," : "", h->commits[c].sha, h->commits[c].time);
+        out_puts("],\"dirs\":[");
+    } else if (g_opts.format == FORMAT_NDJSON) {
+        for (size_t c = 0; c < h->ncommits; c++)
+            out_printf("{\"type\":\"commit\",\"commit\":\"%s\",\"time\":%ld}\n", h->commits[c].sha, h->commits[c].time);
+    } else {
+        out_puts("commit,time,path,lines,generated_lines,files\n");
+    }
+
+    size_t shown = 0;
+    for (size_t i = 0; i < h->ndirs; i++) {
+        const HistDir *d = &h->dirs[i];
+        if (g_opts.max_depth >= 0 && hist_dir_depth(d) > g_opts.max_depth)
+            continue;
+        if (g_opts.format == FORMAT_TREE) {
+            out_printf("  %-*s", (int)width, d->path);
+            for (size_t c = 0; c < h->ncommits; c++)
+                out_printf(" %9ld", d->lines[c]);
+            out_puts("\n");
+        } else if (g_opts.format == FORMAT_CSV) {
+            for (size_t c = 0; c < h->ncommits; c++) {
+                out_printf("%s,%ld,", h->commits[c].sha, h->commits[c].time);
+                out_csv_field(d->path);
+                out_printf(",%ld,%ld,%ld\n", d->lines[c], d->generated[c], d->files[c]);
+            }
+        } else {
+            static const char *names[] = { "lines", "generated_lines", "file_count" };
+            const long *series[] = { d->lines, d->generated, d->files };
+            if (g_opts.format == FORMAT_JSON)
+                out_puts(shown ? ",{\"path\":" : "{\"path\":");
+            else
+                out_puts("{\"type\":\"dir\",\"path\":");
+            out_json_string(d->path);
+            for (int k = 0; k < 3; k++) {
+                out_printf(",\"%s\":[", names[k]);
+                for (size_t c = 0; c < h->ncommits; c++)
+                    out_printf(c ? ",%ld" : "%ld", series[k][c]);
+                out_write("]", 1);
+            }
+            out_puts(g_opts.format == FORMAT_JSON ? "}" : "}\n");
+        }
+        shown++;
+    }
+    if (g_opts.format == FORMAT_JSON)
+        out_puts("]}\n");
+}
+
+static int run_history(const char *root, const char *range, const struct timespec *start) {
+    History h;
+    memset(&h, 0, sizeof(h));
+    path_map_init(&h.dir_index);
+    if (history_commits(&h, root, range) != 0) {
+        history_free(&h);
+        return 1;
+    }
+    const char *args[] = { "cat-file", "--batch", NULL };
+    GitPipe cat;
+    if (git_spawn(&cat, root, args, 1) != 0) {
+        fprintf(stderr, "Failed to run git: %s\n", strerror(errno));
+        history_free(&h);
+        return 1;
+    }
+    int rc = 0;
+    for (size_t c = 0; c < h.ncommits && rc == 0; c++)
+        rc = history_commit(&h, c, root, &cat);
+    if (git_wait(&cat) != 0 && rc == 0) {
+        fprintf(stderr, "git cat-file failed\n");
+        rc = -1;
+    }
+    if (rc == 0) {
+        out_init(STDOUT_FILENO);
+        emit_history(&h, range, elapsed_seconds(start));
+        out_close();
+    }
+    history_free(&h);
+    return rc == 0 ? 0 : 1;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [root_dir]\n"
+            "       %s diff [--format=FMT] OLD_SNAPSHOT NEW_SNAPSHOT\n"
+            "\n"
+            "Options:\n"
+            "  --dedup            Lex byte-identical files only once and reuse the count\n"
+            "  --skip-generated   Exclude files marked '// Code generated ... DO NOT EDIT.'\n"
+            "  --generated-only   Count only generated files\n"
+            "  --top=K            Report the K largest directories and files instead of the tree\n"
+            "  --top-by=MODE      Rank --top by 'lines' (default), 'bytes' or 'growth'\n"
+            "  --baseline=FILE    Previous --save-counts output used by --top-by=growth\n"
+            "  --save-counts=FILE Write per-file 'lines<TAB>bytes<TAB>path' records to FILE\n"
+            "  --save-snapshot=FILE\n"
+            "                     Write the aggregated tree as a binary snapshot for 'diff'\n"
+            "  --files-from=FILE  Count the files listed in FILE ('-' for stdin), one per line,\n"
+            "                     instead of walking root_dir; relative paths are under root_dir\n"
+            "  -0, --null         File list entries are NUL-terminated (git ls-files -z)\n"
+            "  --follow-symlinks=MODE\n"
+            "                     'never', 'once' (not inside a linked tree) or 'always' (default)\n"
+            "  --one-file-system  Do not descend into directories on other file systems\n"
+            "  --estimate[=BUDGET]\n"
+            "                     Extrapolate line counts from a stratified sample. BUDGET is\n"
+            "                     a relative error ('2%%', default), a time ('10s', '500ms')\n"
+            "                     or both ('1%%,30s'); sampling stops when either is met\n"
+            "  --seed=N           Seed the --estimate sampler (default: from the clock; the\n"
+            "                     seed used is printed)\n"
+            "  --depth=N          Limit the directory depth of --estimate, --history and\n"
+            "                     --metrics-file output\n"
+            "  --max-func-lines=N List functions longer than N code lines (exit status 2 if any)\n"
+            "  --top-funcs=N      Report the N longest functions\n"
+            "  --complexity       Report cyclomatic complexity per function, file and directory\n"
+            "  --max-complexity=N List functions with complexity over N (exit status 2 if any)\n"
+            "  --duplicates[=W]   Find code duplicated across files in windows of W code lines\n"
+            "                     (default 6) and report duplicated lines per directory\n"
+            "  --dup-memory=SIZE  Memory for --duplicates (fingerprints, line hashes and the\n"
+            "                     final merge) before sampling the hash space (K/M/G\n"
+            "                     suffixes allowed, default 128M)\n"
+            "  --dup-blocks=N     Number of duplicated blocks to list (default 20)\n"
+            "  --module-report    Attribute counts to the Go modules (go.mod files) of the tree\n"
+            "  --no-nested-modules\n"
+            "                     Skip directories that hold their own go.mod\n"
+            "  --no-vendor        Skip vendor directories at module roots\n"
+            "  --goos=OS, --goarch=ARCH, --tags=LIST\n"
+            "                     Count only files that build for the target, by file name\n"
+            "                     suffix and //go:build line (defaults: linux, host arch)\n"
+            "  --no-tests         Skip _test.go files\n"
+            "  --invalid-files=MODE\n"
+            "                     Binary or non-UTF-8 files: 'skip' (default), 'report' (skip\n"
+            "                     and name them on stderr) or 'count' (lex them anyway)\n"
+            "  --format=FMT       Output 'tree' (default), 'json', 'ndjson' or 'csv'\n"
+            "  --history=REV_RANGE\n"
+            "                     Lines per directory for each first-parent commit in\n"
+            "                     REV_RANGE (e.g. HEAD~20..HEAD), read from the git object\n"
+            "                     database; each distinct blob is lexed once\n"
+            "  --tui              Browse the tree in the terminal while it is being counted;\n"
+            "                     expanded and selected directories are counted first\n"
+            "  --stream           Write each file and finished directory as soon as it is\n"
+            "                     counted, in sorted order, directories after their contents\n"
+            "                     (tree, ndjson and csv)\n"
+            "  -j, --jobs=N       Worker threads (default: number of online CPUs)\n"
+            "  --split-threshold=SIZE\n"
+            "                     Lex files of at least SIZE bytes in parallel chunks\n"
+            "                     (K/M/G suffixes allowed, default 32M)\n"
+            "  --background       Idle I/O priority, nice 19, one worker unless -j is given,\n"
+            "                     reads capped at 32M/s and read files dropped from the page cache\n"
+            "  --io-rate=SIZE     Cap file reads at SIZE bytes per second (K/M/G suffixes allowed)\n"
+            "  --batch-bytes=SIZE Batch files smaller than SIZE into work units of about\n"
+            "                     SIZE bytes (K/M/G suffixes allowed, default 256K)\n"
+            "  --worker-stats     Print per-worker busy and idle time to stderr\n"
+            "  --trace=FILE       Write per-thread spans (readdir, open+read, lex, aggregation)\n"
+            "                     as Chrome trace-event JSON for Perfetto or chrome://tracing\n"
+            "  --metrics-file=FILE\n"
+            "                     Atomically write Prometheus text-format metrics to FILE:\n"
+            "                     lines per directory to --depth (default 2), files, bytes,\n"
+            "                     phase durations, throughput and read errors\n"
+            "  -h, --help         Show this help and exit\n",
+            prog, prog);
+}
+
+static int parse_size(const char *str, long *pValue) {
+    char *end;
+    long v = strtol(str, &end, 10);
+    if (end == str || v < 0)
+        return -1;
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0')
+        return -1;
+    *pValue = v;
+    return 0;
+}
+
+/* Parses "2%", "10s", "500ms" or a comma-separated combination. */
+static int parse_estimate_budget(const char *str, Options *opts) {
+    while (*str) {
+        char *end;
+        double v = strtod(str, &end);
+        if (end == str || v <= 0)
+            return -1;
+        if (*end == '%') {
+            opts->estimate_error = v / 100.0;
+            end++;
+        } else if (strncmp(end, "ms", 2) == 0) {
+            opts->estimate_seconds = v / 1000.0;
+            end += 2;
+        } else if (*end == 's') {
+            opts->estimate_seconds = v;
+            end++;
+        } else {
+            return -1;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        str = end;
+    }
+    return 0;
+}
+
+static int parse_args(int argc, char **argv, Options *opts) {
+    memset(opts, 0, sizeof(*opts));
+    /* The walking and splitting defaults are the library's. */
+    goline_options lib;
+    goline_options_init(&lib);
+    opts->root_dir = ".";
+    opts->split_threshold = (long)lib.split_threshold;
+    opts->batch_bytes = DEFAULT_BATCH_BYTES;
+    opts->follow_symlinks = lib.follow_symlinks;
+    opts->estimate_error = 0.02;
+    opts->max_depth = -1;
+    opts->dup_memory = DUP_DEFAULT_MEMORY;
+    opts->dup_blocks = DUP_DEFAULT_BLOCKS;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->jobs = (ncpu > 0) ? (int)ncpu : 1;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *jobs_arg = NULL;
+        if (strcmp(arg, "-j") == 0 && i + 1 < argc)
+            jobs_arg = argv[++i];
+        else if (strncmp(arg, "-j", 2) == 0 && arg[2] != '\0')
+            jobs_arg = arg + 2;
+        else if (strncmp(arg, "--jobs=", 7) == 0)
+            jobs_arg = arg + 7;
+        if (jobs_arg) {
+            char *end;
+            long n = strtol(jobs_arg, &end, 10);
+            if (*end != '\0' || n <= 0 || n > 1024) {
+                fprintf(stderr, "Invalid value for --jobs: '%s'\n", jobs_arg);
+                return -1;
+            }
+            opts->jobs = (int)n;
+            opts->jobs_set = 1;
+            continue;
+        }
+        if (strcmp(arg, "--dedup") == 0) {
+            opts->dedup = 1;
+        } else if (strcmp(arg, "--skip-generated") == 0) {
+            opts->generated_mode = GEN_SKIP;
+        } else if (strcmp(arg, "--generated-only") == 0) {
+            opts->generated_mode = GEN_ONLY;
+        } else if (strncmp(arg, "--top=", 6) == 0) {
+            char *end;
+            long k = strtol(arg + 6, &end, 10);
+            if (*end != '\0' || k <= 0) {
+                fprintf(stderr, "Invalid value for --top: '%s'\n", arg + 6);
+                return -1;
+            }
+            opts->top_k = (size_t)k;
+        } else if (strncmp(arg, "--top-by=", 9) == 0) {
+            const char *mode = arg + 9;
+            if (strcmp(mode, "lines") == 0) {
+                opts->top_by = TOP_BY_LINES;
+            } else if (strcmp(mode, "bytes") == 0) {
+                opts->top_by = TOP_BY_BYTES;
+            } else if (strcmp(mode, "growth") == 0) {
+                opts->top_by = TOP_BY_GROWTH;
+            } else {
+                fprintf(stderr, "Invalid value for --top-by: '%s'\n", mode);
+                return -1;
+            }
+        } else if (strncmp(arg, "--baseline=", 11) == 0) {
+            opts->baseline_path = arg + 11;
+        } else if (strncmp(arg, "--save-counts=", 14) == 0) {
+            opts->save_counts_path = arg + 14;
+        } else if (strncmp(arg, "--save-snapshot=", 16) == 0) {
+            opts->save_snapshot_path = arg + 16;
+        } else if (strncmp(arg, "--follow-symlinks=", 18) == 0) {
+            const char *mode = arg + 18;
+            if (strcmp(mode, "never") == 0) {
+                opts->follow_symlinks = GOLINE_FOLLOW_NEVER;
+            } else if (strcmp(mode, "once") == 0) {
+                opts->follow_symlinks = GOLINE_FOLLOW_ONCE;
+            } else if (strcmp(mode, "always") == 0) {
+                opts->follow_symlinks = GOLINE_FOLLOW_ALWAYS;
+            } else {
+                fprintf(stderr, "Invalid value for --follow-symlinks: '%s'\n", mode);
+                return -1;
+            }
+        } else if (strcmp(arg, "--one-file-system") == 0) {
+            opts->one_file_system = 1;
+        } else if (strcmp(arg, "--estimate") == 0) {
+            opts->estimate = 1;
+        } else if (strncmp(arg, "--estimate=", 11) == 0) {
+            opts->estimate = 1;
+            if (parse_estimate_budget(arg + 11, opts) != 0) {
+                fprintf(stderr, "Invalid value for --estimate: '%s'\n", arg + 11);
+                return -1;
+            }
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            char *end;
+            errno = 0;
+            unsigned long long seed = strtoull(arg + 7, &end, 10);
+            if (arg[7] == '\0' || arg[7] == '-' || *end != '\0' || errno) {
+                fprintf(stderr, "Invalid value for --seed: '%s'\n", arg + 7);
+                return -1;
+            }
+            opts->estimate_seed = (uint64_t)seed;
+            opts->has_seed = 1;
+        } else if (strncmp(arg, "--depth=", 8) == 0) {
+            char *end;
+            long d = strtol(arg + 8, &end, 10);
+            if (*end != '\0' || d < 0) {
+                fprintf(stderr, "Invalid value for --depth: '%s'\n", arg + 8);
+                return -1;
+            }
+            opts->max_depth = (int)d;
+        } else if (strncmp(arg, "--max-func-lines=", 17) == 0) {
+            char *end;
+            long n = strtol(arg + 17, &end, 10);
+            if (*end != '\0' || n <= 0) {
+                fprintf(stderr, "Invalid value for --max-func-lines: '%s'\n", arg + 17);
+                return -1;
+            }
+            opts->max_func_lines = n;
+        } else if (strncmp(arg, "--top-funcs=", 12) == 0) {
+            char *end;
+            long n = strtol(arg + 12, &end, 10);
+            if (*end != '\0' || n <= 0) {
+                fprintf(stderr, "Invalid value for --top-funcs: '%s'\n", arg + 12);
+                return -1;
+            }
+            opts->top_funcs = (size_t)n;
+        } else if (strcmp(arg, "--complexity") == 0) {
+            opts->complexity = 1;
+        } else if (strncmp(arg, "--max-complexity=", 17) == 0) {
+            char *end;
+            long n = strtol(arg + 17, &end, 10);
+            if (*end != '\0' || n <= 0) {
+                fprintf(stderr, "Invalid value for --max-complexity: '%s'\n", arg + 17);
+                return -1;
+            }
+            opts->max_complexity = n;
+            opts->complexity = 1;
+        } else if (strncmp(arg, "--history=", 10) == 0) {
+            if (arg[10] == '\0' || arg[10] == '-') {
+                fprintf(stderr, "Invalid value for --history: '%s'\n", arg + 10);
+                return -1;
+            }
+            opts->history_range = arg + 10;
+        } else if (strcmp(arg, "--tui") == 0) {
+            opts->tui = 1;
+        } else if (strcmp(arg, "--stream") == 0) {
+            opts->stream = 1;
+        } else if (strcmp(arg, "--module-report") == 0) {
+            opts->module_report = 1;
+        } else if (strcmp(arg, "--no-nested-modules") == 0) {
+            opts->no_nested_modules = 1;
+        } else if (strcmp(arg, "--no-vendor") == 0) {
+            opts->no_vendor = 1;
+        } else if (strncmp(arg, "--goos=", 7) == 0) {
+            if (!goline_known_os(arg + 7)) {
+                fprintf(stderr, "Unknown GOOS for --goos: '%s'\n", arg + 7);
+                return -1;
+            }
+            opts->goos = arg + 7;
+        } else if (strncmp(arg, "--goarch=", 9) == 0) {
+            if (!goline_known_arch(arg + 9)) {
+                fprintf(stderr, "Unknown GOARCH for --goarch: '%s'\n", arg + 9);
+                return -1;
+            }
+            opts->goarch = arg + 9;
+        } else if (strncmp(arg, "--tags=", 7) == 0) {
+            opts->build_tags = arg + 7;
+        } else if (strcmp(arg, "--no-tests") == 0) {
+            opts->no_tests = 1;
+        } else if (strcmp(arg, "--duplicates") == 0) {
+            opts->duplicates = DUP_DEFAULT_WINDOW;
+        } else if (strncmp(arg, "--duplicates=", 13) == 0) {
+            char *end;
+            long n = strtol(arg + 13, &end, 10);
+            if (*end != '\0' || n < 2 || n > DUP_MAX_WINDOW) {
+                fprintf(stderr, "Invalid value for --duplicates: '%s' (2-%d lines)\n", arg + 13, DUP_MAX_WINDOW);
+                return -1;
+            }
+            opts->duplicates = (int)n;
+        } else if (strncmp(arg, "--dup-memory=", 13) == 0) {
+            if (parse_size(arg + 13, &opts->dup_memory) != 0 || opts->dup_memory == 0) {
+                fprintf(stderr, "Invalid value for --dup-memory: '%s'\n", arg + 13);
+                return -1;
+            }
+        } else if (strncmp(arg, "--dup-blocks=", 13) == 0) {
+            char *end;
+            long n = strtol(arg + 13, &end, 10);
+            if (*end != '\0' || n < 0) {
+                fprintf(stderr, "Invalid value for --dup-blocks: '%s'\n", arg + 13);
+                return -1;
+            }
+            opts->dup_blocks = (size_t)n;
+        } else if (strncmp(arg, "--invalid-files=", 16) == 0) {
+            const char *mode = arg + 16;
+            if (strcmp(mode, "skip") == 0) {
+                opts->invalid_files = INVALID_SKIP;
+            } else if (strcmp(mode, "report") == 0) {
+                opts->invalid_files = INVALID_REPORT;
+            } else if (strcmp(mode, "count") == 0) {
+                opts->invalid_files = INVALID_COUNT;
+            } else {
+                fprintf(stderr, "Invalid value for --invalid-files: '%s'\n", mode);
+                return -1;
+            }
+        } else if (strncmp(arg, "--format=", 9) == 0) {
+            const char *fmt = arg + 9;
+            if (strcmp(fmt, "tree") == 0) {
+                opts->format = FORMAT_TREE;
+            } else if (strcmp(fmt, "json") == 0) {
+                opts->format = FORMAT_JSON;
+            } else if (strcmp(fmt, "ndjson") == 0) {
+                opts->format = FORMAT_NDJSON;
+            } else if (strcmp(fmt, "csv") == 0) {
+                opts->format = FORMAT_CSV;
+            } else {
+                fprintf(stderr, "Invalid value for --format: '%s'\n", fmt);
+                return -1;
+            }
+        } else if (strncmp(arg, "--split-threshold=", 18) == 0) {
+            if (parse_size(arg + 18, &opts->split_threshold) != 0) {
+                fprintf(stderr, "Invalid value for --split-threshold: '%s'\n", arg + 18);
+                return -1;
+            }
+        } else if (strncmp(arg, "--batch-bytes=", 14) == 0) {
+            if (parse_size(arg + 14, &opts->batch_bytes) != 0) {
+                fprintf(stderr, "Invalid value for --batch-bytes: '%s'\n", arg + 14);
+                return -1;
+            }
+        } else if (strncmp(arg, "--files-from=", 13) == 0) {
+            opts->files_from = arg + 13;
+        } else if (strcmp(arg, "-0") == 0 || strcmp(arg, "--null") == 0) {
+            opts->null_delim = 1;
+        } else if (strcmp(arg, "--background") == 0) {
+            opts->background = 1;
+        } else if (strncmp(arg, "--io-rate=", 10) == 0) {
+            if (parse_size(arg + 10, &opts->io_rate) != 0 || opts->io_rate == 0) {
+                fprintf(stderr, "Invalid value for --io-rate: '%s'\n", arg + 10);
+                return -1;
+            }
+        } else if (strncmp(arg, "--trace=", 8) == 0) {
+            opts->trace_path = arg + 8;
+        } else if (strncmp(arg, "--metrics-file=", 15) == 0) {
+            opts->metrics_path = arg + 15;
+        } else if (strcmp(arg, "--worker-stats") == 0) {
+            opts->worker_stats = 1;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            exit(0);
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "Unknown option: '%s'\n", arg);
+            print_usage(argv[0]);
+            return -1;
+        } else {
+            opts->root_dir = arg;
+        }
+    }
+    if (opts->goos || opts->goarch || opts->build_tags) {
+        if (!opts->goos)
+            opts->goos = "linux";
+        if (!opts->goarch)
+            opts->goarch = goline_host_arch();
+    }
+    if (opts->top_by == TOP_BY_GROWTH && !opts->baseline_path) {
+        fprintf(stderr, "--top-by=growth requires --baseline=FILE\n");
+        return -1;
+    }
+    if (opts->background) {
+        if (!opts->jobs_set)
+            opts->jobs = 1;
+        if (opts->io_rate == 0)
+            opts->io_rate = BACKGROUND_IO_RATE;
+    }
+    if (opts->files_from && opts->estimate) {
+        fprintf(stderr, "--estimate cannot be combined with --files-from\n");
+        return -1;
+    }
+    if (opts->format == FORMAT_CSV && (opts->max_func_lines || opts->top_funcs || opts->complexity)) {
+        fprintf(stderr, "--max-func-lines, --top-funcs and --complexity are not available with --format=csv\n");
+        return -1;
+    }
+    if ((opts->module_report || opts->no_nested_modules || opts->no_vendor) && opts->files_from) {
+        fprintf(stderr, "--module-report, --no-nested-modules and --no-vendor need a directory walk, not --files-from\n");
+        return -1;
+    }
+    if (opts->has_seed && !opts->estimate) {
+        fprintf(stderr, "--seed needs --estimate\n");
+        return -1;
+    }
+    if (opts->module_report && opts->estimate) {
+        fprintf(stderr, "--module-report cannot be combined with --estimate\n");
+        return -1;
+    }
+    if (opts->history_range && (opts->files_from || opts->estimate || opts->stream || opts->top_k || opts->dedup ||
+                                opts->jobs_set ||
+                                opts->duplicates || opts->module_report || opts->no_nested_modules ||
+                                opts->no_vendor || opts->max_func_lines || opts->top_funcs || opts->complexity ||
+                                opts->save_counts_path || opts->save_snapshot_path || opts->metrics_path)) {
+        fprintf(stderr, "--history only combines with --format, --depth, --skip-generated, --generated-only,\n"
+                        "--goos, --goarch, --tags, --no-tests, --invalid-files and --trace\n");
+        return -1;
+    }
+    if (opts->tui && (opts->format != FORMAT_TREE || opts->files_from || opts->estimate || opts->stream ||
+                      opts->history_range || opts->top_k || opts->duplicates || opts->module_report ||
+                      opts->max_func_lines || opts->top_funcs || opts->max_complexity ||
+                      opts->save_counts_path || opts->save_snapshot_path || opts->metrics_path)) {
+        fprintf(stderr, "--tui only combines with options that select or count files\n");
+        return -1;
+    }
+    if (opts->tui && (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))) {
+        fprintf(stderr, "--tui needs a terminal on stdin and stdout\n");
+        return -1;
+    }
+    if (opts->stream && (opts->format == FORMAT_JSON || opts->files_from || opts->estimate || opts->top_k ||
+                         opts->duplicates || opts->module_report)) {
+        fprintf(stderr, "--stream cannot be combined with --format=json, --files-from, --estimate, --top, "
+                        "--duplicates or --module-report\n");
+        return -1;
+    }
+    if (opts->metrics_path && opts->estimate) {
+        fprintf(stderr, "--metrics-file cannot be combined with --estimate\n");
+        return -1;
+    }
+    if (opts->duplicates && (opts->format == FORMAT_CSV || opts->estimate || opts->dedup)) {
+        fprintf(stderr, "--duplicates cannot be combined with --format=csv, --estimate or --dedup\n");
+        return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
     setlocale(LC_ALL, "");
 
-    const char *root_dir = (argc > 1) ? argv[1] : ".";
+    if (argc >= 2 && strcmp(argv[1], "diff") == 0)
+        return run_diff(argc - 2, argv + 2);
+
+    if (parse_args(argc, argv, &g_opts) != 0 || open_goline() != GOLINE_OK)
+        return 1;
+    /* Before any work, so the walk and every thread and git process started later inherit it. */
+    if (g_opts.background)
+        enter_background_mode();
+    if (g_opts.io_rate > 0)
+        rate_limit_init(g_opts.io_rate);
+    if (g_opts.trace_path) {
+        trace_init();
+        trace_thread_name("main");
+    }
+
+    const char *root_dir = g_opts.root_dir;
     char fullRoot[PATH_MAX];
-    if (realpath(root_dir, fullRoot) == NULL) {
+    int streaming = (g_opts.files_from != NULL);
+    FILE *feed_fp = NULL;
+    if (streaming) {
+        /* The tree comes from the supplied paths alone: no realpath, stat or readdir. */
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == NULL || lexical_path(cwd, root_dir, fullRoot, sizeof(fullRoot)) != 0) {
+            fprintf(stderr, "Failed to resolve path: '%s': %s\n", root_dir, strerror(errno));
+            return 1;
+        }
+        feed_fp = strcmp(g_opts.files_from, "-") == 0 ? stdin : fopen(g_opts.files_from, "r");
+        if (!feed_fp) {
+            fprintf(stderr, "Failed to open file list: '%s': %s\n", g_opts.files_from, strerror(errno));
+            return 1;
+        }
+    } else if (realpath(root_dir, fullRoot) == NULL) {
         fprintf(stderr, "Failed to resolve path: '%s': %s\n", root_dir, strerror(errno));
         return 1;
     }
 
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (g_opts.history_range) {
+        /* Blobs come from git; an interrupted pipe is reported, not fatal. */
+        signal(SIGPIPE, SIG_IGN);
+        int rc = run_history(fullRoot, g_opts.history_range, &start);
+        goline_free(g_goline);
+        if (g_opts.trace_path) {
+            trace_write(g_opts.trace_path);
+            trace_free();
+        }
+        return rc;
+    }
+
+    RunMetrics metrics;
+    memset(&metrics, 0, sizeof(metrics));
     GoFileList g;
     init_go_file_list(&g);
-    find_go_files(fullRoot, &g);
-    if (g.size == 0) {
+    if (!streaming) {
+        uint64_t t_walk = trace_begin();
+        find_go_files(fullRoot, &g);
+        trace_end("walk", t_walk, fullRoot);
+        metrics.walk = elapsed_seconds(&start);
+    }
+    if (g_opts.estimate) {
+        int rc = run_estimate(&g, fullRoot, &start);
+        if (g_opts.trace_path) {
+            trace_write(g_opts.trace_path);
+            trace_free();
+        }
+        free_go_file_list(&g);
+        return rc;
+    }
+    int interactive = (g_opts.format == FORMAT_TREE);
+    if (g.size == 0 && interactive && !streaming && !g_opts.metrics_path) {
         printf("No .go files found under: %s\n", fullRoot);
         free_go_file_list(&g);
         return 0;
     }
 
-    printf("Loading .go files...\n");
-    for (size_t i = 0; i < g.size; i++) {
-        process_one_file(g.data[i].path, &g.data[i].line_count);
-        print_progress_bar_with_filename(i + 1, g.size, g.data[i].path);
-        usleep(500000);
+    if (g_opts.dedup)
+        dedup_init();
+    if (g_opts.duplicates)
+        dup_init();
+
+    int use_report = g_opts.top_k || !interactive || g_opts.max_func_lines || g_opts.top_funcs ||
+                     g_opts.save_snapshot_path || streaming || g_opts.duplicates || g_opts.complexity ||
+                     g_opts.module_report || g_opts.stream || g_opts.tui || g_opts.metrics_path;
+    Report report;
+    if (use_report && report_init(&report, fullRoot, &g) != 0) {
+        report_free(&report);
+        free_go_file_list(&g);
+        if (feed_fp && feed_fp != stdin)
+            fclose(feed_fp);
+        return 1;
+    }
+    out_init(STDOUT_FILENO);
+    TreeLayout layout;
+    memset(&layout, 0, sizeof(layout));
+    if (g_opts.stream || g_opts.tui) {
+        if (tree_layout_init(&layout, &report) != 0) {
+            tree_layout_free(&layout);
+            report_free(&report);
+            free_go_file_list(&g);
+            return 1;
+        }
+        if (g_opts.format == FORMAT_CSV)
+            out_puts("type,path,lines,generated_lines,bytes,files\n");
     }
-    printf("\nDone.\n");
 
-    if (system("clear") != 0) {
-        fprintf(stderr, "Failed to clear the screen.\n");
+    size_t excluded = 0;
+    size_t invalid = 0;
+    size_t constrained = 0;
+    WorkPool pool;
+    if (work_pool_start(&pool, &g, layout.order, g_opts.tui, g_opts.jobs, g_opts.batch_bytes, feed_fp,
+                        g_opts.null_delim ? '\0' : '\n', fullRoot) != 0) {
+        work_pool_join(&pool);
+        work_pool_free(&pool);
+        if (use_report)
+            report_free(&report);
+        tree_layout_free(&layout);
+        free_go_file_list(&g);
+        if (feed_fp && feed_fp != stdin)
+            fclose(feed_fp);
+        return 1;
+    }
+    int progress = interactive && !g_opts.stream && !g_opts.tui;
+    if (progress)
+        printf("Loading .go files...\n");
+    Tui tui;
+    if (g_opts.tui && tui_open(&tui, &layout, &pool, &start) != 0)
+        work_pool_cancel(&pool);
+    WorkDone done;
+    memset(&done, 0, sizeof(done));
+    size_t n = 0;
+    while (g_opts.tui && g_tui_active ? tui_next(&tui, &done) : work_pool_next(&pool, &done)) {
+        size_t i = done.index;
+        int rc = done.rc;
+        if (streaming)
+            i = append_go_file(&g, &done.file);
+        else
+            g.data[i] = done.file;
+        GoFile *f = &g.data[i];
+        uint64_t t_agg = trace_begin();
+        if (rc == 1 && f->invalid) {
+            invalid++;
+            if (g_opts.invalid_files == INVALID_REPORT)
+                fprintf(stderr, "Skipped '%s': %s at offset %ld\n", f->path,
+                        f->invalid == GOLINE_SKIP_BINARY ? "NUL byte" : "invalid UTF-8", f->invalid_offset);
+        } else if (rc == 1 && f->constrained) {
+            constrained++;
+        } else if (rc == 1) {
+            excluded++;
+        } else if (rc < 0) {
+            if (f->load_error == LOAD_OPEN_FAILED)
+                metrics.open_failed++;
+            else if (f->load_error == LOAD_READ_FAILED)
+                metrics.read_failed++;
+            else
+                metrics.other_failed++;
+        } else if (rc == 0 && use_report) {
+            report_add(&report, i);
+            if (g_opts.format == FORMAT_NDJSON && !g_opts.stream)
+                emit_ndjson_file(&report, i);
+        }
+        if (g_opts.stream || g_opts.tui)
+            tree_layout_done(&layout, i, rc == 0);
+        trace_end("aggregate", t_agg, f->path);
+        if (progress)
+            print_progress_bar_with_filename(++n, work_pool_total(&pool), f->path);
+    }
+    work_pool_join(&pool);
+    g_constraint_skipped += (long)constrained;
+    if (g_opts.worker_stats)
+        print_worker_stats(&pool);
+    if (g_opts.background || g_opts.io_rate > 0 || g_opts.worker_stats)
+        print_throughput(&pool);
+    metrics.scan = pool.wall;
+    metrics.excluded = excluded;
+    metrics.invalid = invalid;
+    work_pool_totals(&pool, &metrics.files_read, &metrics.bytes_read);
+    work_pool_free(&pool);
+    if (feed_fp && feed_fp != stdin)
+        fclose(feed_fp);
+    if (g_opts.tui) {
+        int rc = g_tui_active ? 0 : 1;
+        if (g_tui_active) {
+            if (!tui.quit)
+                tui_browse(&tui);
+            tui_close(&tui);
+        }
+        out_close();
+        if (g_opts.trace_path) {
+            trace_write(g_opts.trace_path);
+            trace_free();
+        }
+        report_free(&report);
+        tree_layout_free(&layout);
+        free_modules();
+        goline_free(g_goline);
+        free_go_file_list(&g);
+        return rc;
+    }
+    if (g_opts.duplicates) {
+        uint64_t t_dup = trace_begin();
+        dup_finish();
+        dup_aggregate(report.root, &g);
+        trace_end("duplicates", t_dup, NULL);
+    }
+    if (g.size == 0 && interactive) {
+        printf("No .go files found under: %s\n", fullRoot);
+        int rc = 0;
+        if (g_opts.metrics_path) {
+            metrics.total = elapsed_seconds(&start);
+            if (write_metrics(g_opts.metrics_path, &report, &metrics) != 0)
+                rc = 1;
+        }
+        report_free(&report);
+        if (g_opts.dedup)
+            dedup_free();
+        if (g_opts.duplicates)
+            dup_free();
+        free_go_file_list(&g);
+        return rc;
     }
 
-    printf("Total .go files: %zu\n\n", g.size);
-    print_tree_only_go(fullRoot, "", 1, &g);
+    uint64_t t_out = trace_begin();
+    struct timespec out_start;
+    clock_gettime(CLOCK_MONOTONIC, &out_start);
+    if (g_opts.save_counts_path)
+        save_counts(g_opts.save_counts_path, &g, strlen(fullRoot));
+    if (g_opts.save_snapshot_path)
+        save_snapshot(g_opts.save_snapshot_path, &report, g_opts.stream ? &layout : NULL);
 
+    if (interactive) {
+        if (g_opts.stream) {
+            out_puts("\n");
+        } else {
+            printf("\nDone.\n");
+            fflush(stdout);
+            if (system("clear") != 0) {
+                fprintf(stderr, "Failed to clear the screen.\n");
+            }
+        }
+
+        out_printf("Total .go files: %zu", g.size - excluded - invalid - constrained);
+        if (excluded > 0 && invalid > 0)
+            out_printf(" (%zu excluded by generated-file filter, %zu binary or invalid UTF-8)", excluded, invalid);
+        else if (excluded > 0)
+            out_printf(" (%zu excluded by generated-file filter)", excluded);
+        else if (invalid > 0)
+            out_printf(" (%zu binary or invalid UTF-8)", invalid);
+        out_puts("\n");
+        if (g_opts.no_nested_modules && g_modules_skipped > 0)
+            out_printf("Skipped %ld nested modules\n", g_modules_skipped);
+        if (g_opts.no_vendor && g_vendor_skipped > 0)
+            out_printf("Skipped %ld vendor trees\n", g_vendor_skipped);
+        if (g_opts.no_tests && g_tests_skipped > 0)
+            out_printf("Skipped %ld test files\n", g_tests_skipped);
+        if (build_filtering())
+            out_printf("Skipped %ld files not built for %s/%s\n", g_constraint_skipped, g_opts.goos, g_opts.goarch);
+        out_puts("\n");
+        if (g_opts.stream) {
+            /* The tree is already out. */
+        } else if (g_opts.top_k) {
+            print_top_report(&report);
+        } else if (g_opts.module_report) {
+            print_module_report(&report);
+        } else if (streaming || g_opts.duplicates || g_opts.complexity) {
+            report_sort(report.root, &g);
+            print_report_tree(report.root, "", 1, &g);
+        } else {
+            print_tree_only_go(fullRoot, "", 1, &g);
+        }
+        if (g_opts.max_func_lines || g_opts.top_funcs || g_opts.max_complexity)
+            print_func_report(&report);
+        if (g_opts.duplicates)
+            print_dup_report(&report);
+
+        if (g_opts.dedup) {
+            out_printf("\nDedup: %ld duplicate files, %lld bytes not lexed (%zu unique contents)\n",
+                       g_dedup_files_saved, g_dedup_bytes_saved, dedup_unique_count());
+        }
+    } else {
+        emit_machine_report(&report, excluded, invalid);
+    }
+    out_close();
+    trace_end("output", t_out, NULL);
+    if (g_opts.trace_path) {
+        trace_write(g_opts.trace_path);
+        trace_free();
+    }
+
+    int rc = 0;
+    if (g_opts.metrics_path) {
+        metrics.output = elapsed_seconds(&out_start);
+        metrics.total = elapsed_seconds(&start);
+        if (write_metrics(g_opts.metrics_path, &report, &metrics) != 0)
+            rc = 1;
+    }
+    if (use_report) {
+        if (rc == 0 && (report.nlong_funcs > 0 || report.ncomplex_funcs > 0))
+            rc = 2;
+        report_free(&report);
+    }
+    if (g_opts.dedup)
+        dedup_free();
+    if (g_opts.duplicates)
+        dup_free();
+    free_modules();
+    goline_free(g_goline);
+    tree_layout_free(&layout);
     free_go_file_list(&g);
-    return 0;
+    return rc;
 }
-
@@ -0,0 +1,512 @@
+// tests/libgoline_test.c
+
+/*
+ * Tests for the libgoline API: counts against the goline command, two
+ * contexts driven from several threads at once, and the allocator hook.
+ * Also checks the snapshots goline saves with and without --stream.
+ *
+ * Usage: libgoline_test GOLINE_BINARY TESTDATA_DIR
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "goline.h"
+
+#define MAX_FILES 64
+#define THREAD_ROUNDS 40
+
+static int g_failures;
+
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            g_failures++;                                                           \
+        }                                                                           \
+    } while (0)
+
+typedef struct {
+    char *path;
+    char *data;
+    size_t len;
+} Fixture;
+
+static Fixture g_files[MAX_FILES];
+static size_t g_nfiles;
+static const char *g_root;
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = (char*)malloc((size_t)size + 1);
+    if (buf && fread(buf, 1, (size_t)size, fp) != (size_t)size) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    *len = (size_t)size;
+    return buf;
+}
+
+static int collect_file(void *user, int event, const goline_walk_entry *e) {
+    (void)user;
+    if (event == GOLINE_WALK_FILE && g_nfiles < MAX_FILES) {
+        Fixture *f = &g_files[g_nfiles++];
+        f->path = strdup(e->path);
+        f->data = read_file(e->path, &f->len);
+        CHECK(f->path && f->data);
+        CHECK(f->len == (size_t)e->size);
+    }
+    return 0;
+}
+
+static int collect_none(void *user, int event, const goline_walk_entry *e) {
+    (void)user;
+    (void)event;
+    (void)e;
+    return 0;
+}
+
+static goline_ctx *new_ctx(int generated, const char *goos, int jobs) {
+    goline_options o;
+    goline_options_init(&o);
+    o.generated = generated;
+    o.goos = goos;
+    o.goarch = goos ? "amd64" : NULL;
+    o.jobs = jobs;
+    goline_ctx *ctx = NULL;
+    CHECK(goline_new(&o, &ctx) == GOLINE_OK);
+    return ctx;
+}
+
+/* Lines and files of the CLI's root row, and the lines of one file row when file is set. */
+static int cli_counts(const char *bin, const char *flags, const char *file, long *lines, long *files) {
+    char cmd[4096];
+    snprintf(cmd, sizeof(cmd), "'%s' --format=csv %s '%s'", bin, flags, g_root);
+    FILE *fp = popen(cmd, "r");
+    if (!fp)
+        return -1;
+    char row[4096];
+    int found = 0;
+    while (fgets(row, sizeof(row), fp)) {
+        char path[2048];
+        long l, g, b, n;
+        if (sscanf(row, "dir,%2047[^,],%ld,%ld,%ld,%ld", path, &l, &g, &b, &n) == 5 && !file &&
+            strcmp(path, ".") == 0) {
+            *lines = l;
+            *files = n;
+            found = 1;
+        } else if (sscanf(row, "file,%2047[^,],%ld,%ld,%ld,%ld", path, &l, &g, &b, &n) == 5 && file &&
+                   strcmp(path, file) == 0) {
+            *lines = l;
+            *files = n;
+            found = 1;
+        }
+    }
+    int status = pclose(fp);
+    return status == 0 && found ? 0 : -1;
+}
+
+/* Snippets with known counts, through every counting entry point. */
+static void test_snippets(void) {
+    static const struct {
+        const char *code;
+        long lines;
+    } cases[] = {
+        { "", 0 },
+        { "package a\n", 1 },
+        { "package a\n// x\n\nvar s = `a\n/* b */`\n/* c\n*/ x := 1\n", 4 },
+        { "/* a */ /* b */\n  \t\n//c\nx /* y\nz */ w\n", 2 },
+        { "s := \"\\\"/*\" // q\nr := '\\''\n", 2 },
+        { "package a\r\n\r\nvar x = 1 // c\r\n", 2 },
+    };
+    goline_ctx *ctx = new_ctx(GOLINE_GENERATED_ALL, NULL, 1);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const char *code = cases[i].code;
+        size_t len = strlen(code);
+        char out[256];
+        long out_len = goline_strip_comments(code, len, out, sizeof(out));
+        CHECK(goline_count_code_lines(out, (size_t)out_len) == cases[i].lines);
+        CHECK(goline_count_lines(code, len, len) == cases[i].lines);
+        goline_result res;
+        CHECK(goline_count_buffer(ctx, code, len, &res) == GOLINE_OK);
+        CHECK(res.status == GOLINE_COUNTED && res.lines == cases[i].lines);
+    }
+    goline_free(ctx);
+}
+
+/* goline_count_buffer() and goline_count_file() agree with the CLI file by file. */
+static void test_buffer_matches_cli(const char *bin) {
+    goline_ctx *ctx = new_ctx(GOLINE_GENERATED_ALL, NULL, 1);
+    size_t root_len = strlen(g_root);
+    for (size_t i = 0; i < g_nfiles; i++) {
+        const Fixture *f = &g_files[i];
+        goline_result buf_res, file_res;
+        CHECK(goline_count_buffer(ctx, f->data, f->len, &buf_res) == GOLINE_OK);
+        CHECK(goline_count_file(ctx, f->path, &file_res) == GOLINE_OK);
+        CHECK(memcmp(&buf_res, &file_res, sizeof(buf_res)) == 0);
+        long lines = -1, files = 0;
+        CHECK(cli_counts(bin, "", f->path + root_len + 1, &lines, &files) == 0);
+        CHECK(buf_res.status == GOLINE_COUNTED && buf_res.lines == lines);
+        if (buf_res.lines != lines)
+            fprintf(stderr, "  %s: library %ld, goline %ld\n", f->path, buf_res.lines, lines);
+    }
+    goline_free(ctx);
+}
+
+/* Root totals of goline_scan() and of goline_count_file() sums against the CLI, per filter. */
+static void test_filters_match_cli(const char *bin) {
+    static const struct {
+        const char *flags;
+        int generated;
+        const char *goos;
+    } modes[] = {
+        { "", GOLINE_GENERATED_ALL, NULL },
+        { "--skip-generated", GOLINE_GENERATED_SKIP, NULL },
+        { "--generated-only", GOLINE_GENERATED_ONLY, NULL },
+        { "--goos=linux --goarch=amd64", GOLINE_GENERATED_ALL, "linux" },
+        { "--goos=windows --goarch=amd64", GOLINE_GENERATED_ALL, "windows" },
+    };
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        long cli_lines = -1, cli_files = -1;
+        CHECK(cli_counts(bin, modes[m].flags, NULL, &cli_lines, &cli_files) == 0);
+        goline_ctx *ctx = new_ctx(modes[m].generated, modes[m].goos, 1);
+        long lines = 0, files = 0;
+        for (size_t i = 0; i < g_nfiles; i++) {
+            goline_result res;
+            CHECK(goline_count_file(ctx, g_files[i].path, &res) == GOLINE_OK);
+            if (res.status == GOLINE_COUNTED) {
+                lines += res.lines;
+                files++;
+            }
+        }
+        CHECK(lines == cli_lines && files == cli_files);
+        CHECK(goline_scan(ctx, g_root, NULL, NULL) == GOLINE_OK);
+        const goline_dir *tree = goline_tree(ctx);
+        CHECK(tree && tree->lines == cli_lines && tree->files == cli_files);
+        if (lines != cli_lines)
+            fprintf(stderr, "  %s: library %ld, goline %ld\n", modes[m].flags, lines, cli_lines);
+        goline_free(ctx);
+    }
+}
+
+/* The helpers the CLI shares with the walker and the counting entry points. */
+static void test_helpers(void) {
+    CHECK(goline_is_go_file("a.go") && goline_is_go_file("dir/B.GO"));
+    CHECK(!goline_is_go_file(".go") && !goline_is_go_file("a.gox") && !goline_is_go_file("go"));
+    CHECK(goline_bom_len("\xEF\xBB\xBFpackage a", 12) == 3);
+    CHECK(goline_bom_len("\xEF\xBB", 2) == 0 && goline_bom_len("package a", 9) == 0);
+
+    goline_options o;
+    goline_options_init(&o);
+    o.jobs = 4;
+    o.split_threshold = 2 << 20;
+    goline_ctx *ctx = NULL;
+    CHECK(goline_new(&o, &ctx) == GOLINE_OK);
+    if (ctx) {
+        CHECK(goline_split_chunks(ctx, 1 << 20) == 1);
+        CHECK(goline_split_chunks(ctx, 3 << 20) == 3);
+        CHECK(goline_split_chunks(ctx, 64 << 20) == 4);
+        goline_free(ctx);
+    }
+    ctx = new_ctx(GOLINE_GENERATED_ALL, NULL, 1);
+    CHECK(goline_split_chunks(ctx, 64 << 20) == 1);
+
+    /* Listed files share the walk's visited set: a walked file is no longer fresh. */
+    CHECK(goline_visit(ctx, g_files[0].path) == 1);
+    CHECK(goline_visit(ctx, g_files[0].path) == 0);
+    CHECK(goline_visit(ctx, g_root) == 0);
+    CHECK(goline_visit(ctx, "/nonexistent/a.go") == GOLINE_EOPEN);
+    CHECK(goline_walk(ctx, g_root, collect_none, NULL) == GOLINE_OK);
+    for (size_t i = 0; i < g_nfiles; i++)
+        CHECK(goline_visit(ctx, g_files[i].path) == 0);
+    goline_free(ctx);
+}
+
+/* First line of a command's output, or "" when it failed. */
+static void first_line(const char *cmd, char *line, size_t size) {
+    line[0] = '\0';
+    FILE *fp = popen(cmd, "r");
+    if (!fp)
+        return;
+    if (!fgets(line, (int)size, fp))
+        line[0] = '\0';
+    char rest[256];
+    while (fgets(rest, sizeof(rest), fp))
+        ;
+    if (pclose(fp) != 0)
+        line[0] = '\0';
+}
+
+/*
+ * --stream lays out every walked file before counting; the snapshot it saves
+ * still holds only the counted files, the same as without --stream.
+ */
+static void test_stream_snapshot(const char *bin) {
+    static const char *const flags[] = {
+        "",
+        "--skip-generated",
+        "--generated-only",
+        "--goos=windows --goarch=amd64 --no-tests",
+    };
+    char dir[] = "/tmp/libgoline_testXXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char plain[64], stream[64];
+    snprintf(plain, sizeof(plain), "%s/plain.snap", dir);
+    snprintf(stream, sizeof(stream), "%s/stream.snap", dir);
+    for (size_t m = 0; m < sizeof(flags) / sizeof(flags[0]); m++) {
+        char cmd[4096], line[256];
+        snprintf(cmd, sizeof(cmd),
+                 "'%s' --format=csv %s --save-snapshot='%s' '%s' >/dev/null && "
+                 "'%s' --format=csv %s --stream --save-snapshot='%s' '%s' >/dev/null && "
+                 "'%s' diff '%s' '%s'",
+                 bin, flags[m], plain, g_root, bin, flags[m], stream, g_root, bin, plain, stream);
+        first_line(cmd, line, sizeof(line));
+        CHECK(strcmp(line, "No changes.\n") == 0);
+        if (strcmp(line, "No changes.\n") != 0)
+            fprintf(stderr, "  '%s': %s", flags[m], line[0] ? line : "goline failed\n");
+    }
+    remove(plain);
+    remove(stream);
+    rmdir(dir);
+}
+
+typedef struct {
+    goline_ctx *ctx;
+    int scan;
+    goline_result expect[MAX_FILES];
+    long tree_lines;
+    long tree_files;
+    const char *big;
+    size_t big_len;
+    long big_lines;
+    int failures;
+} Worker;
+
+static void *worker_run(void *arg) {
+    Worker *w = (Worker*)arg;
+    for (int round = 0; round < THREAD_ROUNDS; round++) {
+        for (size_t i = 0; i < g_nfiles; i++) {
+            goline_result res;
+            if (goline_count_buffer(w->ctx, g_files[i].data, g_files[i].len, &res) != GOLINE_OK ||
+                memcmp(&res, &w->expect[i], sizeof(res)) != 0)
+                w->failures++;
+        }
+        if (goline_count_lines_split(w->ctx, w->big, w->big_len, 4) != w->big_lines)
+            w->failures++;
+        if (w->scan && round % 4 == 0) {
+            const goline_dir *tree;
+            if (goline_scan(w->ctx, g_root, NULL, NULL) != GOLINE_OK || !(tree = goline_tree(w->ctx)) ||
+                tree->lines != w->tree_lines || tree->files != w->tree_files)
+                w->failures++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Two contexts with different filters, each scanned by one thread and
+ * counted by another, all at once. Every result has to match what the same
+ * context gave on its own.
+ */
+static void test_reentrant(void) {
+    goline_ctx *ctxs[2] = {
+        new_ctx(GOLINE_GENERATED_SKIP, "linux", 4),
+        new_ctx(GOLINE_GENERATED_ONLY, "windows", 3),
+    };
+    size_t big_len = 2 << 20;
+    char *big = (char*)malloc(big_len);
+    CHECK(big != NULL);
+    if (!ctxs[0] || !ctxs[1] || !big)
+        return;
+    for (size_t pos = 0, i = 0; pos < big_len; i++) {
+        const Fixture *f = &g_files[i % g_nfiles];
+        size_t n = f->len < big_len - pos ? f->len : big_len - pos;
+        memcpy(big + pos, f->data, n);
+        pos += n;
+    }
+    long big_lines = goline_count_lines(big, big_len, big_len);
+
+    Worker workers[4];
+    memset(workers, 0, sizeof(workers));
+    for (int k = 0; k < 4; k++) {
+        Worker *w = &workers[k];
+        w->ctx = ctxs[k % 2];
+        w->scan = k < 2;
+        w->big = big;
+        w->big_len = big_len;
+        w->big_lines = big_lines;
+        for (size_t i = 0; i < g_nfiles; i++)
+            CHECK(goline_count_buffer(w->ctx, g_files[i].data, g_files[i].len, &w->expect[i]) == GOLINE_OK);
+        CHECK(goline_scan(w->ctx, g_root, NULL, NULL) == GOLINE_OK);
+        w->tree_lines = goline_tree(w->ctx)->lines;
+        w->tree_files = goline_tree(w->ctx)->files;
+    }
+    CHECK(workers[0].tree_lines != workers[1].tree_lines);
+
+    pthread_t threads[4];
+    for (int k = 0; k < 4; k++)
+        CHECK(pthread_create(&threads[k], NULL, worker_run, &workers[k]) == 0);
+    for (int k = 0; k < 4; k++) {
+        pthread_join(threads[k], NULL);
+        CHECK(workers[k].failures == 0);
+    }
+    goline_free(ctxs[0]);
+    goline_free(ctxs[1]);
+    free(big);
+}
+
+/* realloc()-style hook that counts live blocks and fails the fail_at-th call. */
+typedef struct {
+    long calls;
+    long live;
+    long fail_at;
+} AllocStats;
+
+static void *counting_alloc(void *user, void *ptr, size_t size) {
+    AllocStats *s = (AllocStats*)user;
+    if (size == 0) {
+        if (ptr)
+            s->live--;
+        free(ptr);
+        return NULL;
+    }
+    if (++s->calls == s->fail_at)
+        return NULL;
+    void *p = realloc(ptr, size);
+    if (p && !ptr)
+        s->live++;
+    return p;
+}
+
+/* Everything a context allocates, ending with goline_free(). Returns the first failure code. */
+static int alloc_workload(AllocStats *stats) {
+    goline_options o;
+    goline_options_init(&o);
+    o.alloc = counting_alloc;
+    o.alloc_user = stats;
+    o.goos = "linux";
+    o.tags = "netgo";
+    o.jobs = 2;
+    goline_ctx *ctx;
+    int rc = goline_new(&o, &ctx);
+    if (rc != GOLINE_OK)
+        return rc;
+    for (int pass = 0; pass < 2 && rc == GOLINE_OK; pass++)
+        rc = goline_scan(ctx, g_root, NULL, NULL);
+    for (size_t i = 0; i < g_nfiles && rc == GOLINE_OK; i++) {
+        goline_result res;
+        rc = goline_count_file(ctx, g_files[i].path, &res);
+        char *out = (char*)malloc(g_files[i].len + 1);
+        goline_funcs funcs;
+        if (rc == GOLINE_OK && out) {
+            long n = goline_strip_funcs(ctx, g_files[i].data, g_files[i].len, out, g_files[i].len + 1, 1, &funcs);
+            if (n < 0)
+                rc = (int)n;
+            else
+                goline_funcs_free(ctx, &funcs);
+        }
+        free(out);
+    }
+    goline_free(ctx);
+    return rc;
+}
+
+/*
+ * All of a context's memory comes from the hook and goes back to it, also
+ * when any single allocation fails. Caches may do without a failed
+ * allocation; everything else reports GOLINE_ENOMEM.
+ */
+static void test_allocator(void) {
+    AllocStats stats = { 0, 0, 0 };
+    CHECK(alloc_workload(&stats) == GOLINE_OK);
+    CHECK(stats.calls > 0);
+    CHECK(stats.live == 0);
+    long total = stats.calls, failed = 0;
+    for (long n = 1; n <= total; n++) {
+        AllocStats failing = { 0, 0, n };
+        int rc = alloc_workload(&failing);
+        failed += (rc == GOLINE_ENOMEM);
+        if ((rc != GOLINE_OK && rc != GOLINE_ENOMEM) || failing.live != 0) {
+            fprintf(stderr, "  failing allocation %ld of %ld: rc %d, %ld blocks left\n", n, total, rc, failing.live);
+            g_failures++;
+            break;
+        }
+    }
+    CHECK(failed > 0);
+}
+
+/* The spans and decision points goline_strip_funcs() reports for funcs.go. */
+static void test_funcs(void) {
+    const Fixture *f = NULL;
+    for (size_t i = 0; i < g_nfiles; i++) {
+        const char *slash = strrchr(g_files[i].path, '/');
+        if (slash && strcmp(slash + 1, "funcs.go") == 0)
+            f = &g_files[i];
+    }
+    CHECK(f != NULL);
+    if (!f)
+        return;
+    goline_ctx *ctx = new_ctx(GOLINE_GENERATED_ALL, NULL, 1);
+    char *out = (char*)malloc(f->len + 1);
+    goline_funcs funcs;
+    long n = goline_strip_funcs(ctx, f->data, f->len, out, f->len + 1, 1, &funcs);
+    CHECK(n > 0);
+    CHECK(funcs.nfuncs == 3);
+    if (n > 0 && funcs.nfuncs == 3) {
+        CHECK(strcmp(funcs.funcs[0].name, "point.Len") == 0);
+        CHECK(funcs.funcs[0].line == 7 && funcs.funcs[0].lines == 6 && funcs.funcs[0].complexity == 3);
+        CHECK(strcmp(funcs.funcs[1].name, "sum") == 0);
+        CHECK(funcs.funcs[1].line == 14 && funcs.funcs[1].lines == 13 && funcs.funcs[1].complexity == 5);
+        CHECK(strcmp(funcs.funcs[2].name, "origin") == 0 && funcs.funcs[2].lines == 1);
+        CHECK(funcs.decisions == 6);
+    }
+    goline_funcs_free(ctx, &funcs);
+    CHECK(funcs.funcs == NULL && funcs.nfuncs == 0);
+    free(out);
+    goline_free(ctx);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s GOLINE_BINARY TESTDATA_DIR\n", argv[0]);
+        return 2;
+    }
+    g_root = argv[2];
+    goline_ctx *ctx = new_ctx(GOLINE_GENERATED_ALL, NULL, 1);
+    if (!ctx || goline_walk(ctx, g_root, collect_file, NULL) != GOLINE_OK || g_nfiles == 0) {
+        fprintf(stderr, "No test files under '%s'\n", g_root);
+        return 1;
+    }
+    goline_free(ctx);
+
+    test_snippets();
+    test_helpers();
+    test_buffer_matches_cli(argv[1]);
+    test_filters_match_cli(argv[1]);
+    test_stream_snapshot(argv[1]);
+    test_funcs();
+    test_reentrant();
+    test_allocator();
+
+    for (size_t i = 0; i < g_nfiles; i++) {
+        free(g_files[i].path);
+        free(g_files[i].data);
+    }
+    if (g_failures) {
+        fprintf(stderr, "%d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("libgoline: all tests passed (%zu files)\n", g_nfiles);
+    return 0;
+}
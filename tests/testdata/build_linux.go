@@ -0,0 +1,5 @@
+//go:build linux && amd64
+
+package comments
+
+const onLinux = true
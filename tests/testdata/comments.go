@@ -0,0 +1,26 @@
+// Package comments mixes comments with code and literals.
+package comments
+
+/*
+A block comment
+over several lines.
+*/
+
+import "fmt" // trailing comment
+
+var raw = `a raw string
+// that looks like a comment
+/* and a block */`
+
+var quoted = "/* not a comment */ // nor this"
+
+var r1, r2 = '"', '\''
+
+/* code after */ var after = 1
+
+var x = 1 /* inline */ + 2 /*
+spans lines */ + 3
+
+func Print() {
+	fmt.Println(raw, quoted, r1, r2, after, x) // done
+}
@@ -0,0 +1,31 @@
+package comments
+
+type point struct {
+	x, y int
+}
+
+func (p *point) Len() int {
+	if p.x > 0 && p.y > 0 {
+		return p.x + p.y
+	}
+	return 0
+}
+
+func sum(xs []int) int {
+	total := 0
+	for _, x := range xs {
+		switch {
+		case x > 10 || x < -10:
+			total += x
+		case x == 0:
+		default:
+			total--
+		}
+	}
+	return total
+}
+
+func origin() point { return point{} }
+
+//go:noescape
+func stub(x int) int
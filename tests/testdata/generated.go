@@ -0,0 +1,7 @@
+// Code generated by hand for the tests. DO NOT EDIT.
+
+package comments
+
+var table = []int{
+	1, 2, 3,
+}
@@ -0,0 +1,7 @@
+package pkg
+
+import "testing"
+
+func TestNothing(t *testing.T) {
+	// nothing to do
+}
@@ -0,0 +1,6 @@
+﻿package sub
+
+// comment
+func F() int {
+	return 1 /* one */
+}